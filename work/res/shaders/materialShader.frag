@@ -1,28 +1,65 @@
-#version 120
+#version 330 core
+
+// Per-frame constants, see FrameConstants in frame_uniforms.hpp
+layout(std140) uniform FrameConstants {
+	mat4 projection;
+	mat4 view;
+	mat4 reflectionViewProjection;
+	mat4 refractionViewProjection;
+	vec4 viewpos;
+	vec4 lightpos;
+	vec4 waterColor;
+	float distort;
+	float invDistort;
+};
 
 uniform float maxHeight;
 uniform float minHeight;
 
-varying vec3 vNormal;
-varying vec3 vPosition;
-varying float height;
+// Cached shadow maps, see ShadowMap
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[4];	// world to shadow map, one per cascade
+uniform vec4 shadowRegions[4];	// xz centre and half width of each cascade
+uniform int shadowCascades;		// 0 when shadows are off
+uniform float shadowTexel;
+
+in vec3 vNormal;
+in vec3 vPosition;
+in float height;
+in float vAmbient;
+
+out vec4 fragColor;
+
+// How lit the fragment is, from the smallest cascade it is well inside,
+// filtered over 3x3 texels
+float shadow() {
+	for (int i = 0; i < shadowCascades; i++) {
+		vec2 d = abs(vPosition.xz - shadowRegions[i].xy);
+		if (i < shadowCascades - 1 && max(d.x, d.y) > shadowRegions[i].z * 0.9) continue;
+		vec4 p = shadowMatrices[i] * vec4(vPosition, 1.0);
+		float lit = 0.0;
+		for (int y = -1; y <= 1; y++) {
+			for (int x = -1; x <= 1; x++) {
+				lit += texture(shadowMap, vec4(p.xy + vec2(x, y) * shadowTexel, float(i), p.z));
+			}
+		}
+		return lit / 9.0;
+	}
+	return 1.0;
+}
 
 void main() {
 	
-	vec3 L = normalize(gl_LightSource[0].position.xyz - vPosition);   
-	vec3 E = normalize(-vPosition); // we are in Eye Coordinates, so EyePos is (0,0,0)  
-	vec3 R = normalize(-reflect(L,vNormal));      
-
-	// calculate Specular Term:
-	vec4 Ispec = gl_FrontLightProduct[0].specular * pow(max(dot(R,E),0.0),0.3*3);
-	Ispec = clamp(Ispec, 0.0, 1.0);
+	vec3 N = normalize(vNormal);
+	vec3 L = normalize(lightpos.xyz - vPosition); // we are in World Coordinates
     
     float scaledHeight = ( (height-minHeight) / (maxHeight-minHeight) );
 	// write Total Color:
     vec3 color; // Sand
-    float lightFactor = dot(vNormal,L);
+    float lightFactor = max(dot(N,L), 0.0) * shadow();
 
-    lightFactor *= 2;
+    // valleys are lit less, by the direct light as well as the ambient
+    lightFactor = lightFactor * 2 * mix(0.5, 1.0, vAmbient) + 0.25 * vAmbient;
     
     if (scaledHeight < 0.1) {
         // sand
@@ -37,5 +74,5 @@ void main() {
         // snow
         color = vec3(1, 1, 1) * lightFactor;
     }
-    gl_FragColor = vec4(color, 1) + Ispec;
+    fragColor = vec4(color, 1);
 }
@@ -1,23 +1,75 @@
-#version 120
+#version 330 core
 
-uniform float maxHeight;
-uniform float minHeight;
+// Per-frame constants, see FrameConstants in frame_uniforms.hpp
+layout(std140) uniform FrameConstants {
+	mat4 projection;
+	mat4 view;
+	mat4 reflectionViewProjection;
+	mat4 refractionViewProjection;
+	vec4 viewpos;
+	vec4 lightpos;
+	vec4 waterColor;
+	float distort;
+	float invDistort;
+};
 
-varying vec3 vNormal;
-varying vec3 vPosition;
-varying float height;
+// Per-pass constants, see PassConstants in frame_uniforms.hpp
+layout(std140) uniform PassConstants {
+	mat4 viewProjection;
+	vec4 clipPlane;
+};
+
+// Grid position of the patch being drawn, one per instance. Each vertex
+// of the shared patch mesh finds its place in the patch from gl_VertexID.
+layout(location = 0) in ivec2 aPatchOrigin;
+
+uniform sampler2D heightMap;		// world heights, already shaped by Terrain::heightModifier
+uniform sampler2D previousHeightMap;	// the heights before a reseed
+uniform sampler2D normalMap;		// octahedral encoded normals
+uniform sampler2D ambientMap;		// ambient occlusion baked from the horizons, 1 for open sky
+uniform sampler2D previousAmbientMap;
+
+// blend from the previous terrain's heights after a reseed, 1 when done
+uniform float heightBlend;
+
+uniform int patchSize;
+uniform ivec2 gridSize;
+uniform float gridSpacing;
+uniform vec3 gridOrigin;
+
+out vec3 vNormal;
+out vec3 vPosition;
+out float height;
+out float vAmbient;
+
+vec3 decodeNormal(vec2 e) {
+	vec3 n = vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y);
+	float t = max(-n.y, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.z += n.z >= 0.0 ? -t : t;
+	return normalize(n);
+}
 
 void main() {
+	// patches past the far edge of the grid collapse onto it
+	ivec2 local = ivec2(gl_VertexID % (patchSize + 1), gl_VertexID / (patchSize + 1));
+	ivec2 grid = min(aPatchOrigin + local, gridSize - 1);
 
-	gl_ClipVertex = gl_ModelViewMatrix * gl_Vertex;
+	float y = texelFetch(heightMap, grid, 0).r;
+	float previous = texelFetch(previousHeightMap, grid, 0).r;
+	y = mix(previous, y, heightBlend);
+	vec4 position = vec4(gridOrigin + vec3(grid.x * gridSpacing, y, grid.y * gridSpacing), 1.0);
+
+	// water reflection/refraction passes cut the terrain at the water plane
+	gl_ClipDistance[0] = dot(position, clipPlane);
     
-    height = gl_Vertex.y;
+    height = position.y;
 	
-	// Transform and pass on the normal/position to fragment shader
-	vNormal = normalize(gl_NormalMatrix * gl_Normal);
-	vPosition = vec3(gl_ModelViewMatrix * gl_Vertex);
+	// Pass on the world space normal/position to fragment shader
+	vNormal = decodeNormal(texelFetch(normalMap, grid, 0).rg);
+	vPosition = position.xyz;
+	vAmbient = mix(texelFetch(previousAmbientMap, grid, 0).r, texelFetch(ambientMap, grid, 0).r, heightBlend);
 
 	// IMPORTANT tell OpenGL where the vertex is
-	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+	gl_Position = viewProjection * position;
 }
-
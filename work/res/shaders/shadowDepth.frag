@@ -0,0 +1,6 @@
+#version 330 core
+
+// Depth only, for the shadow map. Paired with materialShader.vert so the
+// terrain is placed exactly as it is drawn.
+void main() {
+}
@@ -1,18 +1,35 @@
-#version 120
+#version 330 core
+
+// Per-frame constants, see FrameConstants in frame_uniforms.hpp
+layout(std140) uniform FrameConstants {
+	mat4 projection;
+	mat4 view;
+	mat4 reflectionViewProjection;
+	mat4 refractionViewProjection;
+	vec4 viewpos;
+	vec4 lightpos;
+	vec4 waterColor;
+	float distort;
+	float invDistort;
+};
 
 uniform sampler2D reflectionTexture;
 uniform sampler2D refractionTexture;
 uniform sampler2D normalMap;
 uniform sampler2D dudvMap;
 uniform sampler2D depthTexture;
+uniform sampler2D slopeMap;
 
-uniform vec4 waterColor;
+in vec4 toLightV;		// vector to light 
+in vec4 firstDistort;	// first distort values
+in vec4 secondDistort;	// second distort values
+in vec4 reflectionClip;	// clip space coords for projecting the reflection
+in vec4 refractionClip;	// clip space coords for projecting the refraction
+in vec4 toViewV;		// vector to camera
+in vec2 oceanCoord;		// where the tile is in the FFT ocean
+in float waterDepth;	// of the shallow water, none where the ground is dry
 
-varying vec4 toLightV;		// vector to light 
-varying vec4 firstDistort;	// first distort values
-varying vec4 secondDistort;	// second distort values
-varying vec4 clipSpace;		// clip space coords for projection
-varying vec4 toViewV;		// vector to camera
+out vec4 fragColor;
 
 void main(void) {
 	// dudv scalars
@@ -24,38 +41,41 @@ void main(void) {
 	const vec4 two = vec4(2.0, 2.0, 2.0, 1.0);
 	const vec4 mone = vec4(-1.0, -1.0, -1.0, 1.0);
 	const vec4 ofive = vec4(0.5,0.5,0.5,1.0);
+	// strength of the normal map ripples over the FFT waves
+	const float detail = 0.3;
 	// specular exponent for specular highlight
 	const float specExp = 64.0;
 	// fog exponent (higher = less water fog)
 	const float fogExp = 100;
 
+	// dry ground has no water over it
+	if (waterDepth < 0.005) discard;
+
 	vec4 lightTS = normalize(toLightV);
 	vec4 viewt = normalize(toViewV);
 	
-	vec4 disdis = texture2D(dudvMap, vec2(secondDistort * tscale));
-	vec4 totalDist = texture2D(dudvMap, vec2(firstDistort + disdis*sca2));
+	vec4 disdis = texture(dudvMap, vec2(secondDistort * tscale));
+	vec4 totalDist = texture(dudvMap, vec2(firstDistort + disdis*sca2));
 	totalDist = totalDist * two + mone;
 	totalDist = normalize(totalDist);
 	totalDist *= sca;
 
-	//load normalmap
-	vec4 normal = texture2D(normalMap, vec2(firstDistort + disdis*sca2));
-	normal = (normal-ofive) * two;
-	normal = normalize(normal);
+	//load normalmap as ripples over the FFT wave slopes, in tangent space
+	vec4 ripple = texture(normalMap, vec2(firstDistort + disdis*sca2));
+	ripple = (ripple-ofive) * two;
+	vec2 slope = texture(slopeMap, oceanCoord).xy;
+	vec4 normal = vec4(normalize(vec3(-slope, 1.0) + vec3(ripple.xy * detail, 0.0)), 0.0);
 
-	//get projective texcoords
-	vec4 tmp = vec4(1.0 / clipSpace.w);
-
-	vec4 projCoord = clipSpace * tmp;
-	projCoord += vec4(1.0);
-	projCoord *= vec4(0.5);
-	tmp = projCoord + totalDist;
-	tmp = clamp(tmp, 0.001, 0.999);
+	//get projective texcoords, one per pass as they may be from different frames
+	vec2 reflCoord = reflectionClip.xy / reflectionClip.w * 0.5 + 0.5;
+	vec2 refrCoord = refractionClip.xy / refractionClip.w * 0.5 + 0.5;
+	reflCoord = clamp(reflCoord + totalDist.xy, 0.001, 0.999);
+	refrCoord = clamp(refrCoord + totalDist.xy, 0.001, 0.999);
 
 	//load reflection,refraction and depth texture
-	vec4 refl = texture2D(reflectionTexture, vec2(tmp));
-	vec4 refr = texture2D(refractionTexture, vec2(tmp));
-	vec4 wdepth = texture2D(depthTexture, vec2(tmp));
+	vec4 refl = texture(reflectionTexture, reflCoord);
+	vec4 refr = texture(refractionTexture, refrCoord);
+	vec4 wdepth = texture(depthTexture, refrCoord);
 
 	wdepth = vec4(pow(wdepth.x, fogExp));
 	vec4 invdepth = 1.0 - wdepth;
@@ -78,7 +98,5 @@ void main(void) {
 	refl *= fres;
 
 	//add reflection and refraction
-	tmp = refr + refl;
-
-	gl_FragColor = tmp + specular;
+	fragColor = refr + refl + specular;
 }
@@ -1,29 +1,93 @@
-#version 120
+#version 330 core
 
-varying vec4 toLightV;
-varying vec4 firstDistort;
-varying vec4 secondDistort;
-varying vec4 clipSpace;
-varying vec4 toViewV;
-uniform vec4 viewpos, lightpos;
-uniform float distort, invDistort;
+// Per-frame constants, see FrameConstants in frame_uniforms.hpp
+layout(std140) uniform FrameConstants {
+	mat4 projection;
+	mat4 view;
+	mat4 reflectionViewProjection;
+	mat4 refractionViewProjection;
+	vec4 viewpos;
+	vec4 lightpos;
+	vec4 waterColor;
+	float distort;
+	float invDistort;
+};
+
+// Per-pass constants, see PassConstants in frame_uniforms.hpp
+layout(std140) uniform PassConstants {
+	mat4 viewProjection;
+	vec4 clipPlane;
+};
+
+// FFT ocean, see Ocean
+uniform sampler2D displacementMap;
+uniform float oceanSize;
+
+// Shallow water surface height and depth, see ShallowWater
+uniform sampler2D waterLevelMap;
+uniform vec2 waterOrigin;
+uniform float waterCellSize;
+uniform vec2 waterCells;
+
+// This tile's grid, see Watertile. edgeMorph is the fixed morph of the
+// -x, +x, -z and +z borders, or -1 where they go by distance
+uniform vec3 tileOrigin;
+uniform float tileSize;
+uniform float gridQuads;
+uniform float lodRange;
+uniform vec4 edgeMorph;
+
+out vec4 toLightV;
+out vec4 firstDistort;
+out vec4 secondDistort;
+out vec4 reflectionClip;
+out vec4 refractionClip;
+out vec4 toViewV;
+out vec2 oceanCoord;
+out float waterDepth;
 
 void main(void) {
 
+	// grid position from the vertex index, no vertex buffer is needed
+	int row = int(gridQuads) + 1;
+	vec2 gridPos = vec2(gl_VertexID % row, gl_VertexID / row);
+	vec3 base = tileOrigin + vec3(gridPos.x, 0.0, gridPos.y) * (tileSize / gridQuads);
+
+	// odd vertices slide onto the coarser grid over the end of the range
+	float morph = clamp((distance(base, viewpos.xyz) - 0.7 * lodRange) / (0.3 * lodRange), 0.0, 1.0);
+	// borders take a morph both tiles sharing them agree on
+	float edge = -1.0;
+	if (gridPos.x == 0.0) edge = edgeMorph.x;
+	else if (gridPos.x == gridQuads) edge = edgeMorph.y;
+	else if (gridPos.y == 0.0) edge = edgeMorph.z;
+	else if (gridPos.y == gridQuads) edge = edgeMorph.w;
+	if (edge >= 0.0) morph = edge;
+	gridPos -= fract(gridPos * 0.5) * 2.0 * morph;
+	base = tileOrigin + vec3(gridPos.x, 0.0, gridPos.y) * (tileSize / gridQuads);
+
+	// lift to the water's surface, the waves die away in the shallows
+	vec2 water = textureLod(waterLevelMap, ((base.xz - waterOrigin) / waterCellSize + 0.5) / waterCells, 0.0).xy;
+	base.y = water.x;
+	waterDepth = water.y;
+
+	oceanCoord = base.xz / oceanSize;
+	vec3 waves = textureLod(displacementMap, oceanCoord, 0.0).xyz * clamp(water.y * 2.0, 0.0, 1.0);
+	vec4 vertex = vec4(base + waves, 1.0);
+	vec4 texCoord = vec4(gridPos / gridQuads, 0.0, 1.0);
 	vec4 temp;
 	vec4 tangent = vec4(1.0, 0.0, 0.0, 0.0);
 	vec4 norm = vec4(0.0, 1.0, 0.0, 0.0);
 	vec4 binormal = vec4(0.0, 0.0, 1.0, 0.0);
 
 	// view vector in tangent space
-	temp = viewpos - gl_Vertex;
+	temp = viewpos - vertex;
 	toViewV.x = dot(temp, tangent);
 	toViewV.y = dot(temp, binormal);
 	toViewV.z = dot(temp, norm);
 	toViewV.w = 1.0;
 
 	//light vector in tangent space
-	temp = lightpos - gl_Vertex;
+	temp = lightpos - vertex;
 	toLightV.x = dot(temp, tangent);
 	toLightV.y = dot(temp, binormal);
 	toLightV.z = dot(temp, norm);
@@ -32,10 +96,13 @@ void main(void) {
 	vec4 t1 = vec4(0.0, -distort, 0.0,0.0);
 	vec4 t2 = vec4(0.0, -invDistort, 0.0,0.0);
 
-	firstDistort = gl_MultiTexCoord0 + t1;
-	secondDistort = gl_MultiTexCoord0 + t2;
+	firstDistort = texCoord + t1;
+	secondDistort = texCoord + t2;
 
-	clipSpace = gl_ModelViewProjectionMatrix * gl_Vertex;;
+	// the reflection/refraction may be from an earlier frame, so project
+	// with the camera they were rendered from
+	reflectionClip = reflectionViewProjection * vertex;
+	refractionClip = refractionViewProjection * vertex;
 
-	gl_Position = ftransform();
+	gl_Position = viewProjection * vertex;
 }
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <cmath>
+
+#include "ambient_occlusion.hpp"
+#include "job_system.hpp"
+
+using namespace std;
+
+namespace {
+    struct hull_point {
+        float distance;     // along the line from its start
+        float height;
+    };
+}
+
+// Adds the next point along a line to its hull and returns the sine of
+// the horizon behind it
+static inline float addPoint(vector<hull_point> &hull, hull_point p) {
+    // the top of the hull is hidden behind the point under it
+    while (hull.size() >= 2) {
+        const hull_point &a = hull[hull.size() - 1];
+        const hull_point &b = hull[hull.size() - 2];
+        if ((a.height - p.height) * (p.distance - b.distance) > (b.height - p.height) * (p.distance - a.distance)) break;
+        hull.pop_back();
+    }
+
+    float occlusion = 0;
+    if (!hull.empty()) {
+        float rise = hull.back().height - p.height;
+        if (rise > 0) {
+            float run = p.distance - hull.back().distance;
+            occlusion = rise / sqrt(rise * rise + run * run);
+        }
+    }
+    hull.push_back(p);
+    return occlusion;
+}
+
+vector<uint8_t> AmbientOcclusion::bake(const vector<float> &heights, int width, int length, float spacing) {
+    vector<float> occlusion(heights.size(), 0.0f);
+    JobSystem &jobs = JobSystem::instance();
+
+    static const int DIRECTION_X[DIRECTIONS] = { 1, -1, 0, 0, 1, -1, 1, -1 };
+    static const int DIRECTION_Z[DIRECTIONS] = { 0, 0, 1, -1, 1, -1, -1, 1 };
+    for (int d = 0; d < DIRECTIONS; d++) {
+        int dx = DIRECTION_X[d], dz = DIRECTION_Z[d];
+        float step = dx && dz ? spacing * 1.41421356f : spacing;
+
+        if (dz == 0) {
+            // Lines along rows, each swept on its own
+            jobs.wait(jobs.parallelFor(0, length, 0, [&](int begin, int end) {
+                vector<hull_point> hull;
+                for (int z = begin; z < end; z++) {
+                    hull.clear();
+                    for (int k = 0; k < width; k++) {
+                        int i = z * width + (dx > 0 ? k : width - 1 - k);
+                        occlusion[i] += addPoint(hull, { k * step, heights[i] });
+                    }
+                }
+            }));
+            continue;
+        }
+
+        // Lines crossing rows are swept together a row at a time, so each
+        // row is read in order rather than jumping a row every step. Line
+        // id crosses row z at x = id + slant * z.
+        int slant = dx * dz;
+        int firstId = slant > 0 ? -(length - 1) : 0;
+        int lastId = slant < 0 ? width + length - 2 : width - 1;
+        jobs.wait(jobs.parallelFor(firstId, lastId + 1, 0, [&](int begin, int end) {
+            vector<vector<hull_point>> hulls(end - begin);
+            for (int k = 0; k < length; k++) {
+                int z = dz > 0 ? k : length - 1 - k;
+                int from = max(begin, -slant * z), to = min(end, width - slant * z);
+                for (int id = from; id < to; id++) {
+                    int i = z * width + id + slant * z;
+                    occlusion[i] += addPoint(hulls[id - begin], { k * step, heights[i] });
+                }
+            }
+        }));
+    }
+
+    vector<uint8_t> result(heights.size());
+    jobs.wait(jobs.parallelFor(0, heights.size(), 0, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            float open = 1 - occlusion[i] / DIRECTIONS;
+            result[i] = uint8_t(max(0.0f, min(1.0f, open)) * 255 + 0.5f);
+        }
+    }));
+    return result;
+}
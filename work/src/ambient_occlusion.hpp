@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Ambient occlusion of a heightfield from its horizons. For each of the
+// eight grid directions the highest angle any point along that direction
+// rises above a vertex is found, and the sky left under those horizons is
+// how much ambient light the vertex gets.
+//
+// Horizons are found by sweeping each grid line in turn, keeping the upper
+// convex hull of the points behind. The horizon of a new point is on that
+// hull, and any hull point it hides is hidden from every point after it
+// too, so each point is pushed and popped at most once: O(N) for each
+// direction, with the lines of a direction split across threads.
+class AmbientOcclusion {
+public:
+    static const int DIRECTIONS = 8;
+
+    // World heights and the world distance between vertices. Returns how
+    // open to the sky each vertex is, 255 for a flat open plain.
+    static std::vector<uint8_t> bake(const std::vector<float> &heights, int width, int length, float spacing);
+};
@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "camera_controller.hpp"
+#include "terrain.hpp"
+
+using namespace std;
+using namespace cgra;
+
+// Unit direction the camera looks along
+vec3 CameraController::forward() const {
+    float horizontal = cos(radians(m_pitch));
+    return vec3(horizontal * sin(radians(180 - m_yaw)), -sin(radians(m_pitch)), horizontal * cos(radians(180 - m_yaw)));
+}
+
+void CameraController::rotate(float yaw, float pitch) {
+    m_yaw += yaw;
+    m_pitch += pitch;
+    if (m_mode == WALK) m_pitch = max(-89.0f, min(89.0f, m_pitch));
+}
+
+void CameraController::zoom(float amount) {
+    if (m_mode == ORBIT) m_distance -= amount * m_distance * 0.2f;
+}
+
+// The walker starts under the orbit centre, facing the same way
+void CameraController::toggleMode() {
+    if (m_mode == ORBIT) {
+        m_mode = WALK;
+        m_walker = m_target;
+        m_pitch = max(-89.0f, min(89.0f, m_pitch));
+    } else {
+        m_mode = ORBIT;
+    }
+    cout << "Camera mode: " << (m_mode == WALK ? "walk" : "orbit") << endl;
+}
+
+CameraController::mode CameraController::getMode() const {
+    return m_mode;
+}
+
+void CameraController::update(const Terrain *terrain, float dt, float forwardInput, float rightInput) {
+    if (m_mode == WALK) updateWalk(terrain, dt, forwardInput, rightInput);
+    else updateOrbit(terrain);
+}
+
+// The target sits on the ground under it. Steps back from it towards the
+// requested distance, stopping short of the first sample that is under
+// the ground, so hills between the target and the eye pull the eye in.
+// The eye is then lifted clear of the ground right under it, which the
+// samples may have stepped over.
+void CameraController::updateOrbit(const Terrain *terrain) {
+    vec3 back = -forward();
+    float distance = m_distance;
+
+    if (terrain) {
+        m_target.y = terrain->sampleHeight(m_target.x, m_target.z) + CLEARANCE;
+        for (int i = 1; i <= SWEEP_SAMPLES; i++) {
+            vec3 p = m_target + back * (m_distance * i / SWEEP_SAMPLES);
+            if (p.y < terrain->sampleHeight(p.x, p.z) + CLEARANCE) {
+                distance = max(float(MIN_DISTANCE), m_distance * (i - 1) / SWEEP_SAMPLES);
+                break;
+            }
+        }
+    }
+
+    m_eye = m_target + back * distance;
+    if (terrain) {
+        m_eye.y = max(m_eye.y, terrain->sampleHeight(m_eye.x, m_eye.z) + CLEARANCE);
+    }
+    m_lookAt = m_target;
+}
+
+// Moves over the ground in the direction faced, with the eye a fixed
+// height above it
+void CameraController::updateWalk(const Terrain *terrain, float dt, float forwardInput, float rightInput) {
+    vec3 look = forward();
+    vec3 ahead = normalize(vec3(look.x, 0, look.z));
+    vec3 right = cross(ahead, vec3(0, 1, 0));
+
+    m_walker += (ahead * forwardInput + right * rightInput) * (WALK_SPEED * dt);
+    m_walker.y = terrain ? terrain->sampleHeight(m_walker.x, m_walker.z) : 0;
+
+    m_eye = m_walker + vec3(0, EYE_HEIGHT, 0);
+    m_lookAt = m_eye + look;
+}
+
+vec3 CameraController::getEye() const {
+    return m_eye;
+}
+
+vec3 CameraController::getLookAt() const {
+    return m_lookAt;
+}
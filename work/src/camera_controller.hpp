@@ -0,0 +1,47 @@
+#pragma once
+
+#include "cgra_math.hpp"
+
+class Terrain;
+
+// Orbit camera around a target, or a first-person walker, kept above the
+// terrain. Collision costs a fixed number of height samples per frame.
+class CameraController {
+public:
+    enum mode { ORBIT, WALK };
+
+private:
+    static const int SWEEP_SAMPLES = 16;        // height samples along the zoom ray
+    static constexpr float CLEARANCE = 0.5f;    // lowest the orbit eye gets to the ground
+    static constexpr float MIN_DISTANCE = 2.0f; // closest the sweep pulls the orbit in
+    static constexpr float EYE_HEIGHT = 1.0f;   // walker's eye above the ground
+    static constexpr float WALK_SPEED = 10.0f;  // world units per second
+
+    mode m_mode = ORBIT;
+    float m_pitch = 15;             // degrees, positive looks down
+    float m_yaw = -45;
+
+    cgra::vec3 m_target;            // orbit centre, y kept on the ground
+    float m_distance = 150;         // requested orbit distance, before collision
+    cgra::vec3 m_walker;            // walker's feet, y follows the ground
+
+    cgra::vec3 m_eye;
+    cgra::vec3 m_lookAt;
+
+    cgra::vec3 forward() const;
+    void updateOrbit(const Terrain *);
+    void updateWalk(const Terrain *, float dt, float forwardInput, float rightInput);
+
+public:
+    void rotate(float yaw, float pitch);
+    void zoom(float amount);
+    void toggleMode();
+    mode getMode() const;
+
+    // Moves the camera for this frame. The inputs are -1 to 1 and only
+    // move the walker. Without a terrain there is no collision.
+    void update(const Terrain *, float dt, float forwardInput, float rightInput);
+
+    cgra::vec3 getEye() const;
+    cgra::vec3 getLookAt() const;
+};
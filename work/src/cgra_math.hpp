@@ -2896,7 +2896,7 @@ namespace cgra {
 
 		// fovy in radians, aspect is w/h
 		static matrix4 perspectiveProjection(T fovy, T aspect, T zNear, T zFar) {
-			T f = T(1) / (fovy / T(2));
+			T f = T(1) / std::tan(fovy / T(2));
 
 			matrix4 m;
 			m[0][0] = f / aspect;
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+
+#include "cgra_math.hpp"
+#include "opengl.hpp"
+#include "shader_program.hpp"
+
+// Per-frame constants shared by every program through the FrameConstants
+// uniform block. Layout matches std140, so members are kept to mat4/vec4
+// with the scalars packed at the end.
+struct FrameConstants {
+    cgra::mat4 projection;  // camera projection
+    cgra::mat4 view;        // world to eye transform of the main camera
+    cgra::mat4 reflectionViewProjection;    // camera the reflection was rendered from
+    cgra::mat4 refractionViewProjection;    // camera the refraction was rendered from
+    cgra::vec4 viewpos;     // camera position in world space
+    cgra::vec4 lightpos;    // light position in world space
+    cgra::vec4 waterColor;  // deep water colour
+    float distort = 0;      // offset of the water distortion maps
+    float invDistort = 0;
+    float pad[2] = { 0, 0 };
+};
+
+// Constants for a single scene pass (main, reflection or refraction),
+// through the PassConstants uniform block.
+struct PassConstants {
+    cgra::mat4 viewProjection;  // world to clip transform for this pass
+    cgra::vec4 clipPlane;       // world space plane, only used with GL_CLIP_DISTANCE0
+};
+
+static_assert(sizeof(FrameConstants) == 320, "FrameConstants must match the std140 block layout");
+static_assert(sizeof(PassConstants) == 80, "PassConstants must match the std140 block layout");
+
+// A uniform buffer holding one T, attached to the block of the same name
+// in every program it is given.
+template <typename T>
+class UniformBlock {
+private:
+    std::string m_name;
+    GLuint m_binding;
+    GLuint m_buffer = 0;
+
+public:
+    T values;
+
+    UniformBlock(const std::string &name, GLuint binding) : m_name(name), m_binding(binding) {}
+
+    void initialise() {
+        glGenBuffers(1, &m_buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(T), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, m_binding, m_buffer);
+    }
+
+    void attach(const ShaderProgram &program) const {
+        program.bindUniformBlock(m_name, m_binding);
+    }
+
+    // Uploads the current values
+    void update() {
+        glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &values);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+};
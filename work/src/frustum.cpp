@@ -0,0 +1,65 @@
+#include <limits>
+
+#include "cgra_math.hpp"
+#include "frustum.hpp"
+
+using namespace std;
+using namespace cgra;
+
+AABB::AABB() : min(numeric_limits<float>::max()), max(-numeric_limits<float>::max()) {}
+
+AABB::AABB(vec3 min_, vec3 max_) : min(min_), max(max_) {}
+
+void AABB::expand(const vec3 &p) {
+    min = cgra::min(min, p);
+    max = cgra::max(max, p);
+}
+
+bool AABB::isEmpty() const {
+    return min.x > max.x || min.y > max.y || min.z > max.z;
+}
+
+// Everything is visible with the default frustum
+Frustum::Frustum() : m_planeCount(0) {}
+
+// Planes extracted from the rows of the view-projection (Gribb & Hartmann),
+// so they come out in whatever space the matrix transforms from
+Frustum::Frustum(const mat4 &m) {
+    vec4 row[4];
+    for (int i = 0; i < 4; i++) {
+        row[i] = vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+    }
+    m_planes[0] = row[3] + row[0]; // left
+    m_planes[1] = row[3] - row[0]; // right
+    m_planes[2] = row[3] + row[1]; // bottom
+    m_planes[3] = row[3] - row[1]; // top
+    m_planes[4] = row[3] + row[2]; // near
+    m_planes[5] = row[3] - row[2]; // far
+    m_planeCount = 6;
+}
+
+// A clip plane of (0,0,0,w) is treated as disabled
+Frustum::Frustum(const mat4 &m, const vec4 &clipPlane) : Frustum(m) {
+    if (clipPlane.x != 0 || clipPlane.y != 0 || clipPlane.z != 0) {
+        m_planes[m_planeCount++] = clipPlane;
+    }
+}
+
+Frustum Frustum::sides(const mat4 &m) {
+    Frustum frustum(m);
+    frustum.m_planeCount = 4;
+    return frustum;
+}
+
+// Conservative test: only rejects boxes entirely behind one plane
+bool Frustum::intersects(const AABB &box) const {
+    for (int i = 0; i < m_planeCount; i++) {
+        const vec4 &p = m_planes[i];
+        // corner of the box furthest along the plane normal
+        vec3 v(p.x >= 0 ? box.max.x : box.min.x,
+               p.y >= 0 ? box.max.y : box.min.y,
+               p.z >= 0 ? box.max.z : box.min.z);
+        if (p.x * v.x + p.y * v.y + p.z * v.z + p.w < 0) return false;
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "cgra_math.hpp"
+
+// Axis aligned bounding box in world space
+struct AABB {
+    cgra::vec3 min;
+    cgra::vec3 max;
+    
+    AABB();
+    AABB(cgra::vec3, cgra::vec3);
+    
+    void expand(const cgra::vec3 &);
+    bool isEmpty() const;
+};
+
+// Number of objects drawn, outside the frustum, or hidden behind
+// occluders, accumulated over a frame
+struct CullStats {
+    int visible = 0;
+    int culled = 0;
+    int occluded = 0;
+};
+
+// The six planes of a view-projection, plus an optional user clip plane
+// (the water's), all in world space with normals pointing inwards.
+class Frustum {
+private:
+    cgra::vec4 m_planes[7];
+    int m_planeCount = 6;
+    
+public:
+    Frustum();
+    explicit Frustum(const cgra::mat4 &viewProjection);
+    Frustum(const cgra::mat4 &viewProjection, const cgra::vec4 &clipPlane);
+    
+    // Just the left, right, bottom and top planes, for depth clamped passes
+    // where anything in front of the near plane or past the far one still
+    // draws
+    static Frustum sides(const cgra::mat4 &viewProjection);
+    
+    bool intersects(const AABB &) const;
+};
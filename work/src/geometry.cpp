@@ -13,6 +13,7 @@
 //----------------------------------------------------------------------------
 
 #include <cmath>
+#include <cstddef>
 #include <iostream> // input/output streams
 #include <fstream>  // file streams
 #include <sstream>  // string streams
@@ -39,8 +40,7 @@ Geometry::Geometry(string filename, string textureFilename, vec3 color, vec3 pos
 	readOBJ(filename);
     
 	if (m_triangles.size() > 0) {
-		createDisplayListPoly();
-		createDisplayListWire();
+		createBuffers();
 	}
 }
 
@@ -62,7 +62,9 @@ void Geometry::readTex(string textureFilename) {
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     
     // Finnaly, actually fill the data into our texture
-    gluBuild2DMipmaps(GL_TEXTURE_2D, 3, tex.w, tex.h, tex.glFormat(), GL_UNSIGNED_BYTE, tex.dataPointer());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, tex.w, tex.h, 0, tex.glFormat(), GL_UNSIGNED_BYTE, tex.dataPointer());
+    glGenerateMipmap(GL_TEXTURE_2D);
 }
 
 void Geometry::readOBJ(string filename) {
@@ -225,124 +227,66 @@ void Geometry::createNormals() {
 
 
 //-------------------------------------------------------------
-// [Assignment 1] :
-// Fill the following function to create display list
-// of the obj file to show it as wireframe model
+// Builds the vertex array for the loaded obj. Triangles are
+// unrolled into position/normal/uv vertices, with the model
+// position baked in, matching the layout of the terrain mesh.
 //-------------------------------------------------------------
-void Geometry::createDisplayListPoly() {
-	// Delete old list if there is one
-	if (m_displayListPoly) glDeleteLists(m_displayListPoly, 1);
-
-	// Create a new list
-	cout << "Creating Poly Geometry" << endl;
-	m_displayListPoly = glGenLists(1);
-	glNewList(m_displayListPoly, GL_COMPILE);
-
-	// YOUR CODE GOES HERE
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    glBegin(GL_TRIANGLES);
-	for (int i = 0; i < m_triangles.size(); i ++) {
+void Geometry::createBuffers() {
+	struct geometry_vertex {
+		vec3 position;
+		vec3 normal;
+		vec2 uv;
+	};
+
+	cout << "Creating Geometry Buffers" << endl;
+	vector<geometry_vertex> vertices;
+	vertices.reserve(m_triangles.size() * 3);
+	m_bounds = AABB();
+	for (size_t i = 0; i < m_triangles.size(); i ++) {
 		for (int j = 0; j < 3; j ++) {
 			vertex v = m_triangles[i].v[j];
-			vec3 v_point = m_points[v.p];
-            vec3 v_normal = m_normals[v.n];
-            
-            glNormal3f(v_normal.x, v_normal.y, v_normal.z);
-            glTexCoord2d(m_uvs[v.t].x * 4, m_uvs[v.t].y * 4);
-            glVertex3f(v_point.x, v_point.y, v_point.z);
+			geometry_vertex gv;
+			gv.position = m_points[v.p] + m_position;
+			gv.normal = m_normals[v.n];
+			gv.uv = m_uvs[v.t] * 4;
+			vertices.push_back(gv);
+			m_bounds.expand(gv.position);
 		}
 	}
-    
-    glEnd();
-	glEndList();
-	cout << "Finished creating Poly Geometry" << endl;
-}
-
-
-//-------------------------------------------------------------
-// [Assignment 1] :
-// Fill the following function to create display list
-// of the obj file to show it as polygon model
-//-------------------------------------------------------------
-void Geometry::createDisplayListWire() {
-	// Delete old list if there is one
-	if (m_displayListWire) glDeleteLists(m_displayListWire, 1);
-
-	// Create a new list
-	cout << "Creating Wire Geometry" << endl;
-	m_displayListWire = glGenLists(1);
-	glNewList(m_displayListWire, GL_COMPILE);
+	m_vertexCount = vertices.size();
 
-	// YOUR CODE GOES HERE
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glBegin(GL_TRIANGLES);
-    for (int i = 0; i < m_triangles.size(); i ++) {
-        for (int j = 0; j < 3; j ++) {
-            vertex v = m_triangles[i].v[j];
-            vec3 v_point = m_points[v.p];
-            vec3 v_normal = m_normals[v.n];
-            
-            glNormal3f(v_normal.x, v_normal.y, v_normal.z);
-            glVertex3f(v_point.x, v_point.y, v_point.z);
-        }
-    }
-    glEnd();
-	glEndList();
-	cout << "Finished creating Wire Geometry" << endl;
+	if (!m_vao) {
+		glGenVertexArrays(1, &m_vao);
+		glGenBuffers(1, &m_vbo);
+	}
+	glBindVertexArray(m_vao);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(geometry_vertex), vertices.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(geometry_vertex), (void *)offsetof(geometry_vertex, position));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(geometry_vertex), (void *)offsetof(geometry_vertex, normal));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(geometry_vertex), (void *)offsetof(geometry_vertex, uv));
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	cout << "Finished creating Geometry Buffers" << endl;
 }
 
 
+// Draws the geometry with the currently bound program. The
+// texture (if any) is bound to unit 0 for the program to use.
 void Geometry::renderGeometry() {
-	if (m_wireFrameOn) {
-
-		//-------------------------------------------------------------
-		// [Assignment 1] :
-		// When moving on to displaying your obj, comment out the
-		// wire_cow function & uncomment the glCallList function
-		//-------------------------------------------------------------
-
-		glShadeModel(GL_SMOOTH);
-		glCallList(m_displayListWire);
-
-	} else {
-
-		//-------------------------------------------------------------
-		// [Assignment 1] :
-		// When moving on to displaying your obj, comment out the
-		// cow function & uncomment the glCallList function
-		//-------------------------------------------------------------
-        // if m_texture_filename maybe...?
-        if (m_texture_filename != "") {
-            // Disable Drawing colours
-            glDisable(GL_COLOR_MATERIAL);
-            // Enable Drawing texures
-            glEnable(GL_TEXTURE_2D);
-            // Use Texture as the color
-            glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-            // Set the location for binding the texture
-            glActiveTexture(GL_TEXTURE0);
-            // Bind the texture
-            glBindTexture(GL_TEXTURE_2D, m_texture);
-        } else {
-            // Disable Drawing textures
-            glDisable(GL_TEXTURE_2D);
-            // Enable Drawing colours
-            glEnable(GL_COLOR_MATERIAL);
-            glColor3f(m_color.r, m_color.g, m_color.b);
-        }
-        glMaterialfv(GL_FRONT, GL_AMBIENT, m_material.ambient.dataPointer());
-        glMaterialfv(GL_FRONT, GL_SPECULAR, m_material.specular.dataPointer());
-        glMaterialfv(GL_FRONT, GL_DIFFUSE, m_material.diffuse.dataPointer());
-        glMaterialf(GL_FRONT, GL_SHININESS, m_material.shine * 128.0);
-        
-		glShadeModel(GL_SMOOTH);
-        
-        glPushMatrix();
-        glTranslatef(m_position.x, m_position.y, m_position.z);
-		glCallList(m_displayListPoly);
-        glPopMatrix();
-
+	if (m_texture_filename != "") {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, m_texture);
 	}
+
+	glPolygonMode(GL_FRONT_AND_BACK, m_wireFrameOn ? GL_LINE : GL_FILL);
+	glBindVertexArray(m_vao);
+	glDrawArrays(GL_TRIANGLES, 0, m_vertexCount);
+	glBindVertexArray(0);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 }
 
 
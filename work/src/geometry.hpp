@@ -20,6 +20,7 @@
 #include <vector>
 
 #include "cgra_math.hpp"
+#include "frustum.hpp"
 #include "opengl.hpp"
 
 
@@ -58,17 +59,20 @@ private:
 
 	bool m_wireFrameOn = false;
 
-	// IDs for the display list to render
-	GLuint m_displayListPoly = 0; // DisplayList for Polygon
-	GLuint m_displayListWire = 0; // DisplayList for Wireframe
+	// IDs for the vertex array to render, shared by poly and wire mode
+	GLuint m_vao = 0;
+	GLuint m_vbo = 0;
+	GLsizei m_vertexCount = 0;
+
+	// World space bounds of the baked vertices, for culling
+	AABB m_bounds;
 
 	void readOBJ(std::string);
     void readTex(std::string);
 
 	void createNormals();
 
-	void createDisplayListPoly();
-	void createDisplayListWire();
+	void createBuffers();
 
 public:
     Geometry(std::string, std::string, cgra::vec3, cgra::vec3, material);
@@ -76,5 +80,6 @@ public:
 
 	void renderGeometry();
 	void toggleWireFrame();
+	AABB getBounds() const { return m_bounds; }
 	
 };
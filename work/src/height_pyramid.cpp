@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "height_pyramid.hpp"
+#include "job_system.hpp"
+
+using namespace std;
+using namespace cgra;
+
+// Clips [tmin, tmax] to where the ray is between lo and hi on one axis
+static bool clipSlab(float origin, float dir, float lo, float hi, float &tmin, float &tmax) {
+    if (dir == 0) return origin >= lo && origin <= hi;
+    float t0 = (lo - origin) / dir;
+    float t1 = (hi - origin) / dir;
+    if (t0 > t1) swap(t0, t1);
+    tmin = max(tmin, t0);
+    tmax = min(tmax, t1);
+    return tmin <= tmax;
+}
+
+// Moller-Trumbore, accepting hits on either side
+static bool intersectTriangle(const vec3 &origin, const vec3 &dir, const vec3 &a, const vec3 &b, const vec3 &c, float &t) {
+    vec3 e1 = b - a;
+    vec3 e2 = c - a;
+    vec3 p = cross(dir, e2);
+    float det = dot(e1, p);
+    if (fabs(det) < 1e-12f) return false;
+
+    float inv = 1.0f / det;
+    vec3 s = origin - a;
+    float u = dot(s, p) * inv;
+    if (u < 0 || u > 1) return false;
+    vec3 q = cross(s, e1);
+    float v = dot(dir, q) * inv;
+    if (v < 0 || u + v > 1) return false;
+
+    t = dot(e2, q) * inv;
+    return t >= 0;
+}
+
+void HeightPyramid::build(const vector<float> &heights, int width, int length) {
+    m_width = width;
+    m_length = length;
+    m_levels.clear();
+
+    level base;
+    base.width = width - 1;
+    base.length = length - 1;
+    base.min.resize(base.width * base.length);
+    base.max.resize(base.width * base.length);
+    m_levels.push_back(move(base));
+
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, length - 1, 0, [&](int begin, int end) {
+        level &cells = m_levels[0];
+        for (int z = begin; z < end; z++) {
+            for (int x = 0; x < cells.width; x++) {
+                float h00 = heights[z * width + x];
+                float h01 = heights[z * width + x + 1];
+                float h10 = heights[(z + 1) * width + x];
+                float h11 = heights[(z + 1) * width + x + 1];
+                cells.min[z * cells.width + x] = min(min(h00, h01), min(h10, h11));
+                cells.max[z * cells.width + x] = max(max(h00, h01), max(h10, h11));
+            }
+        }
+    }));
+
+    // Each level halves the one before, down to a single node
+    while (m_levels.back().width > 1 || m_levels.back().length > 1) {
+        level next;
+        next.width = (m_levels.back().width + 1) / 2;
+        next.length = (m_levels.back().length + 1) / 2;
+        next.min.resize(next.width * next.length);
+        next.max.resize(next.width * next.length);
+        m_levels.push_back(move(next));
+
+        const level &src = m_levels[m_levels.size() - 2];
+        level &dst = m_levels.back();
+        jobs.wait(jobs.parallelFor(0, dst.length, 0, [&](int begin, int end) {
+            for (int z = begin; z < end; z++) {
+                int sz0 = z * 2;
+                int sz1 = min(src.length - 1, z * 2 + 1);
+                for (int x = 0; x < dst.width; x++) {
+                    int sx0 = x * 2;
+                    int sx1 = min(src.width - 1, x * 2 + 1);
+                    dst.min[z * dst.width + x] = min(
+                        min(src.min[sz0 * src.width + sx0], src.min[sz0 * src.width + sx1]),
+                        min(src.min[sz1 * src.width + sx0], src.min[sz1 * src.width + sx1]));
+                    dst.max[z * dst.width + x] = max(
+                        max(src.max[sz0 * src.width + sx0], src.max[sz0 * src.width + sx1]),
+                        max(src.max[sz1 * src.width + sx0], src.max[sz1 * src.width + sx1]));
+                }
+            }
+        }));
+    }
+}
+
+float HeightPyramid::sample(const vector<float> &heights, float x, float z) const {
+    x = max(0.0f, min(float(m_width - 1), x));
+    z = max(0.0f, min(float(m_length - 1), z));
+    int x0 = min(int(x), m_width - 2);
+    int z0 = min(int(z), m_length - 2);
+    float fx = x - x0;
+    float fz = z - z0;
+
+    float h00 = heights[z0 * m_width + x0];
+    float h01 = heights[z0 * m_width + x0 + 1];
+    float h10 = heights[(z0 + 1) * m_width + x0];
+    float h11 = heights[(z0 + 1) * m_width + x0 + 1];
+    return (h00 * (1 - fx) + h01 * fx) * (1 - fz) + (h10 * (1 - fx) + h11 * fx) * fz;
+}
+
+// The cell's two triangles, split the same way as the patch strips
+bool HeightPyramid::intersectCell(const vector<float> &heights, int x, int z,
+                                  const vec3 &origin, const vec3 &dir, float &t) const {
+    vec3 p00(x, heights[z * m_width + x], z);
+    vec3 p01(x + 1, heights[z * m_width + x + 1], z);
+    vec3 p10(x, heights[(z + 1) * m_width + x], z + 1);
+    vec3 p11(x + 1, heights[(z + 1) * m_width + x + 1], z + 1);
+
+    float t0, t1;
+    bool hit0 = intersectTriangle(origin, dir, p00, p10, p01, t0);
+    bool hit1 = intersectTriangle(origin, dir, p10, p01, p11, t1);
+    if (hit0 && hit1) t = min(t0, t1);
+    else if (hit0) t = t0;
+    else if (hit1) t = t1;
+    return hit0 || hit1;
+}
+
+// Descends front to back from the single top node, skipping every node
+// whose height range the ray misses. Children of a node cover disjoint
+// parts of the ray, so the first cell hit is the nearest.
+bool HeightPyramid::raycast(const vector<float> &heights, const vec3 &origin,
+                            const vec3 &dir, float maxT, float &t) const {
+    if (m_levels.empty()) return false;
+
+    struct node {
+        int level, x, z;
+        float enter;
+    };
+    vector<node> stack;
+    stack.reserve(4 * m_levels.size());
+
+    auto test = [&](int l, int x, int z, float &enter) {
+        const level &lv = m_levels[l];
+        float x0 = float(x << l), x1 = float(min((x + 1) << l, m_width - 1));
+        float z0 = float(z << l), z1 = float(min((z + 1) << l, m_length - 1));
+        float tmin = 0, tmax = maxT;
+        if (!clipSlab(origin.x, dir.x, x0, x1, tmin, tmax)) return false;
+        if (!clipSlab(origin.z, dir.z, z0, z1, tmin, tmax)) return false;
+        if (!clipSlab(origin.y, dir.y, lv.min[z * lv.width + x], lv.max[z * lv.width + x], tmin, tmax)) return false;
+        enter = tmin;
+        return true;
+    };
+
+    float enter;
+    int top = int(m_levels.size()) - 1;
+    if (!test(top, 0, 0, enter)) return false;
+    stack.push_back({ top, 0, 0, enter });
+
+    while (!stack.empty()) {
+        node n = stack.back();
+        stack.pop_back();
+
+        if (n.level == 0) {
+            if (intersectCell(heights, n.x, n.z, origin, dir, t) && t <= maxT) return true;
+            continue;
+        }
+
+        const level &below = m_levels[n.level - 1];
+        node children[4];
+        int count = 0;
+        for (int i = 0; i < 4; i++) {
+            int cx = n.x * 2 + i % 2;
+            int cz = n.z * 2 + i / 2;
+            if (cx >= below.width || cz >= below.length) continue;
+            if (!test(n.level - 1, cx, cz, enter)) continue;
+            // kept farthest first, so the nearest is pushed last and popped next
+            int j = count++;
+            for (; j > 0 && children[j - 1].enter < enter; j--) {
+                children[j] = children[j - 1];
+            }
+            children[j] = { n.level - 1, cx, cz, enter };
+        }
+        stack.insert(stack.end(), children, children + count);
+    }
+    return false;
+}
+
+// A block is one node of the level size cells across, or the top node
+// when the whole grid is smaller than that
+void HeightPyramid::blockRange(int size, int x, int z, float &lo, float &hi) const {
+    size_t l = 0;
+    while ((2 << l) <= size && l + 1 < m_levels.size()) l++;
+    const level &lv = m_levels[l];
+    int i = min(z >> l, lv.length - 1) * lv.width + min(x >> l, lv.width - 1);
+    lo = lv.min[i];
+    hi = lv.max[i];
+}
+
+size_t HeightPyramid::memoryUsage() const {
+    size_t bytes = 0;
+    for (const level &l : m_levels) {
+        bytes += (l.min.size() + l.max.size()) * sizeof(float);
+    }
+    return bytes;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+
+#include "cgra_math.hpp"
+
+// Min/max mip pyramid over a heightfield. Level 0 holds the lowest and
+// highest corner of every grid cell, and each level above holds the range
+// of the 2x2 block of cells below it, so a ray can skip any block it
+// passes over or under in one step.
+//
+// Everything here is in grid space: x and z in vertices, y in the
+// heightfield's own units. The heights themselves are passed to each
+// query rather than copied.
+class HeightPyramid {
+private:
+    struct level {
+        int width = 0;              // cells along x
+        int length = 0;             // cells along z
+        std::vector<float> min;
+        std::vector<float> max;
+    };
+
+    std::vector<level> m_levels;    // m_levels[0] is per cell
+    int m_width = 0;                // vertices along x
+    int m_length = 0;               // vertices along z
+
+    bool intersectCell(const std::vector<float> &heights, int x, int z,
+                       const cgra::vec3 &origin, const cgra::vec3 &dir, float &t) const;
+
+public:
+    void build(const std::vector<float> &heights, int width, int length);
+
+    // Bilinear height at a grid position, clamped to the grid
+    float sample(const std::vector<float> &heights, float x, float z) const;
+
+    // Nearest hit of the ray with the triangles of the grid, as drawn.
+    // t is in units of dir.
+    bool raycast(const std::vector<float> &heights, const cgra::vec3 &origin,
+                 const cgra::vec3 &dir, float maxT, float &t) const;
+
+    // Lowest and highest height within the size x size block of cells
+    // starting at cell x, z. size is a power of two and x, z multiples of it.
+    void blockRange(int size, int x, int z, float &lo, float &hi) const;
+
+    size_t memoryUsage() const;
+};
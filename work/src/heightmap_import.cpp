@@ -0,0 +1,472 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "heightmap_import.hpp"
+
+using namespace std;
+
+// Void marker in signed DEMs such as SRTM, read as sea level
+static const int DEM_VOID = -32768;
+
+RowResampler::RowResampler(int sourceWidth, int sourceLength, int width, int length,
+                           function<void(int, const vector<float> &)> emit)
+    : m_sourceWidth(sourceWidth), m_sourceLength(sourceLength), m_width(width), m_length(length),
+      m_columns(buildTaps(sourceWidth, width)), m_rows(buildTaps(sourceLength, length)),
+      m_scratch(width), m_emit(move(emit)) {}
+
+vector<RowResampler::taps> RowResampler::buildTaps(int sourceSize, int size) {
+    vector<taps> result(size);
+    float scale = size > 1 ? float(sourceSize - 1) / (size - 1) : 0;
+    float radius = max(1.0f, scale);
+    for (int i = 0; i < size; i++) {
+        float centre = i * scale;
+        int first = max(0, int(ceil(centre - radius + 1e-4f)));
+        int last = min(sourceSize - 1, int(floor(centre + radius - 1e-4f)));
+
+        taps &t = result[i];
+        t.first = first;
+        float total = 0;
+        for (int s = first; s <= last; s++) {
+            float w = max(0.0f, 1.0f - fabs(s - centre) / radius);
+            t.weights.push_back(w);
+            total += w;
+        }
+        for (float &w : t.weights) {
+            w /= total;
+        }
+    }
+    return result;
+}
+
+void RowResampler::push(const float *row) {
+    if (m_sourceRow >= m_sourceLength) throw runtime_error("Error: Heightmap has more rows than expected");
+    int y = m_sourceRow++;
+
+    for (int x = 0; x < m_width; x++) {
+        const taps &t = m_columns[x];
+        float sum = 0;
+        for (size_t k = 0; k < t.weights.size(); k++) {
+            sum += t.weights[k] * row[t.first + k];
+        }
+        m_scratch[x] = sum;
+    }
+
+    // Rows open in order and, as their taps only move forward, finish in
+    // the same order
+    while (m_nextRow < m_length && m_rows[m_nextRow].first <= y) {
+        m_open.push_back({ m_nextRow++, vector<float>(m_width, 0.0f) });
+    }
+    for (open_row &open : m_open) {
+        const taps &t = m_rows[open.index];
+        size_t k = y - t.first;
+        if (k >= t.weights.size()) continue;
+        for (int x = 0; x < m_width; x++) {
+            open.sum[x] += t.weights[k] * m_scratch[x];
+        }
+    }
+    while (!m_open.empty()) {
+        const taps &t = m_rows[m_open.front().index];
+        if (t.first + int(t.weights.size()) - 1 > y) break;
+        m_emit(m_open.front().index, m_open.front().sum);
+        m_open.erase(m_open.begin());
+    }
+}
+
+static uint32_t readBigEndian(const unsigned char *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+namespace {
+    // The image data of a PNG, read from its IDAT chunks a block at a time
+    class IdatReader {
+    private:
+        ifstream &m_file;
+        string m_filename;
+        uint32_t m_remaining;               // left in the current chunk
+        vector<unsigned char> m_buffer;
+        size_t m_pos = 0, m_end = 0;
+
+    public:
+        IdatReader(ifstream &file, const string &filename, uint32_t firstSize)
+            : m_file(file), m_filename(filename), m_remaining(firstSize), m_buffer(65536) {}
+
+        unsigned char next() {
+            if (m_pos == m_end) {
+                // past the end of a chunk, skip its CRC onto the next
+                while (m_remaining == 0) {
+                    unsigned char header[12];
+                    if (!m_file.read((char *)header, 12) || memcmp(header + 8, "IDAT", 4) != 0) {
+                        throw runtime_error("Error: Heightmap " + m_filename + " is corrupt");
+                    }
+                    m_remaining = readBigEndian(header + 4);
+                }
+                size_t count = min<size_t>(m_remaining, m_buffer.size());
+                if (!m_file.read((char *)m_buffer.data(), count)) {
+                    throw runtime_error("Error: Heightmap " + m_filename + " is corrupt");
+                }
+                m_remaining -= uint32_t(count);
+                m_pos = 0;
+                m_end = count;
+            }
+            return m_buffer[m_pos++];
+        }
+    };
+
+    struct huffman {
+        short counts[16];       // codes of each length
+        short symbols[288];     // symbols ordered by code
+    };
+
+    // Streaming zlib inflate, after Mark Adler's puff. Output is pulled a
+    // piece at a time and only the 32K window matches can reach back into
+    // is kept, so the image is never held whole.
+    class Inflater {
+    private:
+        static const size_t WINDOW = 32768;
+
+        IdatReader &m_in;
+        string m_filename;
+        uint32_t m_bits = 0;
+        int m_bitCount = 0;
+
+        vector<unsigned char> m_window;
+        size_t m_total = 0;                 // bytes output so far
+        bool m_final = false;               // the current block is the last
+        bool m_inBlock = false;             // in a compressed block
+        size_t m_storedLeft = 0;            // bytes left of a stored block
+        int m_copyLength = 0;               // of a match part way out
+        size_t m_copyDistance = 0;
+        huffman m_lengths, m_distances;
+
+        void corrupt() const {
+            throw runtime_error("Error: Heightmap " + m_filename + " is corrupt");
+        }
+
+        int bits(int count) {
+            while (m_bitCount < count) {
+                m_bits |= uint32_t(m_in.next()) << m_bitCount;
+                m_bitCount += 8;
+            }
+            int value = int(m_bits & ((1u << count) - 1));
+            m_bits >>= count;
+            m_bitCount -= count;
+            return value;
+        }
+
+        // Codes are canonical, so each length's codes follow on from the last
+        int decode(const huffman &h) {
+            int code = 0, first = 0, index = 0;
+            for (int length = 1; length < 16; length++) {
+                code |= bits(1);
+                int count = h.counts[length];
+                if (code - count < first) return h.symbols[index + (code - first)];
+                index += count;
+                first = (first + count) << 1;
+                code <<= 1;
+            }
+            corrupt();
+            return 0;
+        }
+
+        void build(huffman &h, const short *lengths, int count) {
+            fill(begin(h.counts), end(h.counts), 0);
+            for (int i = 0; i < count; i++) {
+                h.counts[lengths[i]]++;
+            }
+            int left = 1;
+            for (int length = 1; length < 16; length++) {
+                left = (left << 1) - h.counts[length];
+                if (left < 0) corrupt();
+            }
+            short offsets[16];
+            offsets[1] = 0;
+            for (int length = 1; length < 15; length++) {
+                offsets[length + 1] = offsets[length] + h.counts[length];
+            }
+            for (int i = 0; i < count; i++) {
+                if (lengths[i] != 0) h.symbols[offsets[lengths[i]]++] = short(i);
+            }
+        }
+
+        void startBlock() {
+            m_final = bits(1) != 0;
+            int type = bits(2);
+            if (type == 0) {
+                // stored, from the next byte boundary
+                m_bits = 0;
+                m_bitCount = 0;
+                int length = m_in.next();
+                length |= m_in.next() << 8;
+                int check = m_in.next();
+                check |= m_in.next() << 8;
+                if (length != (~check & 0xFFFF)) corrupt();
+                m_storedLeft = length;
+                return;
+            }
+
+            short lengths[320];
+            if (type == 1) {
+                int i = 0;
+                for (; i < 144; i++) lengths[i] = 8;
+                for (; i < 256; i++) lengths[i] = 9;
+                for (; i < 280; i++) lengths[i] = 7;
+                for (; i < 288; i++) lengths[i] = 8;
+                build(m_lengths, lengths, 288);
+                fill(lengths, lengths + 30, 5);
+                build(m_distances, lengths, 30);
+            } else if (type == 2) {
+                static const short ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+                int literals = bits(5) + 257, distances = bits(5) + 1, codes = bits(4) + 4;
+                if (literals > 286 || distances > 30) corrupt();
+                fill(lengths, lengths + 19, 0);
+                for (int i = 0; i < codes; i++) {
+                    lengths[ORDER[i]] = short(bits(3));
+                }
+                huffman codeLengths;
+                build(codeLengths, lengths, 19);
+
+                int i = 0;
+                while (i < literals + distances) {
+                    int symbol = decode(codeLengths);
+                    if (symbol < 16) {
+                        lengths[i++] = short(symbol);
+                        continue;
+                    }
+                    int repeat = 0;
+                    short value = 0;
+                    if (symbol == 16) {
+                        if (i == 0) corrupt();
+                        value = lengths[i - 1];
+                        repeat = 3 + bits(2);
+                    } else if (symbol == 17) {
+                        repeat = 3 + bits(3);
+                    } else {
+                        repeat = 11 + bits(7);
+                    }
+                    if (i + repeat > literals + distances) corrupt();
+                    while (repeat--) lengths[i++] = value;
+                }
+                if (lengths[256] == 0) corrupt();
+                build(m_lengths, lengths, literals);
+                build(m_distances, lengths + literals, distances);
+            } else {
+                corrupt();
+            }
+            m_inBlock = true;
+        }
+
+    public:
+        Inflater(IdatReader &in, const string &filename)
+            : m_in(in), m_filename(filename), m_window(WINDOW) {
+            int method = m_in.next(), flags = m_in.next();
+            if ((method & 15) != 8 || (method * 256 + flags) % 31 != 0 || (flags & 32)) corrupt();
+        }
+
+        // Fills out with the next count bytes
+        void read(unsigned char *out, size_t count) {
+            static const short LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+            static const short LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+            static const int DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+            static const short DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+            size_t done = 0;
+            auto put = [&](unsigned char b) {
+                out[done++] = b;
+                m_window[m_total++ & (WINDOW - 1)] = b;
+            };
+            while (done < count) {
+                if (m_copyLength > 0) {
+                    for (; m_copyLength > 0 && done < count; m_copyLength--) {
+                        put(m_window[(m_total - m_copyDistance) & (WINDOW - 1)]);
+                    }
+                } else if (m_storedLeft > 0) {
+                    put(m_in.next());
+                    m_storedLeft--;
+                } else if (!m_inBlock) {
+                    // the stream ended before the image did
+                    if (m_final) corrupt();
+                    startBlock();
+                } else {
+                    int symbol = decode(m_lengths);
+                    if (symbol < 256) {
+                        put((unsigned char)symbol);
+                    } else if (symbol == 256) {
+                        m_inBlock = false;
+                    } else {
+                        symbol -= 257;
+                        if (symbol >= 29) corrupt();
+                        m_copyLength = LENGTH_BASE[symbol] + bits(LENGTH_EXTRA[symbol]);
+                        int distance = decode(m_distances);
+                        if (distance >= 30) corrupt();
+                        m_copyDistance = DISTANCE_BASE[distance] + bits(DISTANCE_EXTRA[distance]);
+                        if (m_copyDistance > m_total) corrupt();
+                    }
+                }
+            }
+        }
+    };
+}
+
+// stb_image only loads PNGs at 8 bits, and whole, so the chunks are read
+// here and the image data inflated as it is needed. Only the row being
+// unfiltered and the one above it are held, however big the PNG is.
+void HeightmapImport::readPng(const string &filename, int width, int length, row_callback emit) {
+    ifstream file(filename, ios::binary);
+    if (!file) throw runtime_error("Error: Could not open heightmap " + filename);
+
+    static const unsigned char SIGNATURE[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    unsigned char signature[8];
+    if (!file.read((char *)signature, 8) || memcmp(signature, SIGNATURE, 8) != 0) {
+        throw runtime_error("Error: Heightmap " + filename + " is not a PNG");
+    }
+
+    // Chunks up to the first IDAT, the rest of the image data follows it
+    int sourceWidth = 0, sourceLength = 0, bitDepth = 0;
+    uint32_t firstSize = 0;
+    while (true) {
+        unsigned char header[8];
+        if (!file.read((char *)header, 8)) {
+            throw runtime_error("Error: Heightmap " + filename + " has no image data");
+        }
+        uint32_t size = readBigEndian(header);
+        string type((const char *)header + 4, 4);
+
+        if (type == "IHDR") {
+            unsigned char data[13];
+            if (size != 13 || !file.read((char *)data, 13)) {
+                throw runtime_error("Error: Heightmap " + filename + " is corrupt");
+            }
+            sourceWidth = readBigEndian(data);
+            sourceLength = readBigEndian(data + 4);
+            bitDepth = data[8];
+            int colourType = data[9];
+            int interlace = data[12];
+            if (colourType != 0 || (bitDepth != 8 && bitDepth != 16) || interlace != 0) {
+                throw runtime_error("Error: Heightmap " + filename + " must be an 8 or 16 bit greyscale, non-interlaced PNG");
+            }
+            file.seekg(4, ios::cur);
+        } else if (type == "IDAT") {
+            firstSize = size;
+            break;
+        } else if (type == "IEND") {
+            throw runtime_error("Error: Heightmap " + filename + " has no image data");
+        } else {
+            file.seekg(size + 4, ios::cur);
+        }
+    }
+    if (sourceWidth <= 0 || sourceLength <= 0) {
+        throw runtime_error("Error: Heightmap " + filename + " has no image data");
+    }
+
+    IdatReader reader(file, filename, firstSize);
+    Inflater inflater(reader, filename);
+    int pixelBytes = bitDepth / 8;
+    size_t stride = size_t(sourceWidth) * pixelBytes;
+
+    // Undo each row's filter against the row above, then resample it
+    RowResampler resampler(sourceWidth, sourceLength, width, length, emit);
+    vector<unsigned char> previous(stride, 0), current(stride), in(stride + 1);
+    vector<float> samples(sourceWidth);
+    float range = bitDepth == 16 ? 65535.0f : 255.0f;
+    for (int y = 0; y < sourceLength; y++) {
+        inflater.read(in.data(), in.size());
+        int filter = in[0];
+        for (size_t i = 0; i < stride; i++) {
+            int a = i >= size_t(pixelBytes) ? current[i - pixelBytes] : 0;
+            int b = previous[i];
+            int c = i >= size_t(pixelBytes) ? previous[i - pixelBytes] : 0;
+            int predict = 0;
+            switch (filter) {
+            case 0: predict = 0; break;
+            case 1: predict = a; break;
+            case 2: predict = b; break;
+            case 3: predict = (a + b) / 2; break;
+            case 4: {
+                int p = a + b - c;
+                int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                predict = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                break;
+            }
+            default: throw runtime_error("Error: Heightmap " + filename + " is corrupt");
+            }
+            current[i] = (unsigned char)(in[i + 1] + predict);
+        }
+
+        for (int x = 0; x < sourceWidth; x++) {
+            int value = bitDepth == 16 ? (current[x * 2] << 8) | current[x * 2 + 1] : current[x];
+            samples[x] = value / range;
+        }
+        resampler.push(samples.data());
+        swap(previous, current);
+    }
+}
+
+// Read a row at a time, so only one source row is ever held
+void HeightmapImport::readRaw(const string &filename, int rawWidth, int rawLength, bool rawSigned,
+                              int width, int length, row_callback emit) {
+    if (rawWidth <= 0 || rawLength <= 0) {
+        throw runtime_error("Error: Raw heightmap " + filename + " needs heightmap-width and heightmap-length");
+    }
+    ifstream file(filename, ios::binary | ios::ate);
+    if (!file) throw runtime_error("Error: Could not open heightmap " + filename);
+    if (uint64_t(file.tellg()) != uint64_t(rawWidth) * rawLength * 2) {
+        throw runtime_error("Error: Raw heightmap " + filename + " is not " + to_string(rawWidth) + " x "
+            + to_string(rawLength) + " 16 bit samples");
+    }
+    file.seekg(0);
+
+    RowResampler resampler(rawWidth, rawLength, width, length, emit);
+    vector<unsigned char> bytes(size_t(rawWidth) * 2);
+    vector<float> samples(rawWidth);
+    for (int y = 0; y < rawLength; y++) {
+        if (!file.read((char *)bytes.data(), bytes.size())) {
+            throw runtime_error("Error: Could not read heightmap " + filename);
+        }
+        for (int x = 0; x < rawWidth; x++) {
+            uint16_t value = uint16_t(bytes[x * 2] | (bytes[x * 2 + 1] << 8));
+            if (rawSigned) {
+                int16_t height = int16_t(value);
+                samples[x] = height == DEM_VOID ? 0.0f : height;
+            } else {
+                samples[x] = value;
+            }
+        }
+        resampler.push(samples.data());
+    }
+}
+
+vector<float> HeightmapImport::load(const string &filename, int rawWidth, int rawLength, bool rawSigned,
+                                    int width, int length) {
+    cout << "Started: importing heightmap " << filename << endl;
+    vector<float> grid(size_t(width) * length);
+    auto emit = [&grid, width](int row, const vector<float> &values) {
+        copy(values.begin(), values.end(), grid.begin() + size_t(row) * width);
+    };
+
+    string extension = filename.size() >= 4 ? filename.substr(filename.size() - 4) : "";
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == ".png") {
+        readPng(filename, width, length, emit);
+    } else {
+        readRaw(filename, rawWidth, rawLength, rawSigned, width, length, emit);
+    }
+
+    // Stretch to 0-1 like the noise, the height scale then sets the relief
+    auto range = minmax_element(grid.begin(), grid.end());
+    float lowest = *range.first;
+    float span = *range.second - lowest;
+    for (float &h : grid) {
+        h = span > 0 ? (h - lowest) / span : 0.0f;
+    }
+    cout << "Finished: importing heightmap " << filename << endl;
+    return grid;
+}
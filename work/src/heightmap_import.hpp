@@ -0,0 +1,60 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Resamples an image to another size one source row at a time, so only a
+// handful of output rows are ever held. Each axis uses a tent filter as
+// wide as the scale when shrinking, which averages every source sample,
+// and plain linear interpolation when growing. Corners map to corners.
+class RowResampler {
+private:
+    struct taps {
+        int first = 0;
+        std::vector<float> weights;
+    };
+
+    struct open_row {
+        int index;
+        std::vector<float> sum;
+    };
+
+    int m_sourceWidth, m_sourceLength;
+    int m_width, m_length;
+    std::vector<taps> m_columns;    // source columns summed into each output column
+    std::vector<taps> m_rows;       // source rows summed into each output row
+    std::vector<float> m_scratch;   // the current source row, resampled across
+
+    std::vector<open_row> m_open;   // output rows still taking source rows
+    int m_nextRow = 0;              // next output row to open
+    int m_sourceRow = 0;
+    std::function<void(int, const std::vector<float> &)> m_emit;
+
+    static std::vector<taps> buildTaps(int sourceSize, int size);
+
+public:
+    RowResampler(int sourceWidth, int sourceLength, int width, int length,
+                 std::function<void(int, const std::vector<float> &)> emit);
+
+    // Takes the next source row, of sourceWidth samples, and emits every
+    // output row it completes
+    void push(const float *row);
+};
+
+// Loads a heightmap into a width x length grid normalised to 0-1.
+// 8 or 16 bit greyscale PNGs are read directly, keeping all 16 bits.
+// Anything else is a headerless raw DEM of 16 bit little endian samples,
+// rawWidth x rawLength of them, signed if rawSigned.
+class HeightmapImport {
+private:
+    typedef std::function<void(int, const std::vector<float> &)> row_callback;
+
+    static void readPng(const std::string &filename, int width, int length, row_callback emit);
+    static void readRaw(const std::string &filename, int rawWidth, int rawLength, bool rawSigned,
+                        int width, int length, row_callback emit);
+
+public:
+    static std::vector<float> load(const std::string &filename, int rawWidth, int rawLength, bool rawSigned,
+                                   int width, int length);
+};
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+
+#include "hydraulic_erosion.hpp"
+#include "job_system.hpp"
+#include "simplex_noise.hpp"
+
+using namespace std;
+using namespace cgra;
+
+// splitmix64, used rather than <random> so the droplets are the same
+// with every standard library
+static uint64_t nextRandom(uint64_t &state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static float randomFloat(uint64_t &state) {
+    return (nextRandom(state) >> 40) * (1.0f / 16777216.0f);
+}
+
+HydraulicErosion::HydraulicErosion() {
+    // Weights fall off linearly to the edge of the radius
+    float total = 0;
+    for (int dz = -m_radius; dz <= m_radius; dz++) {
+        for (int dx = -m_radius; dx <= m_radius; dx++) {
+            float distance = sqrt(float(dx * dx + dz * dz));
+            if (distance > m_radius) continue;
+            float weight = 1 - distance / m_radius;
+            m_brush.push_back({ dx, dz, weight });
+            total += weight;
+        }
+    }
+    for (brush_cell &cell : m_brush) {
+        cell.weight /= total;
+    }
+}
+
+// Furthest a droplet reads or writes from where it started, in cells
+int HydraulicErosion::reach() const {
+    return m_lifetime + m_radius + 2;
+}
+
+// Height and gradient, bilinear within the cell
+static void sampleCell(const vector<float> &heights, int width, float x, float z, float &height, float &gradX, float &gradZ) {
+    int cx = int(x), cz = int(z);
+    float fx = x - cx, fz = z - cz;
+    int i = cz * width + cx;
+    float h00 = heights[i], h10 = heights[i + 1];
+    float h01 = heights[i + width], h11 = heights[i + width + 1];
+
+    gradX = (h10 - h00) * (1 - fz) + (h11 - h01) * fz;
+    gradZ = (h01 - h00) * (1 - fx) + (h11 - h10) * fx;
+    height = h00 * (1 - fx) * (1 - fz) + h10 * fx * (1 - fz) + h01 * (1 - fx) * fz + h11 * fx * fz;
+}
+
+void HydraulicErosion::simulate(vector<float> &heights, int width, int length, float x, float z) const {
+    float dirX = 0, dirZ = 0;
+    float speed = 1, water = 1, sediment = 0;
+
+    for (int step = 0; step < m_lifetime; step++) {
+        int cx = int(x), cz = int(z);
+        float fx = x - cx, fz = z - cz;
+
+        float height, gradX, gradZ;
+        sampleCell(heights, width, x, z, height, gradX, gradZ);
+
+        dirX = dirX * m_inertia - gradX * (1 - m_inertia);
+        dirZ = dirZ * m_inertia - gradZ * (1 - m_inertia);
+        float len = sqrt(dirX * dirX + dirZ * dirZ);
+        if (len < 1e-9f) break;
+        dirX /= len;
+        dirZ /= len;
+        x += dirX;
+        z += dirZ;
+        if (x < 0 || z < 0 || x >= width - 1 || z >= length - 1) break;
+
+        float newHeight, unusedX, unusedZ;
+        sampleCell(heights, width, x, z, newHeight, unusedX, unusedZ);
+        float deltaHeight = newHeight - height;
+
+        float capacity = max(-deltaHeight * speed * water * m_capacity, m_minCapacity);
+        int i = cz * width + cx;
+        if (sediment > capacity || deltaHeight > 0) {
+            // fill the pit behind it when climbing, otherwise drop the excess
+            float deposit = deltaHeight > 0 ? min(deltaHeight, sediment) : (sediment - capacity) * m_depositSpeed;
+            sediment -= deposit;
+            heights[i] += deposit * (1 - fx) * (1 - fz);
+            heights[i + 1] += deposit * fx * (1 - fz);
+            heights[i + width] += deposit * (1 - fx) * fz;
+            heights[i + width + 1] += deposit * fx * fz;
+        } else {
+            // never dig deeper than the drop, so no new pits are made
+            float erode = min((capacity - sediment) * m_erodeSpeed, -deltaHeight);
+            for (const brush_cell &cell : m_brush) {
+                int bx = cx + cell.dx, bz = cz + cell.dz;
+                if (bx < 0 || bz < 0 || bx >= width || bz >= length) continue;
+                float &h = heights[bz * width + bx];
+                float taken = min(h, erode * cell.weight);
+                h -= taken;
+                sediment += taken;
+            }
+        }
+
+        speed = sqrt(max(0.0f, speed * speed + deltaHeight * m_gravity));
+        water *= 1 - m_evaporateSpeed;
+    }
+}
+
+void HydraulicErosion::erode(vector<float> &heights, int width, int length, int seed, int droplets) const {
+    if (droplets <= 0) return;
+
+    // Tiles over the cells droplets can start in
+    int tileSize = 2 * reach();
+    int cellsX = width - 1, cellsZ = length - 1;
+    int tilesX = (cellsX + tileSize - 1) / tileSize;
+    int tilesZ = (cellsZ + tileSize - 1) / tileSize;
+    int64_t totalCells = int64_t(cellsX) * cellsZ;
+
+    // Droplets are shared out by area, the running sum keeps the total exact
+    vector<int64_t> areaBefore(tilesX * tilesZ + 1, 0);
+    for (int t = 0; t < tilesX * tilesZ; t++) {
+        int w = min(tileSize, cellsX - (t % tilesX) * tileSize);
+        int l = min(tileSize, cellsZ - (t / tilesX) * tileSize);
+        areaBefore[t + 1] = areaBefore[t] + int64_t(w) * l;
+    }
+
+    JobSystem &jobs = JobSystem::instance();
+    for (int batch = 0; batch < m_batches; batch++) {
+        int64_t batchDroplets = int64_t(droplets) * (batch + 1) / m_batches - int64_t(droplets) * batch / m_batches;
+
+        for (int colour = 0; colour < 4; colour++) {
+            vector<int> tiles;
+            for (int t = 0; t < tilesX * tilesZ; t++) {
+                if ((t % tilesX) % 2 == colour % 2 && (t / tilesX) % 2 == colour / 2) tiles.push_back(t);
+            }
+            if (tiles.empty()) continue;
+
+            jobs.wait(jobs.parallelFor(0, tiles.size(), 1, [&](int begin, int end) {
+                for (int k = begin; k < end; k++) {
+                    int t = tiles[k];
+                    int64_t count = batchDroplets * areaBefore[t + 1] / totalCells - batchDroplets * areaBefore[t] / totalCells;
+                    float x0 = float((t % tilesX) * tileSize), z0 = float((t / tilesX) * tileSize);
+                    float w = float(min(tileSize, cellsX - (t % tilesX) * tileSize));
+                    float l = float(min(tileSize, cellsZ - (t / tilesX) * tileSize));
+
+                    uint64_t state = (uint64_t(uint32_t(seed)) << 32) ^ (uint64_t(batch) << 24) ^ uint64_t(t);
+                    for (int64_t d = 0; d < count; d++) {
+                        float x = x0 + randomFloat(state) * w;
+                        float z = z0 + randomFloat(state) * l;
+                        simulate(heights, width, length, x, z);
+                    }
+                }
+            }));
+        }
+    }
+}
+
+void HydraulicErosion::benchmark(const TerrainConfig &config) {
+    int droplets = config.erosionDroplets > 0 ? config.erosionDroplets : config.width * config.length;
+    int threads = JobSystem::instance().getThreadCount();
+    cout << "Erosion benchmark: " << config.width << " x " << config.length << " grid, " << droplets
+        << " droplets, " << threads << " threads" << endl;
+
+    SimplexNoise noise;
+    noise.init(config.length, config.width);
+    noise.setSeed(config.seed);
+    vector<vec3> points = noise.generateVertices(config.noiseScale / config.spacing(), config.octaves,
+        config.persistence, config.lacunarity, config.falloff);
+
+    HydraulicErosion erosion;
+    vector<float> first;
+    for (int run = 0; run < 3; run++) {
+        vector<float> heights(points.size());
+        for (size_t i = 0; i < points.size(); i++) {
+            heights[i] = points[i].y;
+        }
+
+        auto start = chrono::steady_clock::now();
+        erosion.erode(heights, config.width, config.length, config.seed, droplets);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        bool same = first.empty() || heights == first;
+        if (first.empty()) first = heights;
+        cout << "  run " << run + 1 << ": " << ms << "ms, " << droplets / ms * 1000.0 << " droplets/s"
+            << (same ? "" : ", DIFFERS from run 1") << endl;
+    }
+}
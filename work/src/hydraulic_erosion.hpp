@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+#include "terrain_config.hpp"
+
+// Particle based hydraulic erosion over a normalised heightfield. Each
+// droplet runs downhill for a fixed lifetime, picking up sediment where
+// it speeds up and dropping it where it slows or climbs.
+//
+// Droplets run in parallel by splitting the grid into tiles at least
+// twice as wide as anything a droplet can touch, coloured in a 2x2
+// checkerboard. Tiles of one colour never share a cell, so they run at
+// once, and the colours run one after another. Which droplets start in
+// which tile, and the order they run in within it, depend only on the
+// seed and droplet count, so the result is the same on any thread count.
+class HydraulicErosion {
+private:
+    struct brush_cell {
+        int dx, dz;
+        float weight;
+    };
+
+    int m_lifetime = 30;            // steps, each at most one cell long
+    int m_radius = 3;               // cells eroded around a droplet
+    int m_batches = 8;              // rounds over the checkerboard the droplets are split into
+    float m_inertia = 0.05f;        // how much a droplet keeps its direction
+    float m_capacity = 4;           // sediment carried per unit of speed, water and slope
+    float m_minCapacity = 0.01f;
+    float m_erodeSpeed = 0.3f;
+    float m_depositSpeed = 0.3f;
+    float m_evaporateSpeed = 0.01f;
+    float m_gravity = 4;
+
+    std::vector<brush_cell> m_brush;
+
+    int reach() const;
+    void simulate(std::vector<float> &heights, int width, int length, float x, float z) const;
+
+public:
+    HydraulicErosion();
+
+    void erode(std::vector<float> &heights, int width, int length, int seed, int droplets) const;
+
+    // Erodes noise generated from config a few times, printing the time
+    // each run took and whether every run gave the same heights
+    static void benchmark(const TerrainConfig &config);
+};
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <iostream>
+
+#include "job_system.hpp"
+
+using namespace std;
+
+// The queue owned by the current thread. Threads that aren't workers
+// share the main thread's queue.
+static thread_local int t_queueIndex = 0;
+
+Job::Job(function<void()> work) : m_work(move(work)), m_pending(1), m_finished(false) {}
+
+bool Job::isFinished() const {
+    return m_finished;
+}
+
+JobSystem::JobSystem() : m_queued(0), m_nextWorker(0), m_stopping(false) {
+    int workers = max(1, int(thread::hardware_concurrency()) - 1);
+    for (int i = 0; i <= workers; i++) {
+        m_queues.emplace_back(new worker_queue());
+    }
+    for (int i = 1; i <= workers; i++) {
+        m_threads.emplace_back(&JobSystem::workerLoop, this, i);
+    }
+    cout << "Started job system with " << workers << " worker threads" << endl;
+}
+
+JobSystem::~JobSystem() {
+    {
+        lock_guard<mutex> lock(m_sleepMutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for (thread &t : m_threads) {
+        t.join();
+    }
+}
+
+JobSystem & JobSystem::instance() {
+    static JobSystem system;
+    return system;
+}
+
+void JobSystem::workerLoop(int index) {
+    t_queueIndex = index;
+    while (!m_stopping) {
+        if (!runOne()) {
+            unique_lock<mutex> lock(m_sleepMutex);
+            m_wake.wait(lock, [this] { return m_queued > 0 || m_stopping; });
+        }
+    }
+}
+
+JobHandle JobSystem::create(function<void()> work) {
+    return make_shared<Job>(move(work));
+}
+
+// job will not start before dependency finishes. Must be called before
+// job is submitted.
+void JobSystem::depend(const JobHandle &job, const JobHandle &dependency) {
+    job->m_pending++;
+    {
+        lock_guard<mutex> lock(dependency->m_mutex);
+        if (!dependency->m_finished) {
+            dependency->m_continuations.push_back(job);
+            return;
+        }
+    }
+    if (dependency->m_error) {
+        lock_guard<mutex> lock(job->m_mutex);
+        if (!job->m_error) job->m_error = dependency->m_error;
+    }
+    release(job);
+}
+
+void JobSystem::submit(const JobHandle &job) {
+    release(job);
+}
+
+JobHandle JobSystem::run(function<void()> work) {
+    JobHandle job = create(move(work));
+    submit(job);
+    return job;
+}
+
+// Workers are taken in turn, so background jobs spread out
+JobHandle JobSystem::runOnWorker(function<void()> work) {
+    JobHandle job = create(move(work));
+    job->m_pending--;
+    enqueue(job, 1 + m_nextWorker++ % m_threads.size());
+    return job;
+}
+
+// Rethrows anything the job, or a job it depended on, threw
+void JobSystem::wait(const JobHandle &job) {
+    while (!job->isFinished()) {
+        if (!runOne()) this_thread::yield();
+    }
+    if (job->m_error) rethrow_exception(job->m_error);
+}
+
+void JobSystem::waitOnly(const JobHandle &job) {
+    while (!job->isFinished()) {
+        JobHandle next = takeOwn(t_queueIndex, job.get());
+        if (next) execute(next);
+        else this_thread::yield();
+    }
+    if (job->m_error) rethrow_exception(job->m_error);
+}
+
+JobHandle JobSystem::parallelFor(int begin, int end, int grain, function<void(int, int)> body) {
+    if (grain <= 0) {
+        grain = max(1, (end - begin) / (int(m_queues.size()) * 4));
+    }
+
+    JobHandle done = create([] {});
+    for (int b = begin; b < end; b += grain) {
+        int e = min(end, b + grain);
+        JobHandle chunk = create([body, b, e] { body(b, e); });
+        chunk->m_group = done.get();
+        depend(done, chunk);
+        submit(chunk);
+    }
+    submit(done);
+    return done;
+}
+
+int JobSystem::getThreadCount() const {
+    return m_queues.size();
+}
+
+void JobSystem::release(const JobHandle &job) {
+    if (--job->m_pending == 0) enqueue(job);
+}
+
+void JobSystem::enqueue(const JobHandle &job) {
+    enqueue(job, t_queueIndex);
+}
+
+void JobSystem::enqueue(const JobHandle &job, int index) {
+    worker_queue &queue = *m_queues[index];
+    {
+        lock_guard<mutex> lock(queue.mutex);
+        queue.jobs.push_back(job);
+    }
+    m_queued++;
+    {
+        lock_guard<mutex> lock(m_sleepMutex);
+    }
+    m_wake.notify_one();
+}
+
+// Pops the newest job from our own queue, otherwise steals the oldest
+// from another
+JobHandle JobSystem::take(int index) {
+    {
+        worker_queue &own = *m_queues[index];
+        lock_guard<mutex> lock(own.mutex);
+        if (!own.jobs.empty()) {
+            JobHandle job = own.jobs.back();
+            own.jobs.pop_back();
+            m_queued--;
+            return job;
+        }
+    }
+    for (size_t i = 1; i < m_queues.size(); i++) {
+        worker_queue &victim = *m_queues[(index + i) % m_queues.size()];
+        lock_guard<mutex> lock(victim.mutex);
+        if (!victim.jobs.empty()) {
+            JobHandle job = victim.jobs.front();
+            victim.jobs.pop_front();
+            m_queued--;
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+// Removes the newest job of our own queue that is group or one of its
+// chunks. A parallelFor's chunks go on the queue of the thread calling it,
+// so none are missed unless a worker has stolen them.
+JobHandle JobSystem::takeOwn(int index, const Job *group) {
+    worker_queue &own = *m_queues[index];
+    lock_guard<mutex> lock(own.mutex);
+    for (auto it = own.jobs.rbegin(); it != own.jobs.rend(); ++it) {
+        if (it->get() == group || (*it)->m_group == group) {
+            JobHandle job = *it;
+            own.jobs.erase(next(it).base());
+            m_queued--;
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+bool JobSystem::runOne() {
+    JobHandle job = take(t_queueIndex);
+    if (!job) return false;
+    execute(job);
+    return true;
+}
+
+void JobSystem::execute(const JobHandle &job) {
+    // a failed dependency fails everything after it
+    if (!job->m_error) {
+        try {
+            job->m_work();
+        } catch (...) {
+            job->m_error = current_exception();
+        }
+    }
+    job->m_work = nullptr;
+
+    vector<JobHandle> continuations;
+    {
+        lock_guard<mutex> lock(job->m_mutex);
+        job->m_finished = true;
+        continuations.swap(job->m_continuations);
+    }
+    for (JobHandle &next : continuations) {
+        if (job->m_error) {
+            lock_guard<mutex> lock(next->m_mutex);
+            if (!next->m_error) next->m_error = job->m_error;
+        }
+        release(next);
+    }
+}
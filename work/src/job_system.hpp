@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A unit of work plus the jobs waiting on it. Jobs are created through
+// the JobSystem and only run once submitted and every dependency has
+// finished.
+class Job {
+private:
+    friend class JobSystem;
+
+    std::function<void()> m_work;
+    std::atomic<int> m_pending;     // unfinished dependencies, plus one until submitted
+    std::atomic<bool> m_finished;
+    std::exception_ptr m_error;     // set if this job or a dependency threw
+    const Job *m_group = nullptr;   // the job finishing the parallelFor this is a chunk of
+
+    std::mutex m_mutex;             // guards the continuations and error
+    std::vector<std::shared_ptr<Job>> m_continuations;
+
+public:
+    explicit Job(std::function<void()>);
+
+    bool isFinished() const;
+};
+
+typedef std::shared_ptr<Job> JobHandle;
+
+// Work-stealing thread pool. Every worker, plus the main thread, owns a
+// deque: jobs are pushed and popped at the back by their owner and stolen
+// from the front by idle workers. Threads waiting on a job help run
+// others rather than block, so jobs may wait on jobs.
+class JobSystem {
+private:
+    struct worker_queue {
+        std::mutex mutex;
+        std::deque<JobHandle> jobs;
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> m_queues; // queue 0 is the main thread's
+    std::vector<std::thread> m_threads;
+
+    std::atomic<int> m_queued;
+    std::atomic<unsigned> m_nextWorker;     // worker queue the next background job goes on
+    std::atomic<bool> m_stopping;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+
+    JobSystem();
+
+    void workerLoop(int index);
+    void release(const JobHandle &);
+    void enqueue(const JobHandle &);
+    void enqueue(const JobHandle &, int index);
+    JobHandle take(int index);
+    JobHandle takeOwn(int index, const Job *);
+    bool runOne();
+    void execute(const JobHandle &);
+
+public:
+    ~JobSystem();
+    JobSystem(const JobSystem &) = delete;
+    JobSystem & operator=(const JobSystem &) = delete;
+
+    static JobSystem & instance();
+
+    JobHandle create(std::function<void()>);
+    void depend(const JobHandle &job, const JobHandle &dependency);
+    void submit(const JobHandle &);
+    JobHandle run(std::function<void()>);
+    // Like run, but queued on a worker rather than the caller, so a
+    // thread that only waits with waitOnly never runs it
+    JobHandle runOnWorker(std::function<void()>);
+    void wait(const JobHandle &);
+
+    // Like wait, but only runs the job itself or the chunks of the
+    // parallelFor it finishes, yielding while workers run the rest. For the
+    // render thread, which must not pick up some long unrelated job.
+    void waitOnly(const JobHandle &);
+
+    // Splits [begin, end) into chunks of grain (0 picks one) and returns a
+    // job that finishes once every chunk has
+    JobHandle parallelFor(int begin, int end, int grain, std::function<void(int, int)>);
+
+    int getThreadCount() const;
+};
@@ -12,18 +12,33 @@
 //
 //----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <stdexcept>
 
+#include "camera_controller.hpp"
 #include "cgra_geometry.hpp"
 #include "cgra_math.hpp"
+#include "frame_uniforms.hpp"
+#include "frustum.hpp"
+#include "hydraulic_erosion.hpp"
+#include "occlusion_culler.hpp"
+#include "ocean.hpp"
 #include "simple_image.hpp"
 #include "simple_shader.hpp"
+#include "shader_program.hpp"
 #include "opengl.hpp"
+#include "reflection_update_policy.hpp"
+#include "render_target.hpp"
+#include "resolution_controller.hpp"
+#include "shadow_map.hpp"
+#include "shallow_water.hpp"
 #include "terrain.hpp"
+#include "terrain_config.hpp"
 #include "water_tile.hpp"
 
 using namespace std;
@@ -35,7 +50,7 @@ GLFWwindow* g_window;
 
 
 int base_seed = 1497779637;
-Terrain terrain = Terrain("./work/res/textures/grass.jpg", base_seed); // Maybe set this seed based on a ui field if I have time.
+Terrain terrain("./work/res/textures/grass.jpg", base_seed); // Maybe set this seed based on a ui field if I have time.
 
 
 // Projection values
@@ -49,14 +64,12 @@ float g_zfar = 1000.0;
 //
 bool g_leftMouseDown = false;
 vec2 g_mousePosition;
-float g_pitch = 15;
-float g_yaw = -45;
 
-//camera position
+//camera position, orbiting or walking over the terrain, toggled with 'F'
 //
-float distToCamera = 150.0f;
+CameraController g_camera;
+double g_lastCameraTime = 0.0;
 vec4 g_camera_position = vec4(0.0, 0.0, 25.0, 1.0);
-vec3 g_camera_direction = vec3(0.0, 0.0, 0.0);
 vec3 g_camera_up = vec3(0.0, 1.0, 0.0);
 
 // light position
@@ -68,12 +81,73 @@ vec4 g_light_pos = vec4(-100.0, 50.0, -100.0, 1.0);
 //
 bool g_useShader = false;
 GLuint g_texture = 0;
-GLuint g_shader = 0;
-GLuint g_waterShader = 0;
+ShaderProgram g_shader;
+ShaderProgram g_waterShader;
+ShaderProgram g_shadowShader;
+
+// Per-frame and per-pass constants shared by the terrain and water programs
+//
+UniformBlock<FrameConstants> g_frameUniforms("FrameConstants", 0);
+UniformBlock<PassConstants> g_passUniforms("PassConstants", 1);
+
+// Camera matrices, rebuilt every frame in setupCamera
+//
+mat4 g_projection;
+mat4 g_view;
 
 // water height
 const float WATER_HEIGHT = 0.5f;
 
+// Offscreen targets shared by every water tile, as a fraction of the window
+// size. The reflection is blurred by the distortion anyway, so half
+// resolution is enough for it
+//
+RenderTarget g_reflectionTarget(0.5f);
+RenderTarget g_refractionTarget(1.0f);
+
+// Scales both targets down further to hold a GPU frame time, toggled with 'R'
+//
+ResolutionController g_resolutionController;
+
+// Decides when the water targets need re-rendering, toggled with 'A'.
+// g_sceneRevision is bumped whenever what the offscreen passes would
+// draw changes for reasons other than the camera
+//
+ReflectionUpdatePolicy g_reflectionPolicy;
+unsigned g_sceneRevision = 0;
+
+// Terrain shadows, only re-rendered when the terrain or light changes,
+// toggled with 'H'. g_terrainRevision is bumped whenever the terrain does
+//
+ShadowMap g_shadowMap;
+unsigned g_terrainRevision = 0;
+
+// FFT ocean displacing every water tile, simulated each frame water is drawn
+//
+unique_ptr<Ocean> g_ocean;
+
+// Shallow water flooding and draining over the terrain, and whether the sea
+// is raised to flood it
+//
+ShallowWater g_shallowWater;
+bool g_flooded = false;
+double g_lastWaterTime = 0.0;
+
+// Patches and tiles drawn or rejected by frustum culling over the current
+// frame, summed across every pass and shown in the window title
+//
+CullStats g_cullStats;
+double g_cullTitleTime = 0.0;
+
+// Rejects terrain patches and water tiles hidden behind the terrain from
+// the main camera, toggled with 'O'
+//
+OcclusionCuller g_occlusionCuller;
+
+// water colour and how far the distortion maps move each frame
+vec4 g_waterColor = vec4(0.0, 0.3, 0.5, 1.0);
+float g_waterDistortSpeed = 0.001f;
+
 //flags for rendering differnt parts of scene
 bool terrainToggle = true;
 bool waterToggle = true;
@@ -89,13 +163,38 @@ vec4 skyColor = vec4(0.0, 0.75, 1.0, 1.0);
 void cursorPosCallback(GLFWwindow* win, double xpos, double ypos) {
 	// cout << "Mouse Movement Callback :: xpos=" << xpos << "ypos=" << ypos << endl;
 	if (g_leftMouseDown) {
-		g_yaw -= (g_mousePosition.x - xpos) * 0.3;
-		g_pitch -= (g_mousePosition.y - ypos) * 0.3;
+		g_camera.rotate((xpos - g_mousePosition.x) * 0.3, (ypos - g_mousePosition.y) * 0.3);
 	}
 	g_mousePosition = vec2(xpos, ypos);
 }
 
 
+// Casts a ray from the camera through the cursor and prints where it
+// meets the terrain
+//
+void pickTerrain(GLFWwindow *win) {
+	int winWidth, winHeight;
+	glfwGetWindowSize(win, &winWidth, &winHeight);
+	if (winWidth <= 0 || winHeight <= 0) return;
+
+	// Unproject the cursor onto the near and far planes
+	float x = 2.0f * float(g_mousePosition.x) / winWidth - 1.0f;
+	float y = 1.0f - 2.0f * float(g_mousePosition.y) / winHeight;
+	mat4 inverseViewProjection = inverse(g_projection * g_view);
+	vec4 nearPoint = inverseViewProjection * vec4(x, y, -1.0f, 1.0f);
+	vec4 farPoint = inverseViewProjection * vec4(x, y, 1.0f, 1.0f);
+	vec3 origin = vec3(nearPoint.x, nearPoint.y, nearPoint.z) / nearPoint.w;
+	vec3 target = vec3(farPoint.x, farPoint.y, farPoint.z) / farPoint.w;
+
+	vec3 hit;
+	if (terrain.raycast(origin, normalize(target - origin), hit)) {
+		cout << "Picked terrain at " << hit << endl;
+	} else {
+		cout << "Picked nothing" << endl;
+	}
+}
+
+
 // Mouse Button callback
 // Called for mouse button event on since the last glfwPollEvents
 //
@@ -103,6 +202,8 @@ void mouseButtonCallback(GLFWwindow *win, int button, int action, int mods) {
 	// cout << "Mouse Button Callback :: button=" << button << "action=" << action << "mods=" << mods << endl;
 	if (button == GLFW_MOUSE_BUTTON_LEFT)
 		g_leftMouseDown = (action == GLFW_PRESS);
+	else if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS && terrainToggle)
+		pickTerrain(win);
 }
 
 
@@ -111,7 +212,7 @@ void mouseButtonCallback(GLFWwindow *win, int button, int action, int mods) {
 //
 void scrollCallback(GLFWwindow *win, double xoffset, double yoffset) {
 	// cout << "Scroll Callback :: xoffset=" << xoffset << "yoffset=" << yoffset << endl;
-	distToCamera -= yoffset * distToCamera * 0.2;
+	g_camera.zoom(yoffset);
 }
 
 
@@ -122,15 +223,46 @@ void keyCallback(GLFWwindow *win, int key, int scancode, int action, int mods) {
     if (key == GLFW_KEY_M && action == 0) {
         cout << "Toggling wire mode" << endl;
         terrain.toggleWireMode();
+        g_sceneRevision++;
     } else if (key == GLFW_KEY_K && action == 0) {
         cout << "Reseeding terrain" << endl;
         int seed = time(NULL);
         cout << "New Seed: " << seed << endl;
         terrain.reseedTerrain(seed);
+     }else if(key == GLFW_KEY_B && action == 0) {
+     	terrain.toggleHeightBlend();
      }else if(key == GLFW_KEY_T && action == 0) {
      	terrainToggle = !terrainToggle;
+     	g_sceneRevision++;
      }else if(key == GLFW_KEY_W && action == 0) {
      	waterToggle = !waterToggle;
+     	g_sceneRevision++;
+     }else if(key == GLFW_KEY_A && action == 0) {
+     	g_reflectionPolicy.setAmortise(!g_reflectionPolicy.isAmortising());
+     	cout << "Amortised water updates: " << g_reflectionPolicy.isAmortising() << endl;
+     }else if(key == GLFW_KEY_S && action == 0) {
+     	try {
+     		terrain.saveTerrain("./work/res/terrain_" + to_string(terrain.getSeed()) + ".terrain");
+     	} catch (const exception &e) {
+     		cerr << e.what() << endl;
+     	}
+     }else if(key == GLFW_KEY_F && action == 0) {
+     	g_camera.toggleMode();
+     }else if(key == GLFW_KEY_O && action == 0) {
+     	g_occlusionCuller.setEnabled(!g_occlusionCuller.isEnabled());
+     	cout << "Occlusion culling: " << g_occlusionCuller.isEnabled() << endl;
+     }else if(key == GLFW_KEY_H && action == 0) {
+     	g_shadowMap.setEnabled(!g_shadowMap.isEnabled());
+     	g_sceneRevision++;
+     	cout << "Shadows: " << g_shadowMap.isEnabled() << endl;
+     }else if(key == GLFW_KEY_L && action == 0) {
+     	g_flooded = !g_flooded;
+     	g_shallowWater.setSeaLevel(WATER_HEIGHT + (g_flooded ? terrain.getConfig().floodHeight : 0.0f));
+     	cout << "Flooding: " << g_flooded << endl;
+     }else if(key == GLFW_KEY_R && action == 0) {
+     	g_resolutionController.setEnabled(!g_resolutionController.isEnabled());
+     	cout << "Dynamic resolution: " << g_resolutionController.isEnabled()
+     		<< " (GPU frame time " << g_resolutionController.getGpuTime() << "ms)" << endl;
      }
 }
 
@@ -142,41 +274,56 @@ void charCallback(GLFWwindow *win, unsigned int c) {
 }
 
 
-// Sets up where and what the light is
-// Called once on start up
-// 
-void updateLight() {
-    // Basic Light - GL_LIGHT_0
-	float diffintensity[] = { 0.7f, 0.7f, 0.7f, 1.0f };
-	float ambient[] = { 0.3f, 0.3f, 0.3f, 1.0f };
-    float specular[] = {1.0, 1.0, 1.0, 1.0};
-
-	glLightfv(GL_LIGHT0, GL_POSITION, g_light_pos.dataPointer());
-	glLightfv(GL_LIGHT0, GL_DIFFUSE, diffintensity);
-	glLightfv(GL_LIGHT0, GL_AMBIENT, ambient);
-	glLightfv(GL_LIGHT0, GL_SPECULAR, specular);
-    
-    glEnable(GL_LIGHT0);
-}
-
 //initalise the shader programs
 void initShader() {
-	g_shader = makeShaderProgramFromFile({GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, { "./work/res/shaders/materialShader.vert", "./work/res/shaders/materialShader.frag" });
-	g_waterShader = makeShaderProgramFromFile({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, { "./work/res/shaders/waterShader.vert", "./work/res/shaders/waterShader.frag" });
+	g_shader = ShaderProgram::fromFiles({GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, { "./work/res/shaders/materialShader.vert", "./work/res/shaders/materialShader.frag" });
+	g_waterShader = ShaderProgram::fromFiles({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, { "./work/res/shaders/waterShader.vert", "./work/res/shaders/waterShader.frag" });
+	g_shadowShader = ShaderProgram::fromFiles({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, { "./work/res/shaders/materialShader.vert", "./work/res/shaders/shadowDepth.frag" });
+
+	g_frameUniforms.initialise();
+	g_frameUniforms.attach(g_shader);
+	g_frameUniforms.attach(g_waterShader);
+	g_frameUniforms.attach(g_shadowShader);
+	g_frameUniforms.values.distort = 1;
+
+	g_passUniforms.initialise();
+	g_passUniforms.attach(g_shader);
+	g_passUniforms.attach(g_waterShader);
+	g_passUniforms.attach(g_shadowShader);
+}
+
+// Uploads this frame's camera, light and water constants
+// Called once per frame, after the camera has been set up
+//
+void updateFrameUniforms() {
+	FrameConstants &frame = g_frameUniforms.values;
+	frame.projection = g_projection;
+	frame.view = g_view;
+	frame.reflectionViewProjection = g_reflectionPolicy.getViewProjection(ReflectionUpdatePolicy::REFLECTION);
+	frame.refractionViewProjection = g_reflectionPolicy.getViewProjection(ReflectionUpdatePolicy::REFRACTION);
+	frame.viewpos = g_camera_position;
+	frame.lightpos = g_light_pos;
+	frame.waterColor = g_waterColor;
+	frame.invDistort = -frame.distort;
+	g_frameUniforms.update();
+
+	// advance the distortion for the next frame
+	frame.distort += g_waterDistortSpeed;
 }
 
-// Updates the cameras position
+// Updates the cameras position, keeping it above the terrain
+// The arrow keys walk in walk mode
 //
 void updateCameraPos() {
-	float horDist = distToCamera * cos(radians(g_pitch));
-	float vertDist = distToCamera * sin(radians(g_pitch));
+	double now = glfwGetTime();
+	float dt = float(min(0.1, now - g_lastCameraTime));
+	g_lastCameraTime = now;
 
-	float offX = horDist * sin(radians(180 - g_yaw));
-	float offZ = horDist * cos(radians(180 - g_yaw));
+	float forward = (glfwGetKey(g_window, GLFW_KEY_UP) == GLFW_PRESS) - (glfwGetKey(g_window, GLFW_KEY_DOWN) == GLFW_PRESS);
+	float right = (glfwGetKey(g_window, GLFW_KEY_RIGHT) == GLFW_PRESS) - (glfwGetKey(g_window, GLFW_KEY_LEFT) == GLFW_PRESS);
+	g_camera.update(terrainToggle ? &terrain : nullptr, dt, forward, right);
 
-	g_camera_position.x = 0 - offX;
-	g_camera_position.y = vertDist;
-	g_camera_position.z = 0 - offZ;
+	g_camera_position = vec4(g_camera.getEye(), 1.0);
 }
 
 // Sets up where the camera is in the scene
@@ -186,103 +333,119 @@ void setupCamera(int width, int height) {
 	updateCameraPos();
 
 	// Set up the projection matrix
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(g_fovy, width / float(height), g_znear, g_zfar);
+	g_projection = mat4::perspectiveProjection(radians(g_fovy), width / float(height), g_znear, g_zfar);
+
+	// Set up the view matrix
+	vec3 eye = vec3(g_camera_position.x, g_camera_position.y, g_camera_position.z);
+	g_view = mat4::lookAt(eye, g_camera.getLookAt(), g_camera_up);
+}
+
+// Sets the view and clip plane used by the next scene pass
+//
+void setupPass(const mat4 &view, const vec4 &clipPlane) {
+	g_passUniforms.values.viewProjection = g_projection * view;
+	g_passUniforms.values.clipPlane = clipPlane;
+	g_passUniforms.update();
+}
 
-	// Set up the view part of the model view matrix
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+// Re-renders whichever shadow cascades are stale, from the light
+// Returns true if any were, so the water passes pick them up
+//
+bool updateShadows() {
+	vec3 eye = vec3(g_camera_position.x, g_camera_position.y, g_camera_position.z);
+	vec3 light = vec3(g_light_pos.x, g_light_pos.y, g_light_pos.z);
+	bool rendered = g_shadowMap.update(eye, light, terrain.getBounds(), g_terrainRevision, [](const mat4 &lightViewProjection) {
+		g_passUniforms.values.viewProjection = lightViewProjection;
+		g_passUniforms.values.clipPlane = vec4(0.0, 0.0, 0.0, 1.0);
+		g_passUniforms.update();
+		CullStats unused;
+		// hills between the light and the cascade are outside its depth
+		// range but still cast onto it
+		terrain.renderTerrain(g_shadowShader, Frustum::sides(lightViewProjection), nullptr, unused);
+	});
+	g_shadowMap.bind(g_shader, 5);
+	return rendered;
+}
 
-	gluLookAt(g_camera_position.x, g_camera_position.y, g_camera_position.z,	//position
-		g_camera_direction.x, g_camera_direction.y, g_camera_direction.z,		//direction
-		g_camera_up.x, g_camera_up.y, g_camera_up.z);							//up
+// Shows the last frame's culling counts in the title twice a second
+//
+void updateCullTitle() {
+	double now = glfwGetTime();
+	if (now - g_cullTitleTime < 0.5) return;
+	g_cullTitleTime = now;
+
+	string title = "Jasen and Matt - Envrionment Simulation (visible: " + to_string(g_cullStats.visible) +
+		", culled: " + to_string(g_cullStats.culled) + ", occluded: " + to_string(g_cullStats.occluded) + ")";
+	glfwSetWindowTitle(g_window, title.c_str());
 }
 
 // Draw function
 //
-void render() {
+void render(const Frustum &frustum, const OcclusionCuller *occlusion) {
 
 	// set sky color
 	glClearColor(skyColor.r, skyColor.g, skyColor.b, skyColor.a);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
 
 	// Enable flags for normal rendering
 	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_LIGHTING);
-	glEnable(GL_NORMALIZE);
 
 	//only render terrain if terrain toggle set
 	if(terrainToggle) {
-		terrain.renderTerrain(g_shader);
+		terrain.renderTerrain(g_shader, frustum, occlusion, g_cullStats);
 	} 
 	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_NORMALIZE);
 }
 
-//render the scene to the provided texture using the provided framebuffer
+//render the scene into the provided render target
 //
-void renderToBuffer(Watertile wt, GLuint buffer, GLuint texture, double clipPlane[4], bool reflection) {
+void renderToBuffer(const RenderTarget &target, float waterHeight, vec4 clipPlane, bool reflection) {
 	//set buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, buffer);
-	glActiveTexture(GL_TEXTURE0);
-	//set texture
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glEnable(GL_TEXTURE_2D);
-	//set cky color and clear scene
-	glClearColor(skyColor.r, skyColor.g, skyColor.b, skyColor.a);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	target.bind();
 
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS);
 
-	glPushMatrix();
+	mat4 view = g_view;
 	if (reflection) {
 		//translate up so that relfection and scene line up correctly
-		glTranslatef(0.0f, 2.0*wt.getWaterPosition().y, 0.0f);
-		//invert scene for reflection
-		glScalef(1.0, -1.0, 1.0);
+		//and invert scene for reflection
+		view = view * mat4::translate(0.0f, 2.0f*waterHeight, 0.0f) * mat4::scale(1.0f, -1.0f, 1.0f);
 	}
 	//use clip plane to remove veticies that are not wanted in reflection/refraction
-	glEnable(GL_CLIP_PLANE0);
-	glClipPlane(GL_CLIP_PLANE0, clipPlane);
-	render();
-	glDisable(GL_CLIP_PLANE0);
-	glPopMatrix();
+	setupPass(view, clipPlane);
+	glEnable(GL_CLIP_DISTANCE0);
+	//the refraction pass shares the main camera, so the main view's occlusion
+	//still applies: where terrain hides a patch it hides the water in front too
+	render(Frustum(g_projection * view, clipPlane), reflection ? nullptr : &g_occlusionCuller);
+	glDisable(GL_CLIP_DISTANCE0);
 
 	//disable framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	
 	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
 }
 
-//render reflection and refraction for all watertiles 
-vector<Watertile> renderRelfectRefract(vector<Watertile> tiles, int tileWidth) {
-	for (int i = 0; i < tileWidth; i++) {
-		for (int j = 0; j < tileWidth; j++) {
-			tiles[tileWidth*i + j].setCameraPos(g_camera_position);
+//render reflection and refraction for the water plane
+//every tile sits at WATER_HEIGHT, so one pair of passes serves them all
+//passes the update policy considers current are skipped
+void renderRelfectRefract(float waterHeight) {
+	//set clip plane for reflection
+	vec4 clipPlane = vec4(0.0, 1.0, 0.0, -waterHeight);
 
-			//set clip plane for reflection
-			double clipPlane[4] = { 0.0, 1.0, 0.0, -tiles[tileWidth*i + j].getWaterPosition().y };
-
-			//render reflection to reflection bufer
-			GLuint reflBuf = tiles[tileWidth *i + j].getReflectionBuffer();
-			GLuint reflTex = tiles[tileWidth*i + j].getReflectionTexture();
-			renderToBuffer(tiles[tileWidth*i + j], reflBuf, reflTex, clipPlane, true);
+	//render reflection to reflection bufer
+	if (g_reflectionPolicy.needsUpdate(ReflectionUpdatePolicy::REFLECTION)) {
+		renderToBuffer(g_reflectionTarget, waterHeight, clipPlane, true);
+	}
 
-			//update clip plane for refraction
-			clipPlane[1] = -1.0;
-			clipPlane[3] = tiles[tileWidth*i + j].getWaterPosition().y;
+	//update clip plane for refraction
+	clipPlane.y = -1.0;
+	clipPlane.w = waterHeight;
 
-			//render refraction to refraction buffer
-			GLuint refrBuf = tiles[tileWidth*i + j].getRefractionBuffer();
-			GLuint refrTex = tiles[tileWidth*i + j].getRefractionTexture();
-			renderToBuffer(tiles[tileWidth*i + j], refrBuf, refrTex, clipPlane, false);
-		}
+	//render refraction to refraction buffer
+	if (g_reflectionPolicy.needsUpdate(ReflectionUpdatePolicy::REFRACTION)) {
+		renderToBuffer(g_refractionTarget, waterHeight, clipPlane, false);
 	}
-	return tiles;
 }
 
 
@@ -294,6 +457,37 @@ void APIENTRY debugCallbackARB(GLenum, GLenum, GLuint, GLenum, GLsizei, const GL
 // 
 int main(int argc, char **argv) {
 
+	// Terrain settings, from the config file then the command line
+	TerrainConfig terrainConfig;
+	terrainConfig.seed = base_seed;
+	try {
+		terrainConfig.loadFile("./work/res/terrain.cfg");
+		terrainConfig.parseArguments(argc, argv);
+		terrain.configure(terrainConfig);
+	} catch (const exception &e) {
+		cerr << e.what() << endl;
+		abort(); // Unrecoverable error
+	}
+	// a terrain file may have replaced the settings
+	terrainConfig = terrain.getConfig();
+
+	// Times erosion of the configured terrain and exits, without a window
+	for (int i = 1; i < argc; i++) {
+		if (string(argv[i]) == "--bench-erosion") {
+			HydraulicErosion::benchmark(terrainConfig);
+			return 0;
+		}
+		if (string(argv[i]) == "--bench-fft") {
+			Ocean::benchmark(terrainConfig);
+			return 0;
+		}
+	}
+	terrainConfig.print();
+	terrain.printMemoryEstimate();
+
+	// Keep the far plane past the edge of large terrains
+	g_zfar = max(g_zfar, terrainConfig.extent * 4);
+
 	// Initialize the GLFW library
 	if (!glfwInit()) {
 		cerr << "Error: Could not initialize GLFW" << endl;
@@ -304,6 +498,12 @@ int main(int argc, char **argv) {
 	int glfwMajor, glfwMinor, glfwRevision;
 	glfwGetVersion(&glfwMajor, &glfwMinor, &glfwRevision);
 
+	// Request a core profile context, everything is drawn with VAOs and shaders
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
 	// Create a windowed mode window and its OpenGL context
 	g_window = glfwCreateWindow(640, 480, "Jasen and Matt - Envrionment Simulation", nullptr, nullptr);
 	if (!g_window) {
@@ -323,6 +523,8 @@ int main(int argc, char **argv) {
 		cerr << "Error: " << glewGetErrorString(err) << endl;
 		abort(); // Unrecoverable error
 	}
+	// glewInit can raise GL_INVALID_ENUM on a core context, which is harmless
+	glGetError();
 
 	// Print out our OpenGL verisions
 	cout << "Using OpenGL " << glGetString(GL_VERSION) << endl;
@@ -349,14 +551,25 @@ int main(int argc, char **argv) {
 		cout << "GL_ARB_debug_output not available. No worries." << endl;
 	}
 
-	updateLight();
 	initShader();
-
-    terrain.setupTerrain();
+	g_resolutionController.initialise();
+	g_shadowMap.initialise();
+	g_ocean.reset(new Ocean(terrainConfig.oceanResolution, terrainConfig.oceanSize, terrainConfig.oceanWind,
+		terrainConfig.oceanChoppiness, terrainConfig.oceanHeight, terrainConfig.seed));
+
+	try {
+		terrain.setWaterLevel(WATER_HEIGHT);
+		terrain.setupTerrain();
+		g_shallowWater.setSeaLevel(WATER_HEIGHT);
+		g_shallowWater.reset(terrain, terrainConfig.waterCells, terrainConfig.waterRate);
+	} catch (const exception &e) {
+		cerr << e.what() << endl;
+		abort(); // Unrecoverable error
+	}
 
     vector<Watertile> tiles;
-	int tileWidth = 20; // width of each tile
 	int waterWidth = 5; // amount of tiles 
+	int tileWidth = int(terrainConfig.extent / waterWidth); // width of each tile
 	for (int i = 0; i < waterWidth; i++) {
 		for (int j = 0; j < waterWidth; j++) {
 			//calculate the position of the tile
@@ -364,12 +577,15 @@ int main(int argc, char **argv) {
 			float half = totalLength/2;
 			float xoff = (half - ((waterWidth - j) * tileWidth)) + tileWidth/2;
 			float yoff = (half - ((waterWidth - i) * tileWidth)) + tileWidth/2;
-			tiles.push_back(Watertile(vec4(xoff, WATER_HEIGHT,yoff, 0.0f), g_light_pos, g_waterShader, tileWidth));
+			tiles.push_back(Watertile(vec4(xoff, WATER_HEIGHT,yoff, 0.0f), g_waterShader, tileWidth));
+			tiles.back().setWaveHeight(g_ocean->getWaveHeight());
 		}
 	}
 
 	//loadSky();
 
+	vector<Watertile *> visibleTiles;
+
 	// Loop until the user closes the window
 	while (!glfwWindowShouldClose(g_window)) {
 
@@ -377,22 +593,84 @@ int main(int argc, char **argv) {
 		int width, height;
 		glfwGetFramebufferSize(g_window, &width, &height);
 
+		g_resolutionController.beginFrame();
+
+		// Keep the water targets matched to the window and dynamic scale
+		float dynamicScale = g_resolutionController.getScale();
+		if (g_reflectionTarget.resize(width, height, dynamicScale)) g_sceneRevision++;
+		if (g_refractionTarget.resize(width, height, dynamicScale)) g_sceneRevision++;
+
+		// Swap in a finished reseed, or step the blend to it
+		if (terrain.update()) {
+			g_sceneRevision++;
+			g_terrainRevision++;
+		}
+
+		// Start the next batch of shallow water steps on a worker, restarting it on a reseed
+		double now = glfwGetTime();
+		if (g_shallowWater.update(terrain, min(0.1, now - g_lastWaterTime))) {
+			for (Watertile &tile : tiles) {
+				tile.setSurfaceTop(g_shallowWater.getHighest());
+			}
+		}
+		g_lastWaterTime = now;
+
 		setupCamera(width, height);
-		updateLight();
+		if (terrainToggle && updateShadows()) g_sceneRevision++;
+		g_cullStats = CullStats();
+
+		// Only tiles inside the view need drawing, and the offscreen
+		// passes are skipped entirely when none of them are
+		Frustum viewFrustum(g_projection * g_view);
+
+		// Rasterise the terrain's occluder from the main camera, as long
+		// as the camera is above it and it can't hide anything wrongly
+		vec3 eye = vec3(g_camera_position.x, g_camera_position.y, g_camera_position.z);
+		if (terrainToggle && terrain.isAbove(eye)) {
+			g_occlusionCuller.build(g_projection * g_view, width, height, terrain.getOccluderPoints(), terrain.getOccluderIndices());
+		} else {
+			g_occlusionCuller.invalidate();
+		}
+
+		visibleTiles.clear();
+		if (waterToggle) {
+			for (Watertile &tile : tiles) {
+				if (!viewFrustum.intersects(tile.getBounds())) {
+					g_cullStats.culled++;
+				} else if (g_occlusionCuller.isOccluded(tile.getBounds())) {
+					g_cullStats.occluded++;
+				} else {
+					visibleTiles.push_back(&tile);
+					g_cullStats.visible++;
+				}
+			}
+		}
 
-		if(waterToggle) {
-        	tiles = renderRelfectRefract(tiles, waterWidth);
+		if (!visibleTiles.empty()) {
+			Ocean::timings unused;
+			g_ocean->simulate(float(glfwGetTime()), unused);
+			g_ocean->upload();
+			g_shallowWater.upload();
+			g_reflectionPolicy.beginFrame(g_projection * g_view, g_sceneRevision, g_resolutionController.isOverBudget());
+		}
+		updateFrameUniforms();
+
+		if (!visibleTiles.empty()) {
+        	renderRelfectRefract(WATER_HEIGHT);
 		}
 
 		// Main Render
-		render();
-		if(waterToggle) {
-	        for (int i = 0; i < pow(waterWidth, 2); i++) {
-	            //render water from framebuffers to water quad
-	           tiles[i].renderWater();
-	        }
-    	}
+		glViewport(0, 0, width, height);
+		setupPass(g_view, vec4(0.0, 0.0, 0.0, 1.0));
+		render(viewFrustum, &g_occlusionCuller);
+		for (Watertile *tile : visibleTiles) {
+			//render water from framebuffers to water quad
+			tile->renderWater(g_reflectionTarget, g_refractionTarget, *g_ocean, g_shallowWater, eye);
+		}
         
+		g_resolutionController.endFrame();
+		updateCullTitle();
+
 		// Swap front and back buffers
 		glfwSwapBuffers(g_window);
 
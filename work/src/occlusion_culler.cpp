@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cmath>
+
+#include "cgra_math.hpp"
+#include "occlusion_culler.hpp"
+
+using namespace std;
+using namespace cgra;
+
+// points closer to the eye than this in clip w are treated as crossing
+// the near plane: such occluder triangles are dropped and such boxes
+// are always visible
+static const float NEAR_W = 1e-3f;
+
+OcclusionCuller::OcclusionCuller(int resolution) : m_resolution(resolution) {}
+
+void OcclusionCuller::resize(int winWidth, int winHeight) {
+    int width = m_resolution;
+    int height = max(1, int(m_resolution * float(winHeight) / max(1, winWidth)));
+    if (!m_levels.empty() && m_levels[0].width == width && m_levels[0].height == height) return;
+
+    // Each level halves the one before, down to a single texel
+    m_levels.clear();
+    while (true) {
+        depth_level level;
+        level.width = width;
+        level.height = height;
+        level.depth.resize(width * height);
+        m_levels.push_back(level);
+        if (width == 1 && height == 1) break;
+        width = max(1, (width + 1) / 2);
+        height = max(1, (height + 1) / 2);
+    }
+}
+
+void OcclusionCuller::build(const mat4 &viewProjection, int winWidth, int winHeight,
+                            const vector<vec3> &points, const vector<GLuint> &indices) {
+    m_valid = false;
+    if (!m_enabled || winWidth <= 0 || winHeight <= 0) return;
+
+    resize(winWidth, winHeight);
+    m_viewProjection = viewProjection;
+    fill(m_levels[0].depth.begin(), m_levels[0].depth.end(), 1.0f);
+
+    m_clip.resize(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        m_clip[i] = viewProjection * vec4(points[i], 1.0f);
+    }
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        rasterise(m_clip[indices[i]], m_clip[indices[i + 1]], m_clip[indices[i + 2]]);
+    }
+
+    buildPyramid();
+    m_valid = true;
+}
+
+void OcclusionCuller::invalidate() {
+    m_valid = false;
+}
+
+// Scanline-free half-space rasteriser, sampling at pixel centres and
+// keeping the nearest depth. Both windings are drawn.
+void OcclusionCuller::rasterise(const vec4 &c0, const vec4 &c1, const vec4 &c2) {
+    if (c0.w < NEAR_W || c1.w < NEAR_W || c2.w < NEAR_W) return;
+
+    depth_level &level = m_levels[0];
+    vec3 s[3];
+    const vec4 *c[3] = { &c0, &c1, &c2 };
+    for (int i = 0; i < 3; i++) {
+        s[i] = vec3((c[i]->x / c[i]->w * 0.5f + 0.5f) * level.width,
+                    (c[i]->y / c[i]->w * 0.5f + 0.5f) * level.height,
+                    c[i]->z / c[i]->w * 0.5f + 0.5f);
+    }
+
+    float area = (s[1].x - s[0].x) * (s[2].y - s[0].y) - (s[1].y - s[0].y) * (s[2].x - s[0].x);
+    if (fabs(area) < 1e-6f) return;
+
+    int x0 = max(0, int(floor(min(s[0].x, min(s[1].x, s[2].x)))));
+    int x1 = min(level.width - 1, int(ceil(max(s[0].x, max(s[1].x, s[2].x)))));
+    int y0 = max(0, int(floor(min(s[0].y, min(s[1].y, s[2].y)))));
+    int y1 = min(level.height - 1, int(ceil(max(s[0].y, max(s[1].y, s[2].y)))));
+
+    for (int y = y0; y <= y1; y++) {
+        float py = y + 0.5f;
+        for (int x = x0; x <= x1; x++) {
+            float px = x + 0.5f;
+            // barycentric weights from the edge functions
+            float w0 = ((s[2].x - s[1].x) * (py - s[1].y) - (s[2].y - s[1].y) * (px - s[1].x)) / area;
+            float w1 = ((s[0].x - s[2].x) * (py - s[2].y) - (s[0].y - s[2].y) * (px - s[2].x)) / area;
+            float w2 = 1.0f - w0 - w1;
+            if (w0 < 0 || w1 < 0 || w2 < 0) continue;
+
+            float z = w0 * s[0].z + w1 * s[1].z + w2 * s[2].z;
+            float &d = level.depth[y * level.width + x];
+            d = min(d, z);
+        }
+    }
+}
+
+// Each texel of a level holds the farthest depth of the 2x2 below it
+void OcclusionCuller::buildPyramid() {
+    for (size_t l = 1; l < m_levels.size(); l++) {
+        const depth_level &src = m_levels[l - 1];
+        depth_level &dst = m_levels[l];
+        for (int y = 0; y < dst.height; y++) {
+            int sy0 = min(src.height - 1, y * 2);
+            int sy1 = min(src.height - 1, y * 2 + 1);
+            for (int x = 0; x < dst.width; x++) {
+                int sx0 = min(src.width - 1, x * 2);
+                int sx1 = min(src.width - 1, x * 2 + 1);
+                dst.depth[y * dst.width + x] = max(
+                    max(src.depth[sy0 * src.width + sx0], src.depth[sy0 * src.width + sx1]),
+                    max(src.depth[sy1 * src.width + sx0], src.depth[sy1 * src.width + sx1]));
+            }
+        }
+    }
+}
+
+bool OcclusionCuller::isOccluded(const AABB &box) const {
+    if (!m_valid || box.isEmpty()) return false;
+
+    const depth_level &base = m_levels[0];
+    float minX = base.width, maxX = 0, minY = base.height, maxY = 0, minZ = 1;
+    for (int i = 0; i < 8; i++) {
+        vec3 corner((i & 1) ? box.max.x : box.min.x,
+                    (i & 2) ? box.max.y : box.min.y,
+                    (i & 4) ? box.max.z : box.min.z);
+        vec4 clip = m_viewProjection * vec4(corner, 1.0f);
+        if (clip.w < NEAR_W) return false;
+
+        float x = (clip.x / clip.w * 0.5f + 0.5f) * base.width;
+        float y = (clip.y / clip.w * 0.5f + 0.5f) * base.height;
+        minX = min(minX, x);
+        maxX = max(maxX, x);
+        minY = min(minY, y);
+        maxY = max(maxY, y);
+        minZ = min(minZ, clip.z / clip.w * 0.5f + 0.5f);
+    }
+
+    // Off screen boxes are left to the frustum test
+    if (maxX < 0 || maxY < 0 || minX > base.width || minY > base.height) return false;
+    int x0 = max(0, int(floor(minX)));
+    int x1 = min(base.width - 1, int(floor(maxX)));
+    int y0 = max(0, int(floor(minY)));
+    int y1 = min(base.height - 1, int(floor(maxY)));
+
+    // Pick the level where the box covers at most 2x2 texels
+    size_t l = 0;
+    while (l + 1 < m_levels.size() && ((x1 >> l) - (x0 >> l) > 1 || (y1 >> l) - (y0 >> l) > 1)) {
+        l++;
+    }
+
+    const depth_level &level = m_levels[l];
+    for (int y = y0 >> l; y <= min(level.height - 1, y1 >> l); y++) {
+        for (int x = x0 >> l; x <= min(level.width - 1, x1 >> l); x++) {
+            if (level.depth[y * level.width + x] >= minZ) return false;
+        }
+    }
+    return true;
+}
+
+void OcclusionCuller::setEnabled(bool enabled) {
+    m_enabled = enabled;
+    if (!enabled) m_valid = false;
+}
+
+bool OcclusionCuller::isEnabled() const {
+    return m_enabled;
+}
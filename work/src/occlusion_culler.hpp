@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "cgra_math.hpp"
+#include "frustum.hpp"
+#include "opengl.hpp"
+
+// Occlusion culling against a small CPU rasterised depth buffer. The
+// terrain's occluder mesh is drawn into it each frame, reduced into a
+// hierarchical max-depth pyramid, and bounding boxes are rejected when
+// every texel they cover holds nearer occluder depth than the box.
+class OcclusionCuller {
+private:
+    struct depth_level {
+        int width = 0;
+        int height = 0;
+        std::vector<float> depth;   // depth in [0, 1], 1 is the far plane
+    };
+
+    int m_resolution;               // width of level 0, height follows the window aspect
+    std::vector<depth_level> m_levels;
+    std::vector<cgra::vec4> m_clip; // occluder points in clip space
+    cgra::mat4 m_viewProjection;
+
+    bool m_enabled = true;
+    bool m_valid = false;
+
+    void resize(int winWidth, int winHeight);
+    void rasterise(const cgra::vec4 &, const cgra::vec4 &, const cgra::vec4 &);
+    void buildPyramid();
+
+public:
+    explicit OcclusionCuller(int resolution = 128);
+
+    void build(const cgra::mat4 &viewProjection, int winWidth, int winHeight,
+               const std::vector<cgra::vec3> &points, const std::vector<GLuint> &indices);
+    void invalidate();
+
+    bool isOccluded(const AABB &) const;
+
+    void setEnabled(bool);
+    bool isEnabled() const;
+};
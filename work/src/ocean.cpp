@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "cgra_math.hpp"
+#include "job_system.hpp"
+#include "ocean.hpp"
+
+using namespace std;
+using namespace cgra;
+
+static const float GRAVITY = 9.81f;
+static const float REPEAT_SECONDS = 200;   // frequencies are rounded so the waves loop over this
+
+static double millisecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// splitmix64, so the sea is the same with every standard library
+static uint64_t nextRandom(uint64_t &state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// A pair of independent standard normals, by Box-Muller
+static complex<float> randomGaussian(uint64_t &state) {
+    float u = ((nextRandom(state) >> 40) + 1) * (1.0f / 16777217.0f);
+    float v = (nextRandom(state) >> 40) * (1.0f / 16777216.0f);
+    float r = sqrt(-2 * log(u));
+    return complex<float>(r * cos(2 * float(math::pi()) * v), r * sin(2 * float(math::pi()) * v));
+}
+
+Ocean::Ocean(int resolution, float size, float windSpeed, float choppiness, float height, int seed)
+    : m_resolution(resolution), m_size(size), m_choppiness(choppiness), m_waveHeight(height * 4) {
+    if (resolution < STRIPE || (resolution & (resolution - 1)) != 0) {
+        throw runtime_error("Error: Ocean resolution must be a power of two, at least " + to_string(STRIPE));
+    }
+    int n = resolution;
+    size_t count = size_t(n) * n;
+
+    // Phillips spectrum, with waves much shorter than the largest the
+    // wind makes damped, and those running against the wind mostly gone
+    float windX = 1 / sqrt(1.36f), windZ = 0.6f / sqrt(1.36f);
+    float largest = windSpeed * windSpeed / GRAVITY;
+    float smallest = largest * 0.001f;
+    float baseFrequency = 2 * float(math::pi()) / REPEAT_SECONDS;
+
+    m_h0.assign(count, 0);
+    m_h0Conj.assign(count, 0);
+    m_omega.assign(count, 0);
+    m_kx.assign(count, 0);
+    m_kz.assign(count, 0);
+    vector<float> amplitude(count, 0);
+    uint64_t state = uint64_t(uint32_t(seed)) * 0x2545F4914F6CDD1Dull;
+    double variance = 0;
+    for (int z = 0; z < n; z++) {
+        for (int x = 0; x < n; x++) {
+            size_t i = size_t(z) * n + x;
+            float kx = 2 * float(math::pi()) * (x - n / 2) / size;
+            float kz = 2 * float(math::pi()) * (z - n / 2) / size;
+            float k = sqrt(kx * kx + kz * kz);
+            complex<float> gaussian = randomGaussian(state);
+            // the first row and column are the Nyquist waves, which have
+            // no opposite on the grid, so would leak between packed outputs
+            if (x == 0 || z == 0 || k < 1e-6f) continue;
+
+            float along = (kx * windX + kz * windZ) / k;
+            float phillips = exp(-1 / (k * largest * k * largest)) / (k * k * k * k) * along * along
+                * exp(-k * k * smallest * smallest);
+            if (along < 0) phillips *= 0.07f;
+            amplitude[i] = sqrt(phillips / 2);
+            m_h0[i] = gaussian * amplitude[i];
+            m_omega[i] = floor(sqrt(GRAVITY * k) / baseFrequency) * baseFrequency;
+            m_kx[i] = kx / k;
+            m_kz[i] = kz / k;
+            variance += 2 * norm(m_h0[i]);
+        }
+    }
+
+    // Scale to the asked for height, then pair each wave with its opposite
+    float scale = variance > 0 ? float(height / sqrt(variance)) : 0;
+    for (int z = 0; z < n; z++) {
+        for (int x = 0; x < n; x++) {
+            m_h0[size_t(z) * n + x] *= scale;
+        }
+    }
+    for (int z = 0; z < n; z++) {
+        for (int x = 0; x < n; x++) {
+            size_t opposite = size_t((n - z) % n) * n + (n - x) % n;
+            m_h0Conj[size_t(z) * n + x] = conj(m_h0[opposite]);
+        }
+    }
+
+    m_reverse.resize(n);
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        }
+        m_reverse[i] = r;
+    }
+    m_twiddleRe.assign(n, 0);
+    m_twiddleIm.assign(n, 0);
+    for (int h = 1; h < n; h *= 2) {
+        for (int j = 0; j < h; j++) {
+            m_twiddleRe[h + j] = cos(float(math::pi()) * j / h);
+            m_twiddleIm[h + j] = sin(float(math::pi()) * j / h);
+        }
+    }
+
+    for (int g = 0; g < 3; g++) {
+        m_re[g].assign(count, 0);
+        m_im[g].assign(count, 0);
+    }
+    m_scratchRe.assign(count, 0);
+    m_scratchIm.assign(count, 0);
+    m_displacement.assign(count * 4, 0);
+    m_slopes.assign(count * 2, 0);
+}
+
+// Inverse FFT down every column, in place. Each stripe of columns is
+// copied out bit reverse permuted, so its rows are packed together rather
+// than a power of two apart, then every butterfly combines two rows of it.
+void Ocean::fftColumns(float *re, float *im) const {
+    int n = m_resolution;
+    JobSystem &jobs = JobSystem::instance();
+    jobs.waitOnly(jobs.parallelFor(0, n / STRIPE, 1, [&](int begin, int end) {
+        vector<float> stripeRe(size_t(n) * STRIPE), stripeIm(size_t(n) * STRIPE);
+        for (int s = begin; s < end; s++) {
+            int first = s * STRIPE;
+            for (int r = 0; r < n; r++) {
+                const float *fromRe = re + size_t(m_reverse[r]) * n + first;
+                const float *fromIm = im + size_t(m_reverse[r]) * n + first;
+                copy(fromRe, fromRe + STRIPE, &stripeRe[r * STRIPE]);
+                copy(fromIm, fromIm + STRIPE, &stripeIm[r * STRIPE]);
+            }
+
+            for (int half = 1; half < n; half *= 2) {
+                for (int start = 0; start < n; start += half * 2) {
+                    for (int j = 0; j < half; j++) {
+                        float wr = m_twiddleRe[half + j], wi = m_twiddleIm[half + j];
+                        float *ar = &stripeRe[(start + j) * STRIPE], *ai = &stripeIm[(start + j) * STRIPE];
+                        float *br = ar + half * STRIPE, *bi = ai + half * STRIPE;
+                        for (int x = 0; x < STRIPE; x++) {
+                            float tr = wr * br[x] - wi * bi[x];
+                            float ti = wr * bi[x] + wi * br[x];
+                            br[x] = ar[x] - tr;
+                            bi[x] = ai[x] - ti;
+                            ar[x] += tr;
+                            ai[x] += ti;
+                        }
+                    }
+                }
+            }
+
+            for (int r = 0; r < n; r++) {
+                copy(&stripeRe[r * STRIPE], &stripeRe[r * STRIPE] + STRIPE, re + size_t(r) * n + first);
+                copy(&stripeIm[r * STRIPE], &stripeIm[r * STRIPE] + STRIPE, im + size_t(r) * n + first);
+            }
+        }
+    }));
+}
+
+// In blocks, so both sides are read and written a cache line at a time
+void Ocean::transpose(const float *re, const float *im, float *outRe, float *outIm) const {
+    int n = m_resolution;
+    const int BLOCK = 16;
+    JobSystem &jobs = JobSystem::instance();
+    jobs.waitOnly(jobs.parallelFor(0, (n + BLOCK - 1) / BLOCK, 1, [&](int begin, int end) {
+        for (int b = begin; b < end; b++) {
+            int z0 = b * BLOCK;
+            for (int x0 = 0; x0 < n; x0 += BLOCK) {
+                for (int z = z0; z < min(n, z0 + BLOCK); z++) {
+                    for (int x = x0; x < min(n, x0 + BLOCK); x++) {
+                        outRe[x * n + z] = re[z * n + x];
+                        outIm[x * n + z] = im[z * n + x];
+                    }
+                }
+            }
+        }
+    }));
+}
+
+// Leaves the result transposed in the grid, x major, which packing reads
+void Ocean::fft2d(int grid) {
+    fftColumns(m_re[grid].data(), m_im[grid].data());
+    transpose(m_re[grid].data(), m_im[grid].data(), m_scratchRe.data(), m_scratchIm.data());
+    fftColumns(m_scratchRe.data(), m_scratchIm.data());
+    m_re[grid].swap(m_scratchRe);
+    m_im[grid].swap(m_scratchIm);
+}
+
+void Ocean::simulate(float seconds, timings &times) {
+    int n = m_resolution;
+    float t = fmod(seconds, REPEAT_SECONDS);
+    JobSystem &jobs = JobSystem::instance();
+
+    // Advance every wave and fill the three transforms: height and x
+    // displacement, z displacement and x slope, then z slope
+    auto start = chrono::steady_clock::now();
+    jobs.waitOnly(jobs.parallelFor(0, n, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            for (int x = 0; x < n; x++) {
+                size_t i = size_t(z) * n + x;
+                float c = cos(m_omega[i] * t), s = sin(m_omega[i] * t);
+                complex<float> h = m_h0[i] * complex<float>(c, s) + m_h0Conj[i] * complex<float>(c, -s);
+                float k = 2 * float(math::pi()) / m_size * sqrt(float((x - n / 2) * (x - n / 2) + (z - n / 2) * (z - n / 2)));
+
+                // -i k/|k| h for displacement, i k h for slope
+                complex<float> dx(m_kx[i] * h.imag(), -m_kx[i] * h.real());
+                complex<float> dz(m_kz[i] * h.imag(), -m_kz[i] * h.real());
+                complex<float> sx(-m_kx[i] * k * h.imag(), m_kx[i] * k * h.real());
+                complex<float> sz(-m_kz[i] * k * h.imag(), m_kz[i] * k * h.real());
+
+                m_re[0][i] = h.real() - dx.imag();
+                m_im[0][i] = h.imag() + dx.real();
+                m_re[1][i] = dz.real() - sx.imag();
+                m_im[1][i] = dz.imag() + sx.real();
+                m_re[2][i] = sz.real();
+                m_im[2][i] = sz.imag();
+            }
+        }
+    }));
+    times.spectrum_ms = millisecondsSince(start);
+
+    start = chrono::steady_clock::now();
+    for (int g = 0; g < 3; g++) {
+        fft2d(g);
+    }
+    times.fft_ms = millisecondsSince(start);
+
+    // The spectrum was centred on the middle texel, which flips the sign
+    // of every other texel
+    start = chrono::steady_clock::now();
+    jobs.waitOnly(jobs.parallelFor(0, n, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            for (int x = 0; x < n; x++) {
+                size_t i = size_t(z) * n + x;
+                size_t t = size_t(x) * n + z;
+                float sign = (x + z) & 1 ? -1.0f : 1.0f;
+                m_displacement[i * 4 + 0] = sign * m_im[0][t] * m_choppiness;
+                m_displacement[i * 4 + 1] = sign * m_re[0][t];
+                m_displacement[i * 4 + 2] = sign * m_re[1][t] * m_choppiness;
+                m_slopes[i * 2 + 0] = sign * m_im[1][t];
+                m_slopes[i * 2 + 1] = sign * m_re[2][t];
+            }
+        }
+    }));
+    times.pack_ms = millisecondsSince(start);
+}
+
+void Ocean::upload() {
+    bool created = m_displacementTexture == 0;
+    if (created) {
+        glGenTextures(1, &m_displacementTexture);
+        glGenTextures(1, &m_slopeTexture);
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, m_displacementTexture);
+    if (created) {
+        // read in the vertex shader, at full resolution
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_resolution, m_resolution, 0, GL_RGBA, GL_FLOAT, m_displacement.data());
+    } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_resolution, m_resolution, GL_RGBA, GL_FLOAT, m_displacement.data());
+    }
+
+    // slopes are mipmapped, so distant water doesn't sparkle
+    glBindTexture(GL_TEXTURE_2D, m_slopeTexture);
+    if (created) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, m_resolution, m_resolution, 0, GL_RG, GL_FLOAT, m_slopes.data());
+    } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_resolution, m_resolution, GL_RG, GL_FLOAT, m_slopes.data());
+    }
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Ocean::bind(const ShaderProgram &shader, int unit) const {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, m_displacementTexture);
+    glActiveTexture(GL_TEXTURE0 + unit + 1);
+    glBindTexture(GL_TEXTURE_2D, m_slopeTexture);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(shader.uniform("displacementMap"), unit);
+    glUniform1i(shader.uniform("slopeMap"), unit + 1);
+    glUniform1f(shader.uniform("oceanSize"), m_size);
+}
+
+// Waves are rarely over four times the RMS height
+float Ocean::getWaveHeight() const {
+    return m_waveHeight;
+}
+
+void Ocean::benchmark(const TerrainConfig &config) {
+    const int FRAMES = 100;
+    int threads = JobSystem::instance().getThreadCount();
+    cout << "FFT benchmark: " << config.oceanResolution << " x " << config.oceanResolution << " spectrum, "
+        << FRAMES << " frames, " << threads << " threads" << endl;
+
+    Ocean ocean(config.oceanResolution, config.oceanSize, config.oceanWind, config.oceanChoppiness,
+                config.oceanHeight, config.seed);
+    timings total, times;
+    double slowest = 0;
+    for (int frame = 0; frame < FRAMES; frame++) {
+        ocean.simulate(frame / 60.0f, times);
+        total.spectrum_ms += times.spectrum_ms;
+        total.fft_ms += times.fft_ms;
+        total.pack_ms += times.pack_ms;
+        slowest = max(slowest, times.spectrum_ms + times.fft_ms + times.pack_ms);
+    }
+    cout << "  per frame: spectrum " << total.spectrum_ms / FRAMES << "ms, FFT " << total.fft_ms / FRAMES
+        << "ms, pack " << total.pack_ms / FRAMES << "ms, slowest frame " << slowest << "ms" << endl;
+}
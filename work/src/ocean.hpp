@@ -0,0 +1,80 @@
+#pragma once
+
+#include <complex>
+#include <vector>
+
+#include "opengl.hpp"
+#include "shader_program.hpp"
+#include "terrain_config.hpp"
+
+// FFT ocean after Tessendorf. A Phillips spectrum of wave amplitudes is
+// drawn once from the seed, then every frame each wave is advanced by its
+// own dispersion and inverse FFTs turn the spectrum back into heights,
+// horizontal (choppy) displacement and slopes over a square patch that
+// tiles the water.
+//
+// The five real outputs go through three complex FFTs, two outputs to a
+// transform. Each 2D FFT is a pass down the columns, a transpose and a
+// second pass down the columns. Columns are split into stripes across
+// threads, each copied out to stay in cache, and every butterfly runs over
+// a whole row of a stripe at once, which the compiler vectorises. It is
+// simulated on the render thread, which only helps with its own passes
+// while waiting, so unrelated jobs never hold up a frame.
+class Ocean {
+public:
+    struct timings {
+        double spectrum_ms = 0;
+        double fft_ms = 0;
+        double pack_ms = 0;
+    };
+
+private:
+    static const int STRIPE = 16;       // columns per job in the FFT passes
+
+    int m_resolution = 0;               // texels along each side, a power of two
+    float m_size = 0;                   // world units the patch covers
+    float m_choppiness = 0;             // scale of the horizontal displacement
+    float m_waveHeight = 0;             // highest a wave should reach
+
+    std::vector<std::complex<float>> m_h0;      // amplitude of each wave at time 0
+    std::vector<std::complex<float>> m_h0Conj;  // conjugate amplitude of the opposite wave
+    std::vector<float> m_omega;                 // angular frequency of each wave
+    std::vector<float> m_kx, m_kz;              // wave vector, divided by its length
+
+    std::vector<int> m_reverse;         // bit reversed index of each row
+    std::vector<float> m_twiddleRe;     // e^(i pi j / h) at h + j, for each half length h
+    std::vector<float> m_twiddleIm;
+    std::vector<float> m_re[3];         // the three packed transforms, split into parts
+    std::vector<float> m_im[3];
+    std::vector<float> m_scratchRe, m_scratchIm;
+
+    std::vector<float> m_displacement;  // RGBA per texel: x, height, z displacement
+    std::vector<float> m_slopes;        // RG per texel: height slope along x and z
+
+    GLuint m_displacementTexture = 0;
+    GLuint m_slopeTexture = 0;
+
+    void fftColumns(float *re, float *im) const;
+    void transpose(const float *re, const float *im, float *outRe, float *outIm) const;
+    void fft2d(int grid);
+
+public:
+    // Heights are scaled so their RMS is height, in world units
+    Ocean(int resolution, float size, float windSpeed, float choppiness, float height, int seed);
+
+    Ocean(const Ocean &) = delete;
+    Ocean & operator=(const Ocean &) = delete;
+
+    void simulate(float seconds, timings &times);
+
+    // Uploads the last simulated frame and binds it for the water program,
+    // using unit and unit + 1
+    void upload();
+    void bind(const ShaderProgram &, int unit) const;
+
+    float getWaveHeight() const;
+
+    // Simulates frames of the configured ocean, printing how long each
+    // stage took
+    static void benchmark(const TerrainConfig &config);
+};
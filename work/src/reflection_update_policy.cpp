@@ -0,0 +1,85 @@
+#include "cgra_math.hpp"
+#include "reflection_update_policy.hpp"
+
+using namespace std;
+using namespace cgra;
+
+static bool sameMatrix(const mat4 &a, const mat4 &b) {
+    for (int i = 0; i < 4; i++) {
+        if (!(a[i] == b[i])) return false;
+    }
+    return true;
+}
+
+ReflectionUpdatePolicy::ReflectionUpdatePolicy() {}
+
+// Works out which passes to render this frame. Any pass this returns
+// true for from needsUpdate is assumed to be rendered before the water.
+void ReflectionUpdatePolicy::beginFrame(const mat4 &viewProjection, unsigned sceneRevision, bool underLoad) {
+    m_frame++;
+    m_viewProjection = viewProjection;
+    
+    bool stale[PASS_COUNT];
+    for (int i = 0; i < PASS_COUNT; i++) {
+        pass_state &pass = m_passes[i];
+        stale[i] = !pass.valid || !m_amortise || pass.revision != sceneRevision
+            || !sameMatrix(pass.viewProjection, viewProjection);
+        pass.update = stale[i];
+    }
+    
+    // Under load only the stalest pass is rendered, and only once it has
+    // waited out the interval. Invalid passes (first frame, scene changes)
+    // still render so the water never shows missing content.
+    if (m_amortise && underLoad) {
+        int stalest = -1;
+        for (int i = 0; i < PASS_COUNT; i++) {
+            pass_state &pass = m_passes[i];
+            bool mustUpdate = !pass.valid || pass.revision != sceneRevision;
+            if (stale[i] && !mustUpdate) {
+                pass.update = false;
+                bool waited = m_frame - pass.lastUpdate >= m_loadInterval;
+                if (waited && (stalest < 0 || pass.lastUpdate < m_passes[stalest].lastUpdate)) {
+                    stalest = i;
+                }
+            }
+        }
+        if (stalest >= 0) m_passes[stalest].update = true;
+    }
+    
+    for (int i = 0; i < PASS_COUNT; i++) {
+        pass_state &pass = m_passes[i];
+        if (pass.update) {
+            pass.viewProjection = viewProjection;
+            pass.revision = sceneRevision;
+            pass.lastUpdate = m_frame;
+            pass.valid = true;
+        }
+    }
+}
+
+bool ReflectionUpdatePolicy::needsUpdate(Pass pass) const {
+    return m_passes[pass].update;
+}
+
+// The view-projection the water shader should project with to sample
+// the given pass. With reprojection this is the camera the pass was
+// rendered from, so a skipped pass still lines up with the scene.
+mat4 ReflectionUpdatePolicy::getViewProjection(Pass pass) const {
+    return m_reprojection ? m_passes[pass].viewProjection : m_viewProjection;
+}
+
+void ReflectionUpdatePolicy::setAmortise(bool amortise) {
+    m_amortise = amortise;
+}
+
+bool ReflectionUpdatePolicy::isAmortising() const {
+    return m_amortise;
+}
+
+void ReflectionUpdatePolicy::setReprojection(bool reprojection) {
+    m_reprojection = reprojection;
+}
+
+void ReflectionUpdatePolicy::setLoadInterval(int frames) {
+    m_loadInterval = frames;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "cgra_math.hpp"
+
+// Decides which of the water's offscreen passes need re-rendering this
+// frame. A pass is stale once the camera or the scene has changed since
+// it was last rendered. Up to date passes are skipped entirely, so an idle
+// camera costs only the main pass. Under GPU load stale passes are
+// staggered so each updates at most every few frames, optionally with the
+// water shader reprojecting the older image.
+class ReflectionUpdatePolicy {
+public:
+    enum Pass { REFLECTION = 0, REFRACTION = 1, PASS_COUNT = 2 };
+
+private:
+    struct pass_state {
+        cgra::mat4 viewProjection;  // camera the pass was last rendered from
+        unsigned revision = 0;      // scene revision it was last rendered with
+        int lastUpdate = 0;         // frame it was last rendered on
+        bool valid = false;
+        bool update = false;        // whether it is rendered this frame
+    };
+    
+    pass_state m_passes[PASS_COUNT];
+    cgra::mat4 m_viewProjection;
+    int m_frame = 0;
+    
+    bool m_amortise = true;
+    bool m_reprojection = true;
+    int m_loadInterval = 2;
+    
+public:
+    ReflectionUpdatePolicy();
+    
+    void beginFrame(const cgra::mat4 &viewProjection, unsigned sceneRevision, bool underLoad);
+    bool needsUpdate(Pass) const;
+    cgra::mat4 getViewProjection(Pass) const;
+    
+    void setAmortise(bool);
+    bool isAmortising() const;
+    void setReprojection(bool);
+    void setLoadInterval(int frames);
+};
@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "opengl.hpp"
+#include "render_target.hpp"
+
+using namespace std;
+
+RenderTarget::RenderTarget(float scale) : m_scale(scale) {}
+
+// Sizes the target to the window times its scale factors, reallocating
+// the attachments only if the resulting size differs from the current one.
+// Returns true if the target was reallocated (and its contents lost)
+bool RenderTarget::resize(int windowWidth, int windowHeight, float dynamicScale) {
+    float scale = m_scale * dynamicScale;
+    int width = max(1, (int)lround(windowWidth * scale));
+    int height = max(1, (int)lround(windowHeight * scale));
+    
+    if (width != m_width || height != m_height) {
+        allocate(width, height);
+        return true;
+    }
+    return false;
+}
+
+void RenderTarget::allocate(int width, int height) {
+    m_width = width;
+    m_height = height;
+    
+    if (!m_framebuffer) {
+        glGenFramebuffers(1, &m_framebuffer);
+        glGenTextures(1, &m_colorTexture);
+        glGenTextures(1, &m_depthTexture);
+    }
+    
+    // colour attachment
+    glBindTexture(GL_TEXTURE_2D, m_colorTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    
+    // depth attachment, sampled by the water shader for its fog
+    glBindTexture(GL_TEXTURE_2D, m_depthTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_colorTexture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_depthTexture, 0);
+    GLenum drawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
+    glDrawBuffers(1, drawBuffers);
+    
+    GLenum err;
+    if ((err = glCheckFramebufferStatus(GL_FRAMEBUFFER)) != GL_FRAMEBUFFER_COMPLETE) {
+        cerr << "Error: render target incomplete (" << err << ")" << endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Binds the framebuffer and sets the viewport to cover it
+void RenderTarget::bind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+    glViewport(0, 0, m_width, m_height);
+}
+
+void RenderTarget::setScale(float scale) {
+    m_scale = scale;
+}
+
+float RenderTarget::getScale() const {
+    return m_scale;
+}
+
+GLuint RenderTarget::getColorTexture() const {
+    return m_colorTexture;
+}
+
+GLuint RenderTarget::getDepthTexture() const {
+    return m_depthTexture;
+}
+
+int RenderTarget::getWidth() const {
+    return m_width;
+}
+
+int RenderTarget::getHeight() const {
+    return m_height;
+}
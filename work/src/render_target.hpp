@@ -0,0 +1,37 @@
+#pragma once
+
+#include "opengl.hpp"
+
+// An offscreen colour target with a sampleable depth attachment. Its
+// size follows the window, scaled by a fixed factor (e.g. half resolution
+// for the water reflection) and an optional dynamic factor, and it is
+// only reallocated when that size actually changes.
+class RenderTarget {
+private:
+    GLuint m_framebuffer = 0;
+    GLuint m_colorTexture = 0;
+    GLuint m_depthTexture = 0;
+    
+    int m_width = 0;
+    int m_height = 0;
+    float m_scale;
+    
+    void allocate(int, int);
+    
+public:
+    explicit RenderTarget(float scale = 1.0f);
+    
+    RenderTarget(const RenderTarget &) = delete;
+    RenderTarget & operator=(const RenderTarget &) = delete;
+    
+    bool resize(int windowWidth, int windowHeight, float dynamicScale = 1.0f);
+    void bind() const;
+    
+    void setScale(float);
+    float getScale() const;
+    
+    GLuint getColorTexture() const;
+    GLuint getDepthTexture() const;
+    int getWidth() const;
+    int getHeight() const;
+};
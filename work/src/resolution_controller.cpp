@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <cmath>
+
+#include "opengl.hpp"
+#include "resolution_controller.hpp"
+
+using namespace std;
+
+ResolutionController::ResolutionController() {}
+
+void ResolutionController::initialise() {
+    glGenQueries(QUERY_COUNT, m_queries);
+}
+
+void ResolutionController::beginFrame() {
+    glBeginQuery(GL_TIME_ELAPSED, m_queries[m_frame % QUERY_COUNT]);
+}
+
+void ResolutionController::endFrame() {
+    glEndQuery(GL_TIME_ELAPSED);
+    m_frame++;
+    
+    // Read back the oldest query, which has had QUERY_COUNT-1 frames to finish
+    if (m_frame < QUERY_COUNT) return;
+    GLuint query = m_queries[m_frame % QUERY_COUNT];
+    GLint available = 0;
+    glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return;
+    
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+    m_gpuMs = elapsed / 1.0e6f;
+    
+    if (m_enabled) adjust();
+}
+
+// Fill cost grows with the square of the scale, so step towards the
+// scale that would have hit the target, damped to avoid oscillating
+void ResolutionController::adjust() {
+    if (m_gpuMs <= 0) return;
+    float ideal = m_scale * sqrt(m_targetMs / m_gpuMs);
+    m_scale += (ideal - m_scale) * 0.1f;
+    m_scale = min(m_maxScale, max(m_minScale, m_scale));
+}
+
+void ResolutionController::setEnabled(bool enabled) {
+    m_enabled = enabled;
+    if (!enabled) m_scale = m_maxScale;
+}
+
+bool ResolutionController::isEnabled() const {
+    return m_enabled;
+}
+
+void ResolutionController::setTarget(float ms) {
+    m_targetMs = ms;
+}
+
+void ResolutionController::setRange(float minScale, float maxScale) {
+    m_minScale = minScale;
+    m_maxScale = maxScale;
+    m_scale = min(m_maxScale, max(m_minScale, m_scale));
+}
+
+// Scale snapped to 1/16 steps so render targets aren't reallocated for
+// every small adjustment
+float ResolutionController::getScale() const {
+    return round(m_scale * 16.0f) / 16.0f;
+}
+
+float ResolutionController::getGpuTime() const {
+    return m_gpuMs;
+}
+
+bool ResolutionController::isOverBudget() const {
+    return m_gpuMs > m_targetMs;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "opengl.hpp"
+
+// Measures GPU frame time with timer queries and, when enabled, adjusts
+// a resolution scale for the offscreen passes to hold a frame-time
+// target. Results are read a few frames late so the CPU never waits on
+// the GPU.
+class ResolutionController {
+private:
+    static const int QUERY_COUNT = 4;
+    
+    GLuint m_queries[QUERY_COUNT];
+    int m_frame = 0;
+    
+    bool m_enabled = false;
+    float m_targetMs = 16.0f;
+    float m_gpuMs = 0.0f;
+    
+    float m_scale = 1.0f;
+    float m_minScale = 0.25f;
+    float m_maxScale = 1.0f;
+    
+    void adjust();
+    
+public:
+    ResolutionController();
+    
+    void initialise();
+    void beginFrame();
+    void endFrame();
+    
+    void setEnabled(bool);
+    bool isEnabled() const;
+    void setTarget(float ms);
+    void setRange(float minScale, float maxScale);
+    
+    float getScale() const;
+    float getGpuTime() const;
+    bool isOverBudget() const;
+};
@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <queue>
+
+#include "job_system.hpp"
+#include "river_network.hpp"
+
+using namespace std;
+
+static const int NEIGHBOUR_X[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+static const int NEIGHBOUR_Z[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+static const float NEIGHBOUR_DISTANCE[8] = { 1.41421356f, 1, 1.41421356f, 1, 1, 1.41421356f, 1, 1.41421356f };
+
+static double millisecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Priority flood with a nudge up at every step, so the filled surface
+// always slopes down towards where it was flooded from
+void RiverNetwork::fill(const vector<float> &heights) {
+    struct open_cell {
+        float height;
+        int index;
+        bool operator>(const open_cell &o) const {
+            return height > o.height || (height == o.height && index > o.index);
+        }
+    };
+
+    m_filled = heights;
+    vector<uint8_t> closed(heights.size(), 0);
+    priority_queue<open_cell, vector<open_cell>, greater<open_cell>> open;
+    queue<int> pit;
+
+    // The sea and the grid's edges are where the flood starts from. Sea
+    // cells are left as they are, the land along the coast is queued
+    for (int z = 0; z < m_length; z++) {
+        for (int x = 0; x < m_width; x++) {
+            int i = z * m_width + x;
+            if (heights[i] <= m_seaLevel) {
+                closed[i] = 1;
+                continue;
+            }
+            bool edge = x == 0 || z == 0 || x == m_width - 1 || z == m_length - 1;
+            for (int k = 0; k < 8 && !edge; k++) {
+                edge = heights[i + NEIGHBOUR_Z[k] * m_width + NEIGHBOUR_X[k]] <= m_seaLevel;
+            }
+            if (edge) {
+                closed[i] = 1;
+                open.push({ heights[i], i });
+            }
+        }
+    }
+
+    while (!open.empty() || !pit.empty()) {
+        int i;
+        if (!pit.empty()) {
+            i = pit.front();
+            pit.pop();
+        } else {
+            i = open.top().index;
+            open.pop();
+        }
+
+        int x = i % m_width, z = i / m_width;
+        float raised = nextafter(m_filled[i], numeric_limits<float>::max());
+        for (int k = 0; k < 8; k++) {
+            int nx = x + NEIGHBOUR_X[k], nz = z + NEIGHBOUR_Z[k];
+            if (nx < 0 || nz < 0 || nx >= m_width || nz >= m_length) continue;
+            int n = nz * m_width + nx;
+            if (closed[n]) continue;
+            closed[n] = 1;
+            if (m_filled[n] <= raised) {
+                // inside a depression, filled level with where it spills
+                m_filled[n] = raised;
+                pit.push(n);
+            } else {
+                open.push({ m_filled[n], n });
+            }
+        }
+    }
+}
+
+// The filled surface has no flats or pits, so every land cell but some
+// along the edges has a lower neighbour to drain to
+void RiverNetwork::findReceivers() {
+    m_receivers.assign(m_filled.size(), -1);
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, m_length, 0, [this](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            for (int x = 0; x < m_width; x++) {
+                int i = z * m_width + x;
+                if (m_filled[i] <= m_seaLevel) continue;
+                float steepest = 0;
+                for (int k = 0; k < 8; k++) {
+                    int nx = x + NEIGHBOUR_X[k], nz = z + NEIGHBOUR_Z[k];
+                    if (nx < 0 || nz < 0 || nx >= m_width || nz >= m_length) continue;
+                    int n = nz * m_width + nx;
+                    float slope = (m_filled[i] - m_filled[n]) / NEIGHBOUR_DISTANCE[k];
+                    if (slope > steepest) {
+                        steepest = slope;
+                        m_receivers[i] = n;
+                    }
+                }
+            }
+        }
+    }));
+}
+
+void RiverNetwork::accumulate() {
+    size_t count = m_filled.size();
+    m_flow.reset(new atomic<int>[count]);
+    atomic<int> *flow = m_flow.get();
+    unique_ptr<atomic<int>[]> waiting(new atomic<int>[count]);
+    vector<uint8_t> source(count);
+
+    // Count each cell's donors by looking back from it, which needs no
+    // atomics, and note the sources the walks start from
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, m_length, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            for (int x = 0; x < m_width; x++) {
+                int i = z * m_width + x;
+                int donors = 0;
+                for (int k = 0; k < 8; k++) {
+                    int nx = x + NEIGHBOUR_X[k], nz = z + NEIGHBOUR_Z[k];
+                    if (nx < 0 || nz < 0 || nx >= m_width || nz >= m_length) continue;
+                    donors += m_receivers[nz * m_width + nx] == i;
+                }
+                flow[i].store(1, memory_order_relaxed);
+                waiting[i].store(donors, memory_order_relaxed);
+                source[i] = donors == 0;
+            }
+        }
+    }));
+
+    // The last donor to arrive at a cell carries its total on down, so
+    // every cell is passed through exactly once
+    jobs.wait(jobs.parallelFor(0, int(count), 0, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            if (!source[i]) continue;
+            int cell = i;
+            int r = m_receivers[cell];
+            while (r >= 0) {
+                flow[r].fetch_add(flow[cell].load(memory_order_relaxed), memory_order_relaxed);
+                if (waiting[r].fetch_sub(1, memory_order_acq_rel) != 1) break;
+                cell = r;
+                r = m_receivers[cell];
+            }
+        }
+    }));
+}
+
+void RiverNetwork::build(const vector<float> &heights, int width, int length, float seaLevel, timings &times) {
+    m_width = width;
+    m_length = length;
+    m_seaLevel = seaLevel;
+
+    auto start = chrono::steady_clock::now();
+    fill(heights);
+    times.fill_ms = millisecondsSince(start);
+
+    start = chrono::steady_clock::now();
+    findReceivers();
+    times.directions_ms = millisecondsSince(start);
+
+    start = chrono::steady_clock::now();
+    accumulate();
+    times.accumulation_ms = millisecondsSince(start);
+}
+
+// Channels are cut down from the filled surface, whose height and the
+// channel depth both only fall downstream, so the beds always run down to
+// the sea. Where that would be above the ground, across a depression, the
+// ground is kept. Banks slope up over two cells either side.
+void RiverNetwork::carve(vector<float> &heights, int threshold, float depth, timings &times) const {
+    auto start = chrono::steady_clock::now();
+    if (threshold <= 0) threshold = 1;
+
+    vector<float> beds(heights.size(), numeric_limits<float>::max());
+    vector<float> depths(heights.size(), 0.0f);
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, int(heights.size()), 0, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int flow = m_flow[i].load(memory_order_relaxed);
+            if (flow < threshold || m_filled[i] <= m_seaLevel) continue;
+            float d = depth * min(1.0f, sqrt(float(flow) / threshold) - 1);
+            depths[i] = d;
+            beds[i] = min(heights[i], m_filled[i] - d);
+        }
+    }));
+
+    // Rivers are sparse, so first mark the columns with one within reach
+    // along each row, and only gather around cells with a mark in reach
+    const int BANK = 2;
+    vector<uint8_t> near(heights.size(), 0);
+    jobs.wait(jobs.parallelFor(0, m_length, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            for (int x = 0; x < m_width; x++) {
+                if (depths[z * m_width + x] <= 0) continue;
+                for (int nx = max(0, x - BANK); nx <= min(m_width - 1, x + BANK); nx++) {
+                    near[z * m_width + nx] = 1;
+                }
+            }
+        }
+    }));
+
+    vector<float> carved(heights.size());
+    jobs.wait(jobs.parallelFor(0, m_length, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            for (int x = 0; x < m_width; x++) {
+                int i = z * m_width + x;
+                float h = heights[i];
+                bool reached = false;
+                for (int nz = max(0, z - BANK); nz <= min(m_length - 1, z + BANK) && !reached; nz++) {
+                    reached = near[nz * m_width + x];
+                }
+                if (!reached) {
+                    carved[i] = h;
+                    continue;
+                }
+                for (int dz = -BANK; dz <= BANK; dz++) {
+                    int nz = z + dz;
+                    if (nz < 0 || nz >= m_length) continue;
+                    for (int dx = -BANK; dx <= BANK; dx++) {
+                        int nx = x + dx;
+                        if (nx < 0 || nx >= m_width) continue;
+                        int n = nz * m_width + nx;
+                        if (depths[n] <= 0) continue;
+                        float distance = sqrt(float(dx * dx + dz * dz));
+                        h = min(h, beds[n] + depths[n] * distance / BANK);
+                    }
+                }
+                carved[i] = h;
+            }
+        }
+    }));
+    heights.swap(carved);
+    times.carve_ms = millisecondsSince(start);
+}
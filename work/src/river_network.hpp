@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Rivers over a normalised heightfield. Depressions are filled by a
+// priority flood from the coast and the edges of the grid, so every cell
+// above sea level has a downhill path out, each cell then drains to its
+// steepest neighbour (D8), and the cells draining through each one are
+// counted. Cells draining enough of the grid have a channel cut into
+// them, deepening downstream, so the rivers run out to the sea.
+//
+// The flood is O(N log N), with cells inside a depression going through
+// a plain queue instead of the heap. Directions and carving are a gather
+// per cell, and the counts are summed by walking down from every source
+// in parallel, a walk only carrying on past a cell once every cell
+// draining into it has arrived.
+class RiverNetwork {
+private:
+    int m_width = 0;
+    int m_length = 0;
+    float m_seaLevel = 0;
+    std::vector<float> m_filled;        // heights with depressions filled
+    std::vector<int> m_receivers;       // the cell each drains to, -1 for the sea and edges
+    std::unique_ptr<std::atomic<int>[]> m_flow; // cells draining through each, itself included
+
+    void fill(const std::vector<float> &heights);
+    void findReceivers();
+    void accumulate();
+
+public:
+    struct timings {
+        double fill_ms = 0;
+        double directions_ms = 0;
+        double accumulation_ms = 0;
+        double carve_ms = 0;
+    };
+
+    // Cells at or below seaLevel are sea
+    void build(const std::vector<float> &heights, int width, int length, float seaLevel, timings &times);
+
+    // Cuts channels through every cell with at least threshold cells
+    // draining through it, reaching depth at four times the threshold
+    void carve(std::vector<float> &heights, int threshold, float depth, timings &times) const;
+};
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "opengl.hpp"
+#include "shader_program.hpp"
+#include "simple_shader.hpp"
+
+using namespace std;
+using namespace cgra;
+
+ShaderProgram::ShaderProgram() {}
+
+ShaderProgram::ShaderProgram(GLuint program) : m_program(program) {
+    resolveUniforms();
+}
+
+ShaderProgram ShaderProgram::fromFiles(const vector<GLenum> &stypes, const vector<string> &files) {
+    return ShaderProgram(makeCachedShaderProgramFromFile(stypes, files));
+}
+
+void ShaderProgram::resolveUniforms() {
+    m_uniforms.clear();
+    if (m_program == 0) return;
+
+    GLint count = 0;
+    GLint maxLength = 0;
+    glGetProgramiv(m_program, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(m_program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+    vector<char> name(maxLength + 1);
+    for (GLint i = 0; i < count; i++) {
+        GLsizei length = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(m_program, i, name.size(), &length, &size, &type, &name[0]);
+        string uniformName(&name[0], length);
+
+        // Uniforms inside a block have no location of their own
+        GLint location = glGetUniformLocation(m_program, uniformName.c_str());
+        if (location < 0) continue;
+
+        // Arrays are reported as "name[0]", but are also addressable as "name"
+        size_t bracket = uniformName.find('[');
+        if (bracket != string::npos) uniformName = uniformName.substr(0, bracket);
+        m_uniforms[uniformName] = location;
+    }
+}
+
+GLuint ShaderProgram::id() const {
+    return m_program;
+}
+
+// Location of the named uniform, or -1 (which GL silently ignores) if the
+// program doesn't use it
+GLint ShaderProgram::uniform(const string &name) const {
+    auto it = m_uniforms.find(name);
+    return it == m_uniforms.end() ? -1 : it->second;
+}
+
+void ShaderProgram::bindUniformBlock(const string &name, GLuint binding) const {
+    GLuint index = glGetUniformBlockIndex(m_program, name.c_str());
+    if (index == GL_INVALID_INDEX) return;
+    glUniformBlockBinding(m_program, index, binding);
+}
+
+void ShaderProgram::use() const {
+    glUseProgram(m_program);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "opengl.hpp"
+
+// Wraps a linked shader program and resolves the location of every
+// active uniform once, so draws never look uniforms up by name through
+// the driver.
+class ShaderProgram {
+private:
+    GLuint m_program = 0;
+    std::unordered_map<std::string, GLint> m_uniforms;
+
+    void resolveUniforms();
+
+public:
+    ShaderProgram();
+    explicit ShaderProgram(GLuint program);
+
+    // links (or fetches from the program cache) the given shader files
+    static ShaderProgram fromFiles(const std::vector<GLenum> &, const std::vector<std::string> &);
+
+    GLuint id() const;
+    GLint uniform(const std::string &) const;
+    void bindUniformBlock(const std::string &, GLuint) const;
+    void use() const;
+};
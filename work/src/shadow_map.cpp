@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "opengl.hpp"
+#include "shadow_map.hpp"
+
+using namespace std;
+using namespace cgra;
+
+void ShadowMap::initialise(int resolution) {
+    m_resolution = resolution;
+    glGenFramebuffers(1, &m_framebuffer);
+    glGenTextures(1, &m_depthTexture);
+}
+
+// Picks the cascades for the terrain's size and allocates a layer for each
+void ShadowMap::layout(const AABB &terrainBounds) {
+    float size = max(terrainBounds.max.x - terrainBounds.min.x, terrainBounds.max.z - terrainBounds.min.z);
+    vec2 middle((terrainBounds.min.x + terrainBounds.max.x) / 2, (terrainBounds.min.z + terrainBounds.max.z) / 2);
+
+    int count = 0;
+    for (float extent = NEAR_EXTENT; count < MAX_CASCADES - 1 && extent < size; extent *= 4) {
+        m_cascades[count++] = cascade();
+        m_cascades[count - 1].extent = extent;
+    }
+    m_cascades[count] = cascade();
+    m_cascades[count].extent = size;
+    m_cascades[count].centre = middle;
+    m_cascades[count].fixed = true;
+    count++;
+
+    if (count != m_cascadeCount) {
+        m_cascadeCount = count;
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_depthTexture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, m_resolution, m_resolution, count, 0,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+}
+
+// Orthographic along the light, fitted around the cascade's square and
+// the full height of the terrain. The box is centred on the cascade's
+// centre at the terrain's middle height, so the projection is symmetric.
+// Its depth only covers the cascade, hills further towards the light are
+// depth clamped onto the near plane.
+mat4 ShadowMap::lightViewProjection(const cascade &c) const {
+    vec3 middle((m_bounds.min.x + m_bounds.max.x) / 2, (m_bounds.min.y + m_bounds.max.y) / 2,
+                (m_bounds.min.z + m_bounds.max.z) / 2);
+    vec3 dir = normalize(m_lightPos - middle);
+    vec3 up = fabs(dir.y) > 0.99f ? vec3(0, 0, 1) : vec3(0, 1, 0);
+    vec3 centre(c.centre.x, middle.y, c.centre.y);
+    mat4 view = mat4::lookAt(centre, centre - dir, up);
+
+    vec3 half(c.extent / 2, max(0.01f, (m_bounds.max.y - m_bounds.min.y) / 2), c.extent / 2);
+    vec3 radius(0, 0, 0);
+    for (int i = 0; i < 8; i++) {
+        vec3 corner(i & 1 ? half.x : -half.x, i & 2 ? half.y : -half.y, i & 4 ? half.z : -half.z);
+        vec4 p = view * vec4(centre + corner, 1);
+        radius = vec3(max(radius.x, fabs(p.x)), max(radius.y, fabs(p.y)), max(radius.z, fabs(p.z)));
+    }
+    return mat4::orthographicProjection(-radius.x, radius.x, -radius.y, radius.y, -radius.z, radius.z) * view;
+}
+
+bool ShadowMap::update(const vec3 &eye, const vec3 &lightPos, const AABB &terrainBounds, unsigned terrainRevision,
+                       function<void(const mat4 &)> draw) {
+    if (!m_enabled || terrainBounds.isEmpty()) return false;
+
+    // A new terrain or light invalidates everything
+    bool sameBounds = m_bounds.min.x == terrainBounds.min.x && m_bounds.max.x == terrainBounds.max.x
+        && m_bounds.min.z == terrainBounds.min.z && m_bounds.max.z == terrainBounds.max.z;
+    if (!sameBounds || m_cascadeCount == 0) layout(terrainBounds);
+    if (!sameBounds || terrainRevision != m_terrainRevision || lightPos.x != m_lightPos.x
+        || lightPos.y != m_lightPos.y || lightPos.z != m_lightPos.z) {
+        for (int i = 0; i < m_cascadeCount; i++) {
+            m_cascades[i].valid = false;
+        }
+    }
+    m_bounds = terrainBounds;
+    m_lightPos = lightPos;
+    m_terrainRevision = terrainRevision;
+
+    // Cascades near the camera move once it strays from their centre,
+    // snapped so they land back on the same texels
+    for (int i = 0; i < m_cascadeCount; i++) {
+        cascade &c = m_cascades[i];
+        if (c.fixed) continue;
+        if (!c.valid || fabs(eye.x - c.centre.x) > c.extent / 4 || fabs(eye.z - c.centre.y) > c.extent / 4) {
+            float snap = c.extent / 16;
+            c.centre = vec2(round(eye.x / snap) * snap, round(eye.z / snap) * snap);
+            c.valid = false;
+        }
+    }
+
+    bool rendered = false;
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    for (int i = 0; i < m_cascadeCount; i++) {
+        cascade &c = m_cascades[i];
+        if (c.valid) continue;
+
+        mat4 viewProjection = lightViewProjection(c);
+        if (!rendered) {
+            glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            glViewport(0, 0, m_resolution, m_resolution);
+            glEnable(GL_DEPTH_TEST);
+            glDepthFunc(GL_LESS);
+            // slope scaled bias against acne, and hills past the near
+            // plane still cast onto the cascade
+            glEnable(GL_POLYGON_OFFSET_FILL);
+            glPolygonOffset(2.0f, 4.0f);
+            glEnable(GL_DEPTH_CLAMP);
+        }
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depthTexture, 0, i);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        draw(viewProjection);
+
+        // to texture space, [-1, 1] to [0, 1]
+        m_matrices[i] = mat4::translate(0.5f, 0.5f, 0.5f) * mat4::scale(0.5f, 0.5f, 0.5f) * viewProjection;
+        m_regions[i] = vec4(c.centre.x, c.centre.y, c.extent / 2, 0);
+        c.valid = true;
+        rendered = true;
+    }
+
+    if (rendered) {
+        glDisable(GL_DEPTH_CLAMP);
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glDisable(GL_DEPTH_TEST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    }
+    return rendered;
+}
+
+void ShadowMap::bind(const ShaderProgram &shader, int unit) const {
+    shader.use();
+    int cascades = m_enabled ? m_cascadeCount : 0;
+    glUniform1i(shader.uniform("shadowCascades"), cascades);
+    if (cascades == 0) return;
+
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_depthTexture);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(shader.uniform("shadowMap"), unit);
+    glUniformMatrix4fv(shader.uniform("shadowMatrices"), cascades, GL_FALSE, &m_matrices[0][0][0]);
+    glUniform4fv(shader.uniform("shadowRegions"), cascades, &m_regions[0][0]);
+    glUniform1f(shader.uniform("shadowTexel"), 1.0f / m_resolution);
+}
+
+// Turning shadows back on re-renders them, the terrain may have changed
+void ShadowMap::setEnabled(bool enabled) {
+    m_enabled = enabled;
+    for (int i = 0; i < m_cascadeCount; i++) {
+        m_cascades[i].valid = false;
+    }
+}
+
+bool ShadowMap::isEnabled() const {
+    return m_enabled;
+}
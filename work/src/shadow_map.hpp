@@ -0,0 +1,74 @@
+#pragma once
+
+#include <functional>
+
+#include "cgra_math.hpp"
+#include "frustum.hpp"
+#include "opengl.hpp"
+#include "shader_program.hpp"
+
+// Shadows cast by the terrain, rendered once and kept between frames. The
+// terrain only changes on a reseed and the light doesn't move, so the
+// depth maps are only re-rendered when one of those changes.
+//
+// Small terrains fit one cascade covering the whole terrain. Larger ones
+// add cascades four times smaller each, centred near the camera, which
+// are only moved, and so re-rendered, once the camera has gone a quarter
+// of their width from where they were last centred. The last cascade
+// always covers the whole terrain and never moves.
+//
+// The light is a point, but a distant one, so shadows are cast along the
+// direction from it to the terrain's centre.
+class ShadowMap {
+public:
+    static const int MAX_CASCADES = 4;
+
+private:
+    static constexpr float NEAR_EXTENT = 128;  // world width of the first cascade, if the terrain is wider
+
+    struct cascade {
+        float extent = 0;           // world units across
+        cgra::vec2 centre;          // world xz it is centred on
+        bool fixed = false;         // covers the whole terrain, so never moves
+        bool valid = false;
+    };
+
+    GLuint m_framebuffer = 0;
+    GLuint m_depthTexture = 0;      // one layer per cascade
+    int m_resolution = 0;
+    bool m_enabled = true;
+
+    int m_cascadeCount = 0;
+    cascade m_cascades[MAX_CASCADES];
+    cgra::mat4 m_matrices[MAX_CASCADES];    // world to shadow map texture space
+    cgra::vec4 m_regions[MAX_CASCADES];     // xz centre and half width each cascade covers
+
+    // What the cascades were rendered with
+    AABB m_bounds;                  // of the terrain
+    cgra::vec3 m_lightPos;
+    unsigned m_terrainRevision = 0;
+
+    void layout(const AABB &terrainBounds);
+    cgra::mat4 lightViewProjection(const cascade &) const;
+
+public:
+    ShadowMap() = default;
+    ShadowMap(const ShadowMap &) = delete;
+    ShadowMap & operator=(const ShadowMap &) = delete;
+
+    void initialise(int resolution = 2048);
+
+    // Re-renders the stale cascades, calling draw with the world to clip
+    // transform of each while its depth map is bound. Casters should only
+    // be culled against its sides, see Frustum::sides. Returns true if any
+    // was rendered.
+    bool update(const cgra::vec3 &eye, const cgra::vec3 &lightPos, const AABB &terrainBounds, unsigned terrainRevision,
+                std::function<void(const cgra::mat4 &)> draw);
+
+    // Sets the shadow uniforms of the terrain program, using unit for the
+    // depth maps
+    void bind(const ShaderProgram &, int unit) const;
+
+    void setEnabled(bool);
+    bool isEnabled() const;
+};
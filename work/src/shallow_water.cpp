@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <cmath>
+
+#include "shallow_water.hpp"
+#include "terrain.hpp"
+
+using namespace std;
+using namespace cgra;
+
+static const float WET_DEPTH = 0.005f;      // shallower than this counts as dry
+static const float OPEN_DEPTH = 1000;       // depth reported while there is no grid, the open sea
+
+void ShallowWater::reset(const Terrain &terrain, int cells, float rate) {
+    finishSteps();
+    m_cells = cells;
+    m_timestep = 1 / rate;
+    m_seed = terrain.getSeed();
+    m_owed = 0;
+    m_seaLevel = m_nextSeaLevel;
+
+    AABB bounds = terrain.getBounds();
+    const TerrainConfig &config = terrain.getConfig();
+    if (cells == 0 || bounds.isEmpty()) {
+        m_width = m_length = 1;
+        m_ground.clear();
+        m_surface = { m_seaLevel, OPEN_DEPTH };
+        m_highest = m_seaLevel;
+        m_changed = true;
+        return;
+    }
+
+    // every stride'th terrain vertex, so the cells sit on the terrain's grid
+    int vertices = max(config.width, config.length);
+    int stride = max(1, (vertices - 1 + cells - 2) / (cells - 1));
+    m_width = (config.width - 1) / stride + 1;
+    m_length = (config.length - 1) / stride + 1;
+    m_cellSize = stride * config.spacing();
+    m_origin = vec2(bounds.min.x, bounds.min.z);
+
+    size_t count = size_t(m_width) * m_length;
+    m_ground.resize(count);
+    m_depth.resize(count);
+    m_level.resize(count);
+    m_limit.resize(count);
+    m_flowX.assign(size_t(m_width + 1) * m_length, 0);
+    m_flowZ.assign(size_t(m_width) * (m_length + 1), 0);
+    m_openRow.assign(m_width, 1);
+    m_surface.resize(count * 2);
+    m_nextSurface.resize(count * 2);
+
+    // filled to the sea where the ground is below it, so it starts at rest
+    for (int z = 0; z < m_length; z++) {
+        for (int x = 0; x < m_width; x++) {
+            size_t i = size_t(z) * m_width + x;
+            m_ground[i] = terrain.sampleHeight(m_origin.x + x * m_cellSize, m_origin.y + z * m_cellSize);
+            m_depth[i] = max(0.0f, m_seaLevel - m_ground[i]);
+            m_level[i] = m_ground[i] + m_depth[i];
+        }
+    }
+    snapshot();
+    m_surface.swap(m_nextSurface);
+    m_highest = m_nextHighest;
+    m_changed = true;
+}
+
+// One step of the pipe model, as four passes over the rows. Each pass
+// only writes its own rows, so needs everything before it finished.
+void ShallowWater::step() {
+    int w = m_width, l = m_length;
+    float pipe = m_timestep * GRAVITY * m_cellSize;     // flow gained per unit of surface difference
+    float area = m_cellSize * m_cellSize;
+    float dt = m_timestep;
+    float sea = m_seaLevel;
+    m_seaRow.assign(w, sea);
+    JobSystem &jobs = JobSystem::instance();
+
+    // Accelerate every pipe by the difference in surface across it
+    jobs.wait(jobs.parallelFor(0, l + 1, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            float *flowZ = &m_flowZ[size_t(z) * w];
+            const float *above = z > 0 ? &m_level[size_t(z - 1) * w] : m_seaRow.data();
+            const float *below = z < l ? &m_level[size_t(z) * w] : m_seaRow.data();
+            for (int x = 0; x < w; x++) {
+                flowZ[x] = DAMPING * flowZ[x] + pipe * (above[x] - below[x]);
+            }
+            if (z == l) continue;
+
+            float *flowX = &m_flowX[size_t(z) * (w + 1)];
+            flowX[0] = DAMPING * flowX[0] + pipe * (sea - below[0]);
+            for (int x = 1; x < w; x++) {
+                flowX[x] = DAMPING * flowX[x] + pipe * (below[x - 1] - below[x]);
+            }
+            flowX[w] = DAMPING * flowX[w] + pipe * (below[w - 1] - sea);
+        }
+    }));
+
+    // How much of its outflow each cell has the water for
+    jobs.wait(jobs.parallelFor(0, l, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            const float *flowX = &m_flowX[size_t(z) * (w + 1)];
+            const float *flowUp = &m_flowZ[size_t(z) * w];
+            const float *flowDown = &m_flowZ[size_t(z + 1) * w];
+            const float *depth = &m_depth[size_t(z) * w];
+            float *limit = &m_limit[size_t(z) * w];
+            for (int x = 0; x < w; x++) {
+                float out = max(0.0f, -flowX[x]) + max(0.0f, flowX[x + 1]) + max(0.0f, -flowUp[x]) + max(0.0f, flowDown[x]);
+                limit[x] = min(1.0f, depth[x] * area / max(out * dt, 1e-12f));
+            }
+        }
+    }));
+
+    // Scale each pipe by the limit of the cell it drains
+    jobs.wait(jobs.parallelFor(0, l + 1, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            float *flowZ = &m_flowZ[size_t(z) * w];
+            const float *above = z > 0 ? &m_limit[size_t(z - 1) * w] : m_openRow.data();
+            const float *below = z < l ? &m_limit[size_t(z) * w] : m_openRow.data();
+            for (int x = 0; x < w; x++) {
+                flowZ[x] *= flowZ[x] > 0 ? above[x] : below[x];
+            }
+            if (z == l) continue;
+
+            float *flowX = &m_flowX[size_t(z) * (w + 1)];
+            flowX[0] *= flowX[0] > 0 ? 1.0f : below[0];
+            for (int x = 1; x < w; x++) {
+                flowX[x] *= flowX[x] > 0 ? below[x - 1] : below[x];
+            }
+            flowX[w] *= flowX[w] > 0 ? below[w - 1] : 1.0f;
+        }
+    }));
+
+    // Move the water
+    jobs.wait(jobs.parallelFor(0, l, 0, [&](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            const float *flowX = &m_flowX[size_t(z) * (w + 1)];
+            const float *flowUp = &m_flowZ[size_t(z) * w];
+            const float *flowDown = &m_flowZ[size_t(z + 1) * w];
+            const float *ground = &m_ground[size_t(z) * w];
+            float *depth = &m_depth[size_t(z) * w];
+            float *level = &m_level[size_t(z) * w];
+            for (int x = 0; x < w; x++) {
+                float net = flowX[x] - flowX[x + 1] + flowUp[x] - flowDown[x];
+                depth[x] = max(0.0f, depth[x] + dt * net / area);
+                level[x] = ground[x] + depth[x];
+            }
+        }
+    }));
+}
+
+// Copies the surface out for the render thread to pick up
+void ShallowWater::snapshot() {
+    float highest = m_seaLevel;
+    for (size_t i = 0; i < m_depth.size(); i++) {
+        m_nextSurface[i * 2] = m_level[i];
+        m_nextSurface[i * 2 + 1] = m_depth[i];
+        if (m_depth[i] > WET_DEPTH) highest = max(highest, m_level[i]);
+    }
+    m_nextHighest = highest;
+}
+
+// Only waits when a reset catches a batch still running, and then without
+// picking up other jobs
+void ShallowWater::finishSteps() {
+    if (!m_steps) return;
+    JobSystem::instance().waitOnly(m_steps);
+    m_steps = nullptr;
+    m_surface.swap(m_nextSurface);
+    m_highest = m_nextHighest;
+    m_changed = true;
+}
+
+bool ShallowWater::update(const Terrain &terrain, double seconds) {
+    if (terrain.getSeed() != m_seed) {
+        reset(terrain, m_cells, 1 / m_timestep);
+        return true;
+    }
+
+    // Without a grid the water is just the sea
+    if (m_ground.empty()) {
+        if (m_surface[0] == m_nextSeaLevel) return false;
+        m_seaLevel = m_nextSeaLevel;
+        m_surface[0] = m_seaLevel;
+        m_highest = m_seaLevel;
+        m_changed = true;
+        return true;
+    }
+
+    // Fixed steps, whatever the frame rate. Time the last batch was still
+    // running for is owed to the next, up to MAX_STEPS.
+    m_owed = min(m_owed + seconds, double(MAX_STEPS * m_timestep));
+    if (m_steps && !m_steps->isFinished()) return false;
+    bool changed = m_steps != nullptr;
+    finishSteps();
+
+    int steps = int(m_owed / m_timestep);
+    if (steps == 0) return changed;
+    m_owed -= steps * m_timestep;
+    m_seaLevel = m_nextSeaLevel;
+    m_steps = JobSystem::instance().runOnWorker([this, steps]() {
+        for (int i = 0; i < steps; i++) {
+            step();
+        }
+        snapshot();
+    });
+    return changed;
+}
+
+// Raising it floods the land from the edges, lowering it drains it
+void ShallowWater::setSeaLevel(float level) {
+    m_nextSeaLevel = level;
+}
+
+float ShallowWater::getSeaLevel() const {
+    return m_nextSeaLevel;
+}
+
+float ShallowWater::getHighest() const {
+    return m_highest;
+}
+
+void ShallowWater::upload() {
+    if (!m_changed) return;
+    m_changed = false;
+
+    if (m_texture == 0) {
+        glGenTextures(1, &m_texture);
+        glBindTexture(GL_TEXTURE_2D, m_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    if (m_textureWidth != m_width || m_textureLength != m_length) {
+        m_textureWidth = m_width;
+        m_textureLength = m_length;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, m_width, m_length, 0, GL_RG, GL_FLOAT, m_surface.data());
+    } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_width, m_length, GL_RG, GL_FLOAT, m_surface.data());
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void ShallowWater::bind(const ShaderProgram &shader, int unit) const {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(shader.uniform("waterLevelMap"), unit);
+    glUniform2f(shader.uniform("waterOrigin"), m_origin.x, m_origin.y);
+    glUniform1f(shader.uniform("waterCellSize"), m_cellSize);
+    glUniform2f(shader.uniform("waterCells"), float(m_width), float(m_length));
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+
+#include "cgra_math.hpp"
+#include "job_system.hpp"
+#include "opengl.hpp"
+#include "shader_program.hpp"
+
+class Terrain;
+
+// Shallow water over the terrain, by the virtual pipe model. Every cell
+// of a grid lined up with the terrain's vertices holds a depth of water,
+// and every pair of neighbouring cells is joined by a pipe whose flow is
+// accelerated by the difference in their surface heights. Each step the
+// flows out of a cell are scaled down so they never take more water than
+// it has, then the depths change by what flows in and out. The sea lies
+// all around the grid at a height that can be raised to flood the land,
+// and lowered again to drain it.
+//
+// Steps run at a fixed rate, a batch at a time as one job queued on a
+// worker rather than the render thread, with each pass split across the
+// workers. The frame is drawn with the surface from the last finished
+// batch while the next runs. Depths and flows are kept in separate arrays
+// and each pass runs branch free along rows, which the compiler vectorises.
+class ShallowWater {
+private:
+    static constexpr float GRAVITY = 9.81f;
+    static constexpr float DAMPING = 0.995f;    // flow kept each step, so sloshing settles
+    static const int MAX_STEPS = 8;             // per frame, so a slow frame doesn't fall further behind
+
+    int m_cells = 0;                    // most cells along a side, 0 for none
+    int m_width = 0;                    // cells along x
+    int m_length = 0;                   // cells along z
+    float m_cellSize = 1;               // world units between cells
+    cgra::vec2 m_origin;                // world xz of the first cell
+    float m_timestep = 1.0f / 60;       // seconds per step
+    int m_seed = 0;                     // of the terrain the ground came from
+
+    float m_seaLevel = 0;               // surface around the grid, used by the running steps
+    float m_nextSeaLevel = 0;           // taken up when the next steps start
+
+    std::vector<float> m_ground;        // terrain height under each cell
+    std::vector<float> m_depth;         // water above it
+    std::vector<float> m_level;         // ground plus depth
+    std::vector<float> m_flowX;         // width + 1 per row, from cell x - 1 into x
+    std::vector<float> m_flowZ;         // length + 1 rows, from cell z - 1 into z
+    std::vector<float> m_limit;         // share of each cell's outflow it can supply
+    std::vector<float> m_seaRow;        // the sea's level along the edges, for rows past the grid
+    std::vector<float> m_openRow;       // the sea never runs dry, for rows past the grid
+
+    std::vector<float> m_surface;       // RG per cell: surface height and depth, of the last batch
+    std::vector<float> m_nextSurface;   // written by the running batch, swapped in when it finishes
+    float m_highest = 0;                // highest wet surface
+    float m_nextHighest = 0;
+    bool m_changed = true;              // not uploaded yet
+
+    double m_owed = 0;                  // seconds not yet stepped
+    JobHandle m_steps;                  // the batch running on a worker
+    GLuint m_texture = 0;
+    int m_textureWidth = 0;
+    int m_textureLength = 0;
+
+    void step();
+    void snapshot();
+    void finishSteps();
+
+public:
+    ShallowWater() = default;
+    ShallowWater(const ShallowWater &) = delete;
+    ShallowWater & operator=(const ShallowWater &) = delete;
+
+    // Lines the grid up with the terrain, at most cells along a side, and
+    // fills it to the sea level. 0 cells leaves the water flat at the sea.
+    void reset(const Terrain &, int cells, float rate);
+
+    // Takes up the last batch of steps and starts the next, running as
+    // many as fit in the time passed. Starts over when the terrain has
+    // been reseeded. Returns true if the surface changed.
+    bool update(const Terrain &, double seconds);
+
+    void setSeaLevel(float);
+    float getSeaLevel() const;
+    float getHighest() const;
+
+    // Uploads the surface if it changed and binds it for the water
+    // program on unit
+    void upload();
+    void bind(const ShaderProgram &, int unit) const;
+};
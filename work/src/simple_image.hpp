@@ -44,7 +44,7 @@ public:
 	// Use to get the appropriate GL format for data
 	GLenum glFormat() const {
 		switch (n) {
-		case 1: return GL_R;
+		case 1: return GL_RED;
 		case 2: return GL_RG;
 		case 3: return GL_RGB;
 		case 4: return GL_RGBA;
@@ -14,11 +14,22 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <fstream>
 #include <sstream>
 
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
 #include "opengl.hpp"
 
 namespace cgra {
@@ -173,5 +184,197 @@ namespace cgra {
 		buffer << fileStream.rdbuf();
 
 		return makeShaderProgram(profile, stypes, buffer.str());
-	}	
+	}
+
+
+	//-------------------------------------------------------------
+	// Program cache
+	//
+	// Linked programs are deduplicated in-process by a hash of their
+	// stage types and sources. Where the driver supports program
+	// binaries, the glGetProgramBinary output is also saved to disk
+	// keyed by that hash and the driver vendor, renderer and version,
+	// so later launches can skip compiling and linking altogether.
+	//-------------------------------------------------------------
+
+	// 64-bit FNV-1a, continued from the given hash
+	inline uint64_t hashShaderBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+		const unsigned char *bytes = static_cast<const unsigned char *>(data);
+		for (size_t i = 0; i < size; ++i) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	inline uint64_t hashShaderSources(const std::vector<GLenum> &stypes, const std::vector<std::string> &sources) {
+		uint64_t hash = hashShaderBytes(nullptr, 0);
+		for (size_t i = 0; i < stypes.size() && i < sources.size(); ++i) {
+			hash = hashShaderBytes(&stypes[i], sizeof(GLenum), hash);
+			hash = hashShaderBytes(sources[i].data(), sources[i].size(), hash);
+		}
+		return hash;
+	}
+
+	class shader_program_cache {
+	private:
+		// header written in front of every cached program binary
+		struct binary_header {
+			char magic[8];
+			uint64_t sourceHash;
+			uint32_t format;
+			uint32_t length;
+		};
+
+		std::string m_directory = "./work/cache/";
+		std::map<uint64_t, GLuint> m_programs;
+		bool m_useBinaries = true;
+
+		bool binariesSupported() {
+			if (!m_useBinaries || !(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)) return false;
+			GLint formats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			return formats > 0;
+		}
+
+		// a driver update invalidates binaries, so the driver strings form part of the key
+		std::string binaryPath(uint64_t sourceHash) {
+			std::string driver;
+			for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+				const GLubyte *str = glGetString(name);
+				if (str) driver += reinterpret_cast<const char *>(str);
+				driver += '\n';
+			}
+			uint64_t key = hashShaderBytes(driver.data(), driver.size(), sourceHash);
+
+			char name[32];
+			std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+			return m_directory + name;
+		}
+
+		GLuint loadBinary(uint64_t sourceHash) {
+			std::ifstream file(binaryPath(sourceHash), std::ios::binary);
+			if (!file) return 0;
+
+			binary_header header;
+			if (!file.read(reinterpret_cast<char *>(&header), sizeof(header))) return 0;
+			if (std::string(header.magic, 8) != std::string("CGRAPRG1", 8) || header.sourceHash != sourceHash) return 0;
+
+			std::vector<char> binary(header.length);
+			if (!file.read(binary.data(), binary.size())) return 0;
+
+			GLuint prog = glCreateProgram();
+			glProgramBinary(prog, header.format, binary.data(), header.length);
+
+			// the driver is free to reject a binary, in which case we rebuild from source
+			GLint link_status;
+			glGetProgramiv(prog, GL_LINK_STATUS, &link_status);
+			if (!link_status) {
+				glDeleteProgram(prog);
+				return 0;
+			}
+			return prog;
+		}
+
+		void saveBinary(uint64_t sourceHash, GLuint prog) {
+			GLint length = 0;
+			glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+			if (length <= 0) return;
+
+			std::vector<char> binary(length);
+			GLenum format = 0;
+			glGetProgramBinary(prog, length, &length, &format, binary.data());
+
+#ifdef _WIN32
+			_mkdir(m_directory.c_str());
+#else
+			mkdir(m_directory.c_str(), 0755);
+#endif
+			std::ofstream file(binaryPath(sourceHash), std::ios::binary);
+			if (!file) {
+				std::cout << "SimpleShader : " << "Could not write program cache to " << m_directory << std::endl;
+				return;
+			}
+
+			binary_header header = { { 'C', 'G', 'R', 'A', 'P', 'R', 'G', '1' }, sourceHash, format, uint32_t(length) };
+			file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			file.write(binary.data(), length);
+		}
+
+		GLuint linkProgram(const std::vector<GLenum> &stypes, const std::vector<std::string> &sources, bool retrievable) {
+			GLuint prog = glCreateProgram();
+			if (retrievable) glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+			std::vector<GLuint> shaders;
+			for (size_t i = 0; i < stypes.size(); ++i) {
+				shaders.push_back(compileShader(stypes[i], sources[i]));
+				glAttachShader(prog, shaders.back());
+			}
+
+			linkShaderProgram(prog);
+
+			// the linked program keeps everything it needs from the shader objects
+			for (GLuint shader : shaders) {
+				glDetachShader(prog, shader);
+				glDeleteShader(shader);
+			}
+			return prog;
+		}
+
+	public:
+		static shader_program_cache & instance() {
+			static shader_program_cache cache;
+			return cache;
+		}
+
+		// directory the program binaries are written to, with a trailing separator
+		void setDirectory(const std::string &directory) { m_directory = directory; }
+
+		// disable to always compile from source (still deduplicated in-process)
+		void setUseBinaries(bool useBinaries) { m_useBinaries = useBinaries; }
+
+		GLuint getProgram(const std::vector<GLenum> &stypes, const std::vector<std::string> &sources) {
+			if (stypes.size() != sources.size()) {
+				throw std::runtime_error("Error: stypes and shader sources, vector size mismatch");
+			}
+
+			uint64_t sourceHash = hashShaderSources(stypes, sources);
+			auto it = m_programs.find(sourceHash);
+			if (it != m_programs.end()) return it->second;
+
+			bool binaries = binariesSupported();
+			GLuint prog = binaries ? loadBinary(sourceHash) : 0;
+			if (prog) {
+				std::cout << "SimpleShader : " << "Shader program loaded from binary cache" << std::endl;
+			} else {
+				prog = linkProgram(stypes, sources, binaries);
+				if (binaries) saveBinary(sourceHash, prog);
+				std::cout << "SimpleShader : " << "Shader program compiled and linked successfully" << std::endl;
+			}
+
+			m_programs[sourceHash] = prog;
+			return prog;
+		}
+	};
+
+	inline GLuint makeCachedShaderProgram(const std::vector<GLenum> &stypes, const std::vector<std::string> &sources) {
+		return shader_program_cache::instance().getProgram(stypes, sources);
+	}
+
+	inline GLuint makeCachedShaderProgramFromFile(const std::vector<GLenum> &stypes, const std::vector<std::string> &sourcefiles) {
+		std::vector<std::string> sources;
+		for (std::string filename : sourcefiles) {
+			std::ifstream fileStream(filename);
+
+			if (!fileStream) {
+				throw std::runtime_error("Error: Could not locate and open file " + filename);
+			}
+
+			std::stringstream buffer;
+			buffer << fileStream.rdbuf();
+			sources.push_back(buffer.str());
+		}
+
+		return makeCachedShaderProgram(stypes, sources);
+	}
 }
\ No newline at end of file
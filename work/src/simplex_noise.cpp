@@ -1,12 +1,16 @@
+#include <algorithm>
 #include <cmath>
 #include <iostream> // input/output streams
 #include <fstream>  // file streams
 #include <sstream>  // string streams
 #include <string>
+#include <limits>
+#include <mutex>
 #include <stdexcept>
 #include <vector>
 
 #include "cgra_math.hpp"
+#include "job_system.hpp"
 #include "simplex_noise.hpp"
 #include "opengl.hpp"
 #include "simple_image.hpp"
@@ -48,45 +52,55 @@ vector<vec3> SimplexNoise::generateVertices( float scale, int octaves, float per
         octaveOffsets.push_back(vec2(offsetX, offsetY));
     }
     
-    for (int z = 0; z < noise_length; z++) {
-        //vector<float> row;
-        for (int x = 0; x < noise_width; x++) {
-            
-            float frequency = 1;
-            float amplitude = 1;
-            float height = 0;
-            for (int i =0; i < octaves; i++ ) {
-                float sampleX = x / scale * frequency + octaveOffsets[i].x;
-                float sampleZ = z / scale * frequency + octaveOffsets[i].y;
+    // Rows are generated in parallel, each chunk keeping its own height
+    // range which is merged in once the chunk is done
+    vertices.resize(noise_length * noise_width);
+    mutex rangeMutex;
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, noise_length, 0, [&](int z0, int z1) {
+        float chunkMax = -numeric_limits<float>::max();
+        float chunkMin = numeric_limits<float>::max();
+        for (int z = z0; z < z1; z++) {
+            for (int x = 0; x < noise_width; x++) {
                 
-                float perlinValue = generateNoiseInternal(sampleX, sampleZ);
-                height += perlinValue * amplitude;
+                float frequency = 1;
+                float amplitude = 1;
+                float height = 0;
+                for (int i =0; i < octaves; i++ ) {
+                    float sampleX = x / scale * frequency + octaveOffsets[i].x;
+                    float sampleZ = z / scale * frequency + octaveOffsets[i].y;
+                    
+                    float perlinValue = generateNoiseInternal(sampleX, sampleZ);
+                    height += perlinValue * amplitude;
+                    
+                    amplitude *= persistence;
+                    frequency *= lacunarity;
+                }
                 
-                amplitude *= persistence;
-                frequency *= lacunarity;
-            }
-            
-            if (height > maxHeight) {
-                maxHeight = height;
-            } else if (height < minHeight) {
-                minHeight = height;
+                chunkMax = max(chunkMax, height);
+                chunkMin = min(chunkMin, height);
+                vertices[z * noise_width + x] = vec3(x, height, z);
             }
-            vertices.push_back(vec3(x, height, z));
         }
-    }
+        lock_guard<mutex> lock(rangeMutex);
+        maxHeight = max(maxHeight, chunkMax);
+        minHeight = min(minHeight, chunkMin);
+    }));
 
     cout << "Max Height: " << maxHeight << endl;
     cout << "Min Height: " << minHeight << endl;
     
-    for (int i = 0; i < noise_length*noise_width; i++) {
-        // Normalise the height between over the max an min height range
-        float height = (vertices[i].y - minHeight) / (maxHeight - minHeight);
-        if (use_falloff) {
-            // If using falloff, subtract the falloff value from the height and reclamp.
-            height = clamp(height - falloff_map[i], 1, 0);
+    jobs.wait(jobs.parallelFor(0, noise_length*noise_width, 0, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++) {
+            // Normalise the height between over the max an min height range
+            float height = (vertices[i].y - minHeight) / (maxHeight - minHeight);
+            if (use_falloff) {
+                // If using falloff, subtract the falloff value from the height and reclamp.
+                height = clamp(height - falloff_map[i], 1, 0);
+            }
+            vertices[i].y = height;
         }
-        vertices[i].y = height;
-    }
+    }));
 
     return vertices;
 }
@@ -1,14 +1,26 @@
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iostream> // input/output streams
 #include <fstream>  // file streams
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <sstream>  // string streams
 #include <string>
 #include <stdexcept>
 #include <vector>
 
 #include "cgra_math.hpp"
+#include "heightmap_import.hpp"
+#include "job_system.hpp"
 #include "terrain.hpp"
 #include "opengl.hpp"
+#include "shader_program.hpp"
 #include "simple_image.hpp"
 
 using namespace std;
@@ -16,25 +28,124 @@ using namespace cgra;
 
 SimplexNoise simplex_noise = SimplexNoise();
 
+// Octahedral encoding folded around y, so the upward facing normals a
+// terrain mostly has use the middle of the range
+static void encodeNormal(vec3 n, GLshort out[2]) {
+    n = n / (fabs(n.x) + fabs(n.y) + fabs(n.z));
+    vec2 e(n.x, n.z);
+    if (n.y < 0) {
+        e = vec2((1 - fabs(n.z)) * (n.x >= 0 ? 1 : -1), (1 - fabs(n.x)) * (n.z >= 0 ? 1 : -1));
+    }
+    out[0] = GLshort(round(max(-1.0f, min(1.0f, e.x)) * 32767));
+    out[1] = GLshort(round(max(-1.0f, min(1.0f, e.y)) * 32767));
+}
+
+// exp in a form the compiler can vectorise: 2^(x log2 e), split into a
+// power of two built straight into the exponent bits and a polynomial for
+// the remaining fraction. Relative error is under 1e-6.
+static inline float fastExp(float x) {
+    float t = x * 1.44269504f;
+    int i = int(t + (t >= 0 ? 0.5f : -0.5f));
+    float f = t - i;
+    float p = 1.0f + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f + f * (0.00961813f + f * (0.00133336f + f * 0.00015404f)))));
+    int32_t bits = (i + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(float));
+    return p * scale;
+}
+
 Terrain::Terrain(string textureFilename, int seed) {
-    simplex_noise.init(terrain_length, terrain_width);
-    simplex_noise.setSeed(seed);
     t_texture_filename = textureFilename;
+    t_config.seed = seed;
+    configure(t_config);
+    
+    t_display_wire = false;
+}
+
+Terrain::~Terrain() {}
+
+// Must be called before setupTerrain, the grid can't change afterwards
+// A terrain file replaces the grid and noise settings with the ones it
+// was saved with, and is loaded rather than generated for its seed
+void Terrain::configure(const TerrainConfig &settings) {
+    TerrainConfig config = settings;
+    if (!settings.terrainFile.empty()) {
+        t_file.open(settings.terrainFile);
+        config = t_file.applyTo(settings);
+    } else {
+        t_file.close();
+    }
+    
+    t_config = config;
+    t_seed = config.seed;
+    
+    terrain_width = config.width;
+    terrain_length = config.length;
+    t_spacing = config.spacing();
+    height_multiplier = config.heightScale;
+    simplex_noise.init(terrain_length, terrain_width);
+    
+    t_curve_lut.clear();
+    if (config.heightLut) {
+        t_curve_lut.resize(CURVE_LUT_SIZE + 1);
+        for (int i = 0; i <= CURVE_LUT_SIZE; i++) {
+            t_curve_lut[i] = heightModifier(float(i) / CURVE_LUT_SIZE);
+        }
+    }
     
     x_off = -(int)terrain_width/2;
     z_off = -(int)terrain_length/2;
     y_off = 0;
-    
-    t_display_wire = false;
 }
 
-Terrain::~Terrain() {}
+// Must be called before setupTerrain for the rivers to drain into it
+void Terrain::setWaterLevel(float level) {
+    t_water_level = level;
+}
 
-void Terrain::readTex(string filename) {
-    Image tex(filename);
+const TerrainConfig & Terrain::getConfig() const {
+    return t_config;
+}
+
+int Terrain::getSeed() const {
+    return t_seed;
+}
+
+// Rough peak memory of the terrain at its configured size
+void Terrain::printMemoryEstimate() const {
+    double vertices = double(terrain_width) * terrain_length;
+    double quads = double(terrain_width - 1) * (terrain_length - 1);
+    const double MB = 1024.0 * 1024.0;
+    
+    // points, heights and normals, for the drawn terrain, the one blended from and the one being generated
+    double data = vertices * (2 * sizeof(vec3) + sizeof(float) + sizeof(uint8_t)) * 3;
+    // patch list, and the min/max pyramid of each data set at about 4/3 of its base
+    double grid = quads / (PATCH_SIZE * PATCH_SIZE) * sizeof(terrain_patch) + quads * 2 * sizeof(float) * 4 / 3 * 3;
+    // unsmoothed normals and falloff map while generating, encoded normals until uploaded
+    double scratch = vertices * (sizeof(vec3) + sizeof(float) + 2 * sizeof(GLshort));
+    double textures = vertices * (sizeof(float) + 2 * sizeof(GLshort) + sizeof(GLubyte)) * 2;
     
+    cout << "Terrain memory estimate:" << endl;
+    cout << "  CPU heights/normals: " << data / MB << "MB" << endl;
+    cout << "  CPU patches and height pyramids: " << grid / MB << "MB" << endl;
+    cout << "  CPU scratch during generation: " << scratch / MB << "MB" << endl;
+    cout << "  GPU height/normal/ambient textures: " << textures / MB << "MB" << endl;
+    cout << "  Total: " << (data + grid + scratch + textures) / MB << "MB" << endl;
+}
+
+// Wraps a stage in a job that records how long it took
+static JobHandle timedJob(double &ms, function<void()> stage) {
+    return JobSystem::instance().create([&ms, stage] {
+        auto start = chrono::steady_clock::now();
+        stage();
+        ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    });
+}
+
+// Uploads an already decoded image, reusing the texture on reseeds
+void Terrain::readTex(const Image &tex) {
     glActiveTexture(GL_TEXTURE0); // Use slot 0, need to use GL_TEXTURE1 ... etc if using more than one texture PER OBJECT
-    glGenTextures(1, &t_texture); // Generate texture ID
+    if (!t_texture) glGenTextures(1, &t_texture); // Generate texture ID
     glBindTexture(GL_TEXTURE_2D,  t_texture); // Bind it as a 2D texture
     
     // Setup sampling strategies
@@ -45,225 +156,602 @@ void Terrain::readTex(string filename) {
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     
     // Finnaly, actually fill the data into our texture
-    gluBuild2DMipmaps(GL_TEXTURE_2D, 3, tex.w, tex.h, tex.glFormat(), GL_UNSIGNED_BYTE, tex.dataPointer());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, tex.w, tex.h, 0, tex.glFormat(), GL_UNSIGNED_BYTE, tex.dataPointer());
+    glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+// The noise draws its octave offsets from rand(), so it is seeded here,
+// on the job's thread. Only one generation runs at a time. A heightmap,
+// if one was given, stands in for the noise of the starting seed.
+void Terrain::generateHeights(terrain_data &data) {
+    if (!t_config.heightmap.empty() && data.seed == t_config.seed) {
+        vector<float> grid = HeightmapImport::load(t_config.heightmap, t_config.heightmapWidth, t_config.heightmapLength,
+            t_config.heightmapSigned, terrain_width, terrain_length);
+        data.points.resize(grid.size());
+        for (int z = 0; z < terrain_length; z++) {
+            for (int x = 0; x < terrain_width; x++) {
+                data.points[z * terrain_width + x] = vec3(x, grid[z * terrain_width + x], z);
+            }
+        }
+        data.imported = true;
+        return;
+    }
+    
+    simplex_noise.setSeed(data.seed);
+    data.points = simplex_noise.generateVertices(t_config.noiseScale / t_spacing, t_config.octaves,
+        t_config.persistence, t_config.lacunarity, t_config.falloff);
 }
 
-void Terrain::generateHeights() {
-    t_points.clear();
-    cout << "Started: generating heights" << endl;
-    t_points = simplex_noise.generateVertices(40, 4, 0.4, 2, true);
-    cout << "Finished: generating heights" << endl;
+// Runs on the normalised heights, before they are shaped or lit
+void Terrain::erodeHeights(terrain_data &data) {
+    if (t_config.erosionDroplets <= 0) return;
+    
+    vector<float> heights(data.points.size());
+    for (size_t i = 0; i < heights.size(); i++) {
+        heights[i] = data.points[i].y;
+    }
+    t_erosion.erode(heights, terrain_width, terrain_length, data.seed, t_config.erosionDroplets);
+    for (size_t i = 0; i < heights.size(); i++) {
+        data.points[i].y = heights[i];
+    }
 }
 
-void Terrain::generateUvs() {
-    t_uvs.clear();
+// Thermal erosion after the droplets, so the banks they cut slump. It runs
+// on world heights, so the talus is a real angle wherever the height curve
+// steepens, then the result is taken back through the curve's inverse.
+void Terrain::relaxHeights(terrain_data &data) {
+    if (t_config.thermalIterations <= 0) return;
     
-    for (int z = 0; z < terrain_length; z++) {
-        for (int x = 0; x < terrain_width; x ++) {
-            float x_uv = (float)x / (float)terrain_width;
-            float z_uv = (float)z / (float)terrain_length;
-            t_uvs.push_back(vec2(x_uv, z_uv));
+    vector<float> heights(data.points.size());
+    float multiplier = height_multiplier;
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, heights.size(), 0, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            float h = data.points[i].y;
+            heights[i] = data.imported ? h * multiplier : heightModifier(h);
+        }
+    }));
+    float talus = tan(t_config.thermalTalus * math::pi() / 180) * t_spacing;
+    ThermalErosion thermal(t_config.thermalIterations, talus, t_config.thermalThreshold);
+    vector<double> iterationMs;
+    int iterations = thermal.erode(heights, terrain_width, terrain_length, iterationMs);
+    // slumping only moves material downhill, so heights stay positive for the log
+    jobs.wait(jobs.parallelFor(0, heights.size(), 0, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            float h = heights[i] / multiplier;
+            data.points[i].y = data.imported ? h : (log(h) + 6) / 6;
         }
+    }));
+    
+    double total = 0, slowest = 0, fastest = numeric_limits<double>::max();
+    for (double ms : iterationMs) {
+        total += ms;
+        slowest = max(slowest, ms);
+        fastest = min(fastest, ms);
     }
+    cout << "Thermal erosion: " << iterations << " iterations" << (iterations < t_config.thermalIterations ? " (converged)" : "")
+        << ", " << total / iterations << "ms each (" << fastest << "-" << slowest << "ms)" << endl;
 }
 
-// Normal computation method sourced from: https://medium.com/@SoumitraSaxena/terrain-generation-from-a-heightmap-cccf50e961a9
-void Terrain::generateNormals() {
-    t_normals.clear();
-    cout << "Started: generating normals" << endl;
-    vec3 normals[terrain_length][terrain_width];
-    
-    for (int z = 0; z < terrain_length; z++) {
-        for (int x = 0; x < terrain_width; x ++) {
-            vec3 sum(0.0f, 0.0f, 0.0f);
-            
-            vec3 out;
-            if (z > 0)
-            {
-                out = vec3(0.0f, getHeight(z-1, x) - getHeight(z, x), -1.0f);
-            }
-            vec3 in;
-            if (z < terrain_length - 1)
-            {
-                in = vec3(0.0f, getHeight(z+1, x) - getHeight(z, x), 1.0f);
-            }
-            vec3 left;
-            if (x > 0)
-            {
-                left = vec3(-1.0f, getHeight(z, x-1) - getHeight(z, x), 0.0f);
-            }
-            vec3 right;
-            if (x < terrain_width - 1)
-            {
-                right = vec3(1.0f, getHeight(z, x+1) - getHeight(z, x), 0.0f);
+// Rivers are cut last, so nothing fills the channels back in. The water
+// level is taken back through the height curve to a normalised height.
+void Terrain::carveRivers(terrain_data &data) {
+    if (t_config.riverArea <= 0) return;
+    
+    float level = max(t_water_level - y_off, 1e-6f) / height_multiplier;
+    float seaLevel = data.imported ? level : (log(level) + 6) / 6;
+    int threshold = max(1, int(t_config.riverArea / (t_spacing * t_spacing)));
+    
+    vector<float> heights(data.points.size());
+    for (size_t i = 0; i < heights.size(); i++) {
+        heights[i] = data.points[i].y;
+    }
+    RiverNetwork rivers;
+    RiverNetwork::timings times;
+    rivers.build(heights, terrain_width, terrain_length, seaLevel, times);
+    rivers.carve(heights, threshold, t_config.riverDepth, times);
+    for (size_t i = 0; i < heights.size(); i++) {
+        data.points[i].y = heights[i];
+    }
+    
+    cout << "Rivers: fill " << times.fill_ms << "ms, directions " << times.directions_ms << "ms, accumulation "
+        << times.accumulation_ms << "ms, carve " << times.carve_ms << "ms" << endl;
+}
+
+// Copies a saved terrain out of the mapping, a row per job so the pages
+// are faulted in in parallel
+void Terrain::loadTerrainFile(terrain_data &data) {
+    const TerrainFileHeader &header = t_file.getHeader();
+    size_t count = size_t(terrain_width) * terrain_length;
+    data.points.resize(count);
+    data.heights.resize(count);
+    data.normals.resize(count);
+    data.encoded_normals.resize(count * 2);
+    data.min_height = header.minHeight;
+    data.max_height = header.maxHeight;
+    
+    const float *noise = t_file.getNoise();
+    const float *heights = t_file.getHeights();
+    const vec3 *normals = t_file.getNormals();
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, terrain_length, 0, [&](int begin, int end) {
+        size_t first = size_t(begin) * terrain_width;
+        size_t rows = size_t(end - begin) * terrain_width;
+        for (int z = begin; z < end; z++) {
+            for (int x = 0; x < terrain_width; x++) {
+                size_t i = size_t(z) * terrain_width + x;
+                data.points[i] = vec3(x, noise[i], z);
             }
-            
-            if (x > 0 && z > 0)
-            {
-                sum += normalize(cross(out, left));
+        }
+        memcpy(&data.heights[first], heights + first, rows * sizeof(float));
+        memcpy(&data.normals[first], normals + first, rows * sizeof(vec3));
+        for (size_t i = first; i < first + rows; i++) {
+            encodeNormal(data.normals[i], &data.encoded_normals[i * 2]);
+        }
+    }));
+}
+
+void Terrain::saveTerrain(const string &filename) const {
+    TerrainFile::save(filename, t_config, t_seed, t_data.points, t_data.heights, t_data.normals,
+                      t_data.min_height, t_data.max_height);
+}
+
+// Applies heightModifier to every point once, into the persistent height
+// buffer that bounds, the occluder and the height texture all read, and
+// finds the height range in the same pass
+void Terrain::shapeHeights(terrain_data &data) {
+    size_t count = data.points.size();
+    data.heights.resize(count);
+    data.min_height = numeric_limits<float>::max();
+    data.max_height = numeric_limits<float>::lowest();
+    
+    mutex rangeMutex;
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, count, 0, [&](int begin, int end) {
+        // copy the heights out of the points so the curve runs over plain floats
+        float *heights = data.heights.data();
+        for (int i = begin; i < end; i++) {
+            heights[i] = data.points[i].y;
+        }
+        
+        if (data.imported) {
+            // real elevations keep their shape
+            float multiplier = height_multiplier;
+            for (int i = begin; i < end; i++) {
+                heights[i] *= multiplier;
             }
-            if (x > 0 && z < terrain_length - 1)
-            {
-                sum += normalize(cross(left, in));
+        } else if (!t_curve_lut.empty()) {
+            const float *lut = t_curve_lut.data();
+            for (int i = begin; i < end; i++) {
+                float x = max(0.0f, min(1.0f, heights[i])) * CURVE_LUT_SIZE;
+                int j = min(int(x), CURVE_LUT_SIZE - 1);
+                heights[i] = lut[j] + (lut[j + 1] - lut[j]) * (x - j);
             }
-            if (x < terrain_width - 1 && z < terrain_length - 1)
-            {
-                sum += normalize(cross(in, right));
+        } else {
+            float multiplier = height_multiplier;
+            for (int i = begin; i < end; i++) {
+                heights[i] = fastExp(heights[i] * 6 - 6) * multiplier;
             }
-            if (x < terrain_width - 1 && z > 0)
-            {
-                sum += normalize(cross(right, out));
+        }
+        
+        float chunkMin = numeric_limits<float>::max();
+        float chunkMax = numeric_limits<float>::lowest();
+        for (int i = begin; i < end; i++) {
+            chunkMin = min(chunkMin, heights[i]);
+            chunkMax = max(chunkMax, heights[i]);
+        }
+        lock_guard<mutex> lock(rangeMutex);
+        data.min_height = min(data.min_height, chunkMin);
+        data.max_height = max(data.max_height, chunkMax);
+    }));
+}
+
+// Normal computation method sourced from: https://medium.com/@SoumitraSaxena/terrain-generation-from-a-heightmap-cccf50e961a9
+void Terrain::generateNormals(terrain_data &data) {
+    // Rows are independent in each pass, so both run as parallel-fors
+    vector<vec3> normals(terrain_length * terrain_width);
+    JobSystem &jobs = JobSystem::instance();
+    
+    jobs.wait(jobs.parallelFor(0, terrain_length, 0, [&](int z0, int z1) {
+        for (int z = z0; z < z1; z++) {
+            for (int x = 0; x < terrain_width; x ++) {
+                vec3 sum(0.0f, 0.0f, 0.0f);
+                
+                vec3 out;
+                if (z > 0)
+                {
+                    out = vec3(0.0f, getHeight(data, z-1, x) - getHeight(data, z, x), -t_spacing);
+                }
+                vec3 in;
+                if (z < terrain_length - 1)
+                {
+                    in = vec3(0.0f, getHeight(data, z+1, x) - getHeight(data, z, x), t_spacing);
+                }
+                vec3 left;
+                if (x > 0)
+                {
+                    left = vec3(-t_spacing, getHeight(data, z, x-1) - getHeight(data, z, x), 0.0f);
+                }
+                vec3 right;
+                if (x < terrain_width - 1)
+                {
+                    right = vec3(t_spacing, getHeight(data, z, x+1) - getHeight(data, z, x), 0.0f);
+                }
+                
+                if (x > 0 && z > 0)
+                {
+                    sum += normalize(cross(out, left));
+                }
+                if (x > 0 && z < terrain_length - 1)
+                {
+                    sum += normalize(cross(left, in));
+                }
+                if (x < terrain_width - 1 && z < terrain_length - 1)
+                {
+                    sum += normalize(cross(in, right));
+                }
+                if (x < terrain_width - 1 && z > 0)
+                {
+                    sum += normalize(cross(right, out));
+                }
+                
+                normals[z * terrain_width + x] = sum;
             }
-            
-            normals[z][x] = sum;
-            
         }
-    }
+    }));
     
     //Smooth out the normals
     const float FALLOUT_RATIO = 0.5f;
-    for(int z = 0; z < terrain_length; z++)
-    {
-        for(int x = 0; x < terrain_width; x++)
+    data.normals.resize(terrain_length * terrain_width);
+    data.encoded_normals.resize(data.normals.size() * 2);
+    jobs.wait(jobs.parallelFor(0, terrain_length, 0, [&](int z0, int z1) {
+        for(int z = z0; z < z1; z++)
         {
-            vec3 sum = normals[z][x];
-            
-            if (x > 0)
-            {
-                sum += normals[z][x - 1] * FALLOUT_RATIO;
-            }
-            if (x < terrain_width - 1)
-            {
-                sum += normals[z][x + 1] * FALLOUT_RATIO;
-            }
-            if (z > 0)
-            {
-                sum += normals[z - 1][x] * FALLOUT_RATIO;
-            }
-            if (z < terrain_length - 1)
-            {
-                sum += normals[z + 1][x] * FALLOUT_RATIO;
-            }
-            
-            if (length(sum) == 0)
+            for(int x = 0; x < terrain_width; x++)
             {
-                sum = vec3(0.0f, 1.0f, 0.0f);
+                int i = z * terrain_width + x;
+                vec3 sum = normals[i];
+                
+                if (x > 0)
+                {
+                    sum += normals[i - 1] * FALLOUT_RATIO;
+                }
+                if (x < terrain_width - 1)
+                {
+                    sum += normals[i + 1] * FALLOUT_RATIO;
+                }
+                if (z > 0)
+                {
+                    sum += normals[i - terrain_width] * FALLOUT_RATIO;
+                }
+                if (z < terrain_length - 1)
+                {
+                    sum += normals[i + terrain_width] * FALLOUT_RATIO;
+                }
+                
+                if (length(sum) == 0)
+                {
+                    sum = vec3(0.0f, 1.0f, 0.0f);
+                }
+                data.normals[i] = normalize(sum);
+                encodeNormal(data.normals[i], &data.encoded_normals[i * 2]);
             }
-            t_normals.push_back(normalize(sum));
         }
-    }
-    
-    cout << "Finished: generating normals" << endl;
+    }));
 }
 
-void Terrain::generateTriangles() {
-    t_triangles.clear();
-    cout << "Started: generating trinagles" << endl;
-    for (int z = 0; z < terrain_length-1; z++) {
-        for (int x = 0; x < terrain_width-1; x++) {
-            
-            int i1 = z * terrain_width + x;
-            int i2 = (z+1) * terrain_width + x;
-            int i3 = (z) * terrain_width + (x+1);
-            int i4 = (z+1) * terrain_width + (x+1);
-            
-            // These normal indices are for per vertex normals, which I may yet use.
-            vertex v1 = {i1, i1, i1};
-            vertex v2 = {i2, i2, i2};
-            vertex v3 = {i3, i3, i3};
-            vertex v4 = {i4, i4, i4};
-            
-            triangle t1 = {{v1, v2, v3}};
-            triangle t2 = {{v2, v3, v4}};
-            
-            t_triangles.push_back(t1);
-            t_triangles.push_back(t2);
+// Every patch is drawn from one shared PATCH_SIZE grid mesh, built in
+// createPatchMesh, so only the patch list depends on the terrain size
+void Terrain::generatePatches() {
+    t_patches.clear();
+    for (int pz = 0; pz < terrain_length-1; pz += PATCH_SIZE) {
+        for (int px = 0; px < terrain_width-1; px += PATCH_SIZE) {
+            terrain_patch patch;
+            patch.x = px;
+            patch.z = pz;
+            t_patches.push_back(patch);
+        }
+    }
+    
+    // Triangles of the coarse occluder grid, see createOccluder
+    int step = max(1, (terrain_width - 1) / OCCLUDER_CELLS);
+    int cellsX = (terrain_width - 2) / step + 1;
+    int cellsZ = (terrain_length - 2) / step + 1;
+    t_occluder_indices.clear();
+    for (int cz = 0; cz < cellsZ; cz++) {
+        for (int cx = 0; cx < cellsX; cx++) {
+            GLuint i1 = cz * (cellsX + 1) + cx;
+            GLuint i2 = (cz + 1) * (cellsX + 1) + cx;
+            t_occluder_indices.insert(t_occluder_indices.end(), { i1, i2, i1 + 1, i2, i1 + 1, i2 + 1 });
         }
     }
-    cout << "Finished: generating trinagles" << endl;
 }
 
 
-float Terrain::getHeight(int z, int x) {
-    vec3 p = t_points[z * terrain_width + x];
+float Terrain::getHeight(const terrain_data &data, int z, int x) const {
+    vec3 p = data.points[z * terrain_width + x];
     return p.y;
 }
 
-float Terrain::heightModifier(float height) {
+float Terrain::heightModifier(float height) const {
     height = exp(height*6-6) * height_multiplier;
     return height;
 }
 
-void Terrain::createDisplayList() {
-    cout << "Started: creating display list" << endl;
-    max_height = numeric_limits<float>::min();
-    min_Height = numeric_limits<float>::max();
-    
-    if (t_displaylist) glDeleteLists(t_displaylist, 1);
-    t_displaylist = glGenLists(1);
+float Terrain::getShapedHeight(const terrain_data &data, int z, int x) const {
+    return data.heights[z * terrain_width + x];
+}
 
-    glNewList(t_displaylist, GL_COMPILE);
+vec3 Terrain::worldPosition(const terrain_data &data, int z, int x) const {
+    return vec3((x + x_off) * t_spacing, getShapedHeight(data, z, x) + y_off, (z + z_off) * t_spacing);
+}
 
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    glBegin(GL_TRIANGLES);
-    for (int i = 0; i < t_triangles.size(); i ++) {
-        triangle t = t_triangles[i];
-        for (int j = 0; j < 3; j++) {
-            vertex v = t.v[j];
-            vec3 point = t_points[v.p];
-            vec3 normal = t_normals[v.n];
-            vec2 uv = t_uvs[v.t];
-
-            float height = heightModifier(point.y);
-            if (height > max_height) {
-                max_height = height;
-            }
-            if (height < min_Height) {
-                min_Height = height;
+// Builds the shared patch mesh. It has no vertex data of its own: the
+// vertex shader places each vertex from gl_VertexID and the patch's grid
+// position, which comes from a per-instance attribute.
+//
+// Each row of quads is one triangle strip zig-zagging between the row's
+// two vertex lines, and rows are joined by a restart index. The rows have
+// fixed offsets, so they are written in parallel straight into the mapped
+// index buffer.
+void Terrain::createPatchMesh() {
+    const int rowLength = 2 * (PATCH_SIZE + 1) + 1;
+    t_patch_index_count = PATCH_SIZE * rowLength;
+    
+    glGenVertexArrays(1, &t_vao);
+    glGenBuffers(1, &t_ibo);
+    glGenBuffers(1, &t_instance_vbo);
+    
+    glBindVertexArray(t_vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t_ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, t_patch_index_count * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+    GLuint *indices = (GLuint *)glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, t_patch_index_count * sizeof(GLuint),
+                                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!indices) {
+        throw runtime_error("Error: Could not map the terrain index buffer");
+    }
+    
+    JobSystem &jobs = JobSystem::instance();
+    jobs.wait(jobs.parallelFor(0, PATCH_SIZE, 0, [indices, rowLength](int begin, int end) {
+        for (int z = begin; z < end; z++) {
+            GLuint *row = indices + z * rowLength;
+            for (int x = 0; x <= PATCH_SIZE; x++) {
+                *row++ = z * (PATCH_SIZE + 1) + x;
+                *row++ = (z + 1) * (PATCH_SIZE + 1) + x;
             }
-            
-            glNormal3f(normal.x, normal.y, normal.z);
-            glTexCoord2f(uv.x*100, uv.y*100);
-            glVertex3f(point.x, height, point.z);
+            *row = PATCH_RESTART;
         }
-    }
-    glEnd();
-    glEndList();
+    }));
+    glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, t_instance_vbo);
+    glEnableVertexAttribArray(0);
+    glVertexAttribIPointer(0, 2, GL_INT, 2 * sizeof(GLint), (void *)0);
+    glVertexAttribDivisor(0, 1);
     
-    cout << "Finished: creating display list" << endl;
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void Terrain::createDisplayListWire() {
-    cout << "Started: creating wire display list" << endl;
-    if (t_displaylist) glDeleteLists(t_displaylist_wire, 1);
-    t_displaylist_wire = glGenLists(1);
+// Uploads t_data's heights, normals and ambient occlusion into the back
+// texture set and flips it to the front. The old front set is kept for
+// the blend.
+void Terrain::createBuffers() {
+    // the height range covers the terrain blended from too
+    max_height = t_data.max_height;
+    min_Height = t_data.min_height;
+    if (t_previous) {
+        max_height = max(max_height, t_previous->max_height);
+        min_Height = min(min_Height, t_previous->min_height);
+    }
     
-    glNewList(t_displaylist_wire, GL_COMPILE);
+    int back = 1 - t_front;
+    if (!t_height_tex[back]) {
+        glGenTextures(1, &t_height_tex[back]);
+        glGenTextures(1, &t_normal_tex[back]);
+        glGenTextures(1, &t_ambient_tex[back]);
+    }
     
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glBegin(GL_TRIANGLES);
-    for (int i = 0; i < t_triangles.size(); i ++) {
-        triangle t = t_triangles[i];
-        for (int j = 0; j < 3; j++) {
-            vertex v = t.v[j];
-            vec3 point = t_points[v.p];
-            vec3 normal = t_normals[v.n];
-            float height = heightModifier(point.y);
-            
-            glColor3f(0.0, 1.0, 0.0);
-            glNormal3f(normal.x, normal.y, normal.z);
-            glVertex3f(point.x, height, point.z);
+    // Read with texelFetch, but still needs a complete, non-mipmapped texture
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, t_height_tex[back]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, terrain_width, terrain_length, 0, GL_RED, GL_FLOAT, t_data.heights.data());
+    
+    glBindTexture(GL_TEXTURE_2D, t_normal_tex[back]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16_SNORM, terrain_width, terrain_length, 0, GL_RG, GL_SHORT, t_data.encoded_normals.data());
+    
+    // rows of bytes aren't 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, t_ambient_tex[back]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, terrain_width, terrain_length, 0, GL_RED, GL_UNSIGNED_BYTE, t_data.ambient.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    vector<GLshort>().swap(t_data.encoded_normals);
+    
+    t_front = back;
+}
+
+// Bound each patch by the pyramid node over it, over both terrains while
+// blending, so no vertex is visited on the render thread
+void Terrain::updatePatchBounds() {
+    for (terrain_patch &patch : t_patches) {
+        float lo, hi;
+        t_data.pyramid.blockRange(PATCH_SIZE, patch.x, patch.z, lo, hi);
+        if (t_previous) {
+            float previousLo, previousHi;
+            t_previous->pyramid.blockRange(PATCH_SIZE, patch.x, patch.z, previousLo, previousHi);
+            lo = min(lo, previousLo);
+            hi = max(hi, previousHi);
+        }
+        int x1 = min(patch.x + PATCH_SIZE, terrain_width - 1);
+        int z1 = min(patch.z + PATCH_SIZE, terrain_length - 1);
+        patch.bounds = AABB(vec3((patch.x + x_off) * t_spacing, lo + y_off, (patch.z + z_off) * t_spacing),
+                            vec3((x1 + x_off) * t_spacing, hi + y_off, (z1 + z_off) * t_spacing));
+    }
+}
+
+// While blending the occluder has to stay below both terrains
+void Terrain::updateOccluder() {
+    t_occluder_points = t_data.occluder_points;
+    if (t_previous) {
+        for (size_t i = 0; i < t_occluder_points.size(); i++) {
+            t_occluder_points[i].y = min(t_occluder_points[i].y, t_previous->occluder_points[i].y);
         }
     }
-    glEnd();
-    glEndList();
+}
+
+// Builds a coarse grid whose vertices take the lowest height within one
+// coarse cell of them, so every coarse triangle lies on or below the real
+// surface. Anything it hides from a camera above the terrain is hidden
+// by the terrain as well.
+void Terrain::createOccluder(terrain_data &data) {
+    int step = max(1, (terrain_width - 1) / OCCLUDER_CELLS);
+    int cellsX = (terrain_width - 2) / step + 1;
+    int cellsZ = (terrain_length - 2) / step + 1;
     
-    cout << "Finished: creating wire display list" << endl;
+    data.occluder_points.clear();
+    for (int cz = 0; cz <= cellsZ; cz++) {
+        int z = min(cz * step, terrain_length - 1);
+        for (int cx = 0; cx <= cellsX; cx++) {
+            int x = min(cx * step, terrain_width - 1);
+            
+            float lowest = numeric_limits<float>::max();
+            for (int nz = max(0, z - step); nz <= min(terrain_length - 1, z + step); nz++) {
+                for (int nx = max(0, x - step); nx <= min(terrain_width - 1, x + step); nx++) {
+                    lowest = min(lowest, getShapedHeight(data, nz, nx));
+                }
+            }
+            data.occluder_points.push_back(vec3((x + x_off) * t_spacing, lowest + y_off, (z + z_off) * t_spacing));
+        }
+    }
 }
 
+// Starts generating a new terrain in the background. The current one keeps
+// rendering until update() swaps the result in. Seeds asked for while a
+// generation is running are queued, keeping only the latest.
 void Terrain::reseedTerrain(int seed) {
-    simplex_noise.setSeed(seed);
-    setupTerrain();
+    if (t_generation) {
+        t_queued_seed = seed;
+        t_seed_queued = true;
+        return;
+    }
+    cout << "Started: reseeding terrain" << endl;
+    startGeneration(seed);
+}
+
+// Called once a frame on the render thread. Swaps in a finished
+// generation and advances the height blend, returning true whenever what
+// the terrain draws has changed.
+bool Terrain::update() {
+    bool changed = false;
+    if (t_generation && t_generation->isFinished()) {
+        swapGeneration();
+        changed = true;
+        
+        if (t_seed_queued) {
+            t_seed_queued = false;
+            reseedTerrain(t_queued_seed);
+        }
+    }
+    
+    if (t_previous) {
+        t_blend_amount = min(1.0, (glfwGetTime() - t_blend_start) / BLEND_SECONDS);
+        if (t_blend_amount >= 1) {
+            t_previous.reset();
+            updatePatchBounds();
+            updateOccluder();
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+// Submits the seed dependent stages into t_next without waiting
+JobHandle Terrain::startGeneration(int seed) {
+    JobSystem &jobs = JobSystem::instance();
+    t_next.reset(new terrain_data());
+    terrain_data &data = *t_next;
+    data.seed = seed;
+    
+    JobHandle occluder = timedJob(data.occluder_ms, [this, &data] { createOccluder(data); });
+    JobHandle pyramid = timedJob(data.pyramid_ms, [this, &data] {
+        data.pyramid.build(data.heights, terrain_width, terrain_length);
+    });
+    // baked from the shaped heights, so it matches what is drawn
+    JobHandle ambient = timedJob(data.ambient_ms, [this, &data] {
+        data.ambient = AmbientOcclusion::bake(data.heights, terrain_width, terrain_length, t_spacing);
+    });
+    t_generation = jobs.create([] {});
+    jobs.depend(t_generation, occluder);
+    jobs.depend(t_generation, pyramid);
+    jobs.depend(t_generation, ambient);
+    
+    // A saved terrain replaces the noise, shaping and normal stages
+    vector<JobHandle> stages;
+    if (t_file.isOpen() && seed == t_file.getHeader().seed) {
+        JobHandle load = timedJob(data.load_ms, [this, &data] { loadTerrainFile(data); });
+        jobs.depend(occluder, load);
+        jobs.depend(pyramid, load);
+        jobs.depend(ambient, load);
+        stages = { load };
+    } else {
+        JobHandle heights = timedJob(data.heights_ms, [this, &data] { generateHeights(data); });
+        JobHandle erosion = timedJob(data.erosion_ms, [this, &data] { erodeHeights(data); });
+        JobHandle thermal = timedJob(data.thermal_ms, [this, &data] { relaxHeights(data); });
+        JobHandle rivers = timedJob(data.rivers_ms, [this, &data] { carveRivers(data); });
+        JobHandle shape = timedJob(data.shape_ms, [this, &data] { shapeHeights(data); });
+        JobHandle normals = timedJob(data.normals_ms, [this, &data] { generateNormals(data); });
+        jobs.depend(erosion, heights);
+        jobs.depend(thermal, erosion);
+        jobs.depend(rivers, thermal);
+        jobs.depend(shape, rivers);
+        jobs.depend(normals, rivers);
+        jobs.depend(occluder, shape);
+        jobs.depend(pyramid, shape);
+        jobs.depend(ambient, shape);
+        jobs.depend(t_generation, normals);
+        stages = { heights, erosion, thermal, rivers, shape, normals };
+    }
+    
+    stages.insert(stages.end(), { occluder, pyramid, ambient, t_generation });
+    for (const JobHandle &stage : stages) {
+        jobs.submit(stage);
+    }
+    return t_generation;
+}
+
+// Makes t_next the drawn terrain, blending from the old one if enabled
+void Terrain::swapGeneration() {
+    JobHandle generation = t_generation;
+    t_generation = nullptr;
+    JobSystem::instance().wait(generation);
+    
+    auto start = chrono::steady_clock::now();
+    if (t_blend && !t_data.points.empty()) {
+        t_previous.reset(new terrain_data(move(t_data)));
+        t_blend_start = glfwGetTime();
+        t_blend_amount = 0;
+    } else {
+        t_previous.reset();
+        t_blend_amount = 1;
+    }
+    t_data = move(*t_next);
+    t_next.reset();
+    t_seed = t_data.seed;
+    
+    createBuffers();
+    updatePatchBounds();
+    updateOccluder();
+    double uploadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    cout << "Finished: terrain for seed " << t_seed << " (load " << t_data.load_ms << "ms, heights " << t_data.heights_ms << "ms, erosion " << t_data.erosion_ms << "ms, thermal " << t_data.thermal_ms << "ms, rivers " << t_data.rivers_ms << "ms, shape " << t_data.shape_ms << "ms, normals "
+        << t_data.normals_ms << "ms, occluder " << t_data.occluder_ms << "ms, pyramid " << t_data.pyramid_ms << "ms, ambient " << t_data.ambient_ms << "ms, upload " << uploadMs << "ms)" << endl;
 }
 
 void Terrain::toggleWireMode() {
@@ -271,30 +759,148 @@ void Terrain::toggleWireMode() {
     cout << "Wire mode state: " << t_display_wire << endl;
 }
 
+void Terrain::toggleHeightBlend() {
+    t_blend = !t_blend;
+    cout << "Reseed height blend: " << t_blend << endl;
+}
+
+// Runs the CPU stages of the pipeline as jobs, overlapping the grid
+// patch list and texture decode with the noise, then uploads the results on
+// this thread, which owns the GL context
 void Terrain::setupTerrain() {
-    readTex(t_texture_filename);
-    generateHeights();
-    generateUvs();
-    generateTriangles();
-    generateNormals();
-    createDisplayList();
-    createDisplayListWire();
+    cout << "Started: generating terrain" << endl;
+    JobSystem &jobs = JobSystem::instance();
+    auto start = chrono::steady_clock::now();
+    
+    double textureMs = 0, patchesMs = 0;
+    unique_ptr<Image> image;
+    JobHandle texture = timedJob(textureMs, [&] { image.reset(new Image(t_texture_filename)); });
+    JobHandle patches = timedJob(patchesMs, [this] { generatePatches(); });
+    for (const JobHandle &stage : { texture, patches }) {
+        jobs.submit(stage);
+    }
+    JobHandle generation = startGeneration(t_seed);
+    
+    for (const JobHandle &stage : { texture, patches, generation }) {
+        jobs.wait(stage);
+    }
+    double generateMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    readTex(*image);
+    createPatchMesh();
+    swapGeneration();
+    
+    cout << "  texture: " << textureMs << "ms" << endl;
+    cout << "  patches: " << patchesMs << "ms" << endl;
+    cout << "  generation (wall): " << generateMs << "ms on " << jobs.getThreadCount() << " threads" << endl;
+    cout << "Finished: generating terrain" << endl;
 }
 
-void Terrain::renderTerrain(GLuint shader) {
-    GLuint displayList = t_display_wire ? t_displaylist_wire : t_displaylist;
+void Terrain::renderTerrain(const ShaderProgram &shader, const Frustum &frustum, const OcclusionCuller *occlusion, CullStats &stats) {
+    // Gather the visible patches into one instanced draw of the patch mesh
+    vector<GLint> origins;
+    origins.reserve(t_patches.size() * 2);
+    for (const terrain_patch &patch : t_patches) {
+        if (!frustum.intersects(patch.bounds)) {
+            stats.culled++;
+        } else if (occlusion && occlusion->isOccluded(patch.bounds)) {
+            stats.occluded++;
+        } else {
+            origins.push_back(patch.x);
+            origins.push_back(patch.z);
+            stats.visible++;
+        }
+    }
+    if (origins.empty()) return;
+    
+    glBindBuffer(GL_ARRAY_BUFFER, t_instance_vbo);
+    glBufferData(GL_ARRAY_BUFFER, origins.size() * sizeof(GLint), origins.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
     
-    glEnable(GL_COLOR_MATERIAL);
-    glUseProgram(shader);
-    glUniform1f(glGetUniformLocation(shader, "maxHeight"), max_height);
-    glUniform1f(glGetUniformLocation(shader, "minHeight"), min_Height);
-    glShadeModel(GL_SMOOTH);
+    // Blend from the back pair while it still holds the previous terrain
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, t_height_tex[t_front]);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, t_height_tex[t_previous ? 1 - t_front : t_front]);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, t_normal_tex[t_front]);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, t_ambient_tex[t_front]);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D, t_ambient_tex[t_previous ? 1 - t_front : t_front]);
+    glActiveTexture(GL_TEXTURE0);
     
-    glPushMatrix();
-    glTranslatef(x_off, y_off, z_off);
-    glCallList(displayList);
-    glPopMatrix();
+    shader.use();
+    glUniform1i(shader.uniform("heightMap"), 0);
+    glUniform1i(shader.uniform("previousHeightMap"), 1);
+    glUniform1i(shader.uniform("normalMap"), 2);
+    glUniform1i(shader.uniform("ambientMap"), 3);
+    glUniform1i(shader.uniform("previousAmbientMap"), 4);
+    glUniform1f(shader.uniform("maxHeight"), max_height);
+    glUniform1f(shader.uniform("minHeight"), min_Height);
+    glUniform1f(shader.uniform("heightBlend"), t_blend_amount);
+    glUniform1i(shader.uniform("patchSize"), PATCH_SIZE);
+    glUniform2i(shader.uniform("gridSize"), terrain_width, terrain_length);
+    glUniform1f(shader.uniform("gridSpacing"), t_spacing);
+    glUniform3f(shader.uniform("gridOrigin"), x_off * t_spacing, y_off, z_off * t_spacing);
+    
+    // Wire mode draws the same mesh with line polygons
+    glPolygonMode(GL_FRONT_AND_BACK, t_display_wire ? GL_LINE : GL_FILL);
+    glEnable(GL_PRIMITIVE_RESTART);
+    glPrimitiveRestartIndex(PATCH_RESTART);
+    glBindVertexArray(t_vao);
+    glDrawElementsInstanced(GL_TRIANGLE_STRIP, t_patch_index_count, GL_UNSIGNED_INT, 0, origins.size() / 2);
+    glBindVertexArray(0);
+    glDisable(GL_PRIMITIVE_RESTART);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     
     glUseProgram(0);
-    glDisable(GL_COLOR_MATERIAL);
+}
+
+const vector<vec3> & Terrain::getOccluderPoints() const {
+    return t_occluder_points;
+}
+
+const vector<GLuint> & Terrain::getOccluderIndices() const {
+    return t_occluder_indices;
+}
+
+// World bounds of the grid, over both terrains while blending
+AABB Terrain::getBounds() const {
+    if (t_data.points.empty()) return AABB();
+    vec3 low(x_off * t_spacing, min_Height + y_off, z_off * t_spacing);
+    vec3 high((x_off + terrain_width - 1) * t_spacing, max_height + y_off, (z_off + terrain_length - 1) * t_spacing);
+    return AABB(low, high);
+}
+
+// Whether a point is above the surface, or outside the grid entirely
+bool Terrain::isAbove(const vec3 &p) const {
+    int x = int(floor(p.x / t_spacing - x_off));
+    int z = int(floor(p.z / t_spacing - z_off));
+    if (x < 0 || z < 0 || x >= terrain_width - 1 || z >= terrain_length - 1) return true;
+    
+    float highest = 0;
+    for (int i = 0; i < 4; i++) {
+        highest = max(highest, getShapedHeight(t_data, z + i / 2, x + i % 2));
+        if (t_previous) highest = max(highest, getShapedHeight(*t_previous, z + i / 2, x + i % 2));
+    }
+    return p.y > highest + y_off;
+}
+
+float Terrain::sampleHeight(float x, float z) const {
+    if (t_data.heights.empty()) return y_off;
+    return t_data.pyramid.sample(t_data.heights, x / t_spacing - x_off, z / t_spacing - z_off) + y_off;
+}
+
+// The ray is taken into grid space, where cells are one unit square,
+// which scales dir but keeps t the same
+bool Terrain::raycast(const vec3 &origin, const vec3 &dir, vec3 &hit) const {
+    if (t_data.heights.empty()) return false;
+    
+    vec3 gridOrigin(origin.x / t_spacing - x_off, origin.y - y_off, origin.z / t_spacing - z_off);
+    vec3 gridDir(dir.x / t_spacing, dir.y, dir.z / t_spacing);
+    float t;
+    if (!t_data.pyramid.raycast(t_data.heights, gridOrigin, gridDir, numeric_limits<float>::max(), t)) return false;
+    hit = origin + dir * t;
+    return true;
 }
@@ -2,27 +2,75 @@
 
 #include <cmath>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "ambient_occlusion.hpp"
 #include "cgra_math.hpp"
+#include "frustum.hpp"
+#include "height_pyramid.hpp"
+#include "hydraulic_erosion.hpp"
+#include "job_system.hpp"
+#include "occlusion_culler.hpp"
 #include "opengl.hpp"
+#include "river_network.hpp"
+#include "shader_program.hpp"
 #include "simplex_noise.hpp"
+#include "terrain_config.hpp"
+#include "terrain_file.hpp"
+#include "thermal_erosion.hpp"
 
-struct vertex {
-    int p = 0; // index for point in m_points
-    int t = 0; // index for uv in m_uvs
-    int n = 0; // index for normal in m_normals
+class Image;
+
+// A square block of the grid, culled as a unit
+struct terrain_patch {
+    AABB bounds;        // world space bounds, min/max height of the patch
+    int x = 0;          // grid position of the patch's first vertex
+    int z = 0;
 };
 
-struct triangle {
-    vertex v[3]; //requires 3 verticies
+// Everything that changes with the seed. Built by jobs off the render
+// thread, then swapped in whole.
+struct terrain_data {
+    int seed = 0;
+    std::vector<cgra::vec3> points;             // Point list, normalised height in y
+    bool imported = false;                      // points came from a heightmap, not noise
+    std::vector<float> heights;                 // World heights, after heightModifier
+    std::vector<cgra::vec3> normals;            // Normal list
+    std::vector<GLshort> encoded_normals;       // Octahedral normals for the RG16 snorm texture, freed once uploaded
+    std::vector<uint8_t> ambient;               // How open to the sky each vertex is, baked from the horizons
+    std::vector<cgra::vec3> occluder_points;    // Coarse mesh on or below the surface
+    float min_height = 0;                       // Range of heights
+    float max_height = 0;
+    HeightPyramid pyramid;                      // Min/max of heights, for height queries
+    
+    double load_ms = 0;                         // Stage timings
+    double heights_ms = 0;
+    double erosion_ms = 0;
+    double thermal_ms = 0;
+    double rivers_ms = 0;
+    double shape_ms = 0;
+    double normals_ms = 0;
+    double ambient_ms = 0;
+    double occluder_ms = 0;
+    double pyramid_ms = 0;
 };
 
 class Terrain {
     
 private:
     // Fields
+    static const int PATCH_SIZE = 16; // quads along each side of a patch
+    static const int OCCLUDER_CELLS = 32; // target quads along each side of the occluder mesh
+    static constexpr double BLEND_SECONDS = 1.0; // length of the height blend after a reseed
+    static const GLuint PATCH_RESTART = 0xFFFFFFFF; // primitive restart index between strips
+    static const int CURVE_LUT_SIZE = 4096;     // intervals in the heightModifier lookup table
+    
+    TerrainConfig t_config;
+    TerrainFile t_file;             // saved terrain for the starting seed, if one was given
+    HydraulicErosion t_erosion;
+    
     int terrain_width = 100;
     int terrain_length = 100;
     
@@ -30,7 +78,10 @@ private:
     int z_off;
     int y_off;
     
+    float t_spacing = 1;            // world units between grid vertices
     float height_multiplier = 12;
+    float t_water_level = 0;        // world height of the sea the rivers drain to
+    std::vector<float> t_curve_lut; // heightModifier sampled over 0-1, when enabled
     
     float max_height;
     float min_Height;
@@ -40,33 +91,86 @@ private:
     std::string t_texture_filename;     // String for storing texture filename
     GLuint t_texture;                   // ID of created texture
     
-    std::vector<cgra::vec3> t_points;	// Point list
-    std::vector<cgra::vec2> t_uvs;		// Texture Coordinate list
-    std::vector<cgra::vec3> t_normals;	// Normal list
-    std::vector<triangle> t_triangles;	// Triangle/Face list
+    int t_seed;
+    terrain_data t_data;                        // The terrain being drawn
+    std::unique_ptr<terrain_data> t_previous;   // The terrain blended away from, while blending
+    std::unique_ptr<terrain_data> t_next;       // The terrain being generated
+    JobHandle t_generation;                     // Finishes when t_next is ready
+    bool t_seed_queued = false;                 // A reseed asked for during a generation
+    int t_queued_seed = 0;
+    
+    bool t_blend = true;
+    double t_blend_start = 0;
+    float t_blend_amount = 1;                   // 0 draws t_previous, 1 draws t_data
     
-    GLuint t_displaylist;       // ID for Polygon Displaylist
-    GLuint t_displaylist_wire; // ID for Wire Dispalylist
+    // Grid layout, the same for every seed
+    std::vector<terrain_patch> t_patches; // Patches the grid is split into
+    
+    // One flat patch mesh, instanced once per visible patch
+    GLuint t_vao = 0;
+    GLuint t_ibo = 0;                   // Row strips, joined by PATCH_RESTART
+    GLuint t_instance_vbo = 0;          // Grid position of each visible patch
+    GLsizei t_patch_index_count = 0;
+    
+    // Height, normal and ambient textures are double buffered, a reseed
+    // fills the set not being drawn and then flips, keeping the old set to
+    // blend from
+    GLuint t_height_tex[2] = { 0, 0 };  // R32F world heights
+    GLuint t_normal_tex[2] = { 0, 0 };  // RG16 snorm octahedral normals
+    GLuint t_ambient_tex[2] = { 0, 0 }; // R8 ambient occlusion
+    int t_front = 0;
+    
+    // Coarse mesh lying on or below the terrain, for occlusion culling
+    std::vector<cgra::vec3> t_occluder_points;
+    std::vector<GLuint> t_occluder_indices;
     
     
     // Methods
-    void readTex(std::string);
-    void generateHeights();
-    void generateNormals();
-    void generateUvs();
-    void generateTriangles();
-    void createDisplayList();
-    void createDisplayListWire();
-    float getHeight(int, int);
-    float heightModifier(float);
+    void readTex(const Image &);
+    void generateHeights(terrain_data &);
+    void loadTerrainFile(terrain_data &);
+    void erodeHeights(terrain_data &);
+    void relaxHeights(terrain_data &);
+    void carveRivers(terrain_data &);
+    void shapeHeights(terrain_data &);
+    void generateNormals(terrain_data &);
+    void generatePatches();
+    void createPatchMesh();
+    void createBuffers();
+    void createOccluder(terrain_data &);
+    void updatePatchBounds();
+    void updateOccluder();
+    JobHandle startGeneration(int seed);
+    void swapGeneration();
+    float getHeight(const terrain_data &, int, int) const;
+    float getShapedHeight(const terrain_data &, int, int) const;
+    float heightModifier(float) const;
+    cgra::vec3 worldPosition(const terrain_data &, int, int) const;
     
 public:
     Terrain(std::string, int seed);
     ~Terrain();
     
+    void configure(const TerrainConfig &);
+    void setWaterLevel(float);
+    const TerrainConfig & getConfig() const;
+    int getSeed() const;
+    void printMemoryEstimate() const;
+    void saveTerrain(const std::string &filename) const;
     void reseedTerrain(int);
     void setupTerrain();
-    void renderTerrain(GLuint);
+    bool update();
+    void renderTerrain(const ShaderProgram &, const Frustum &, const OcclusionCuller *, CullStats &);
+    
+    const std::vector<cgra::vec3> & getOccluderPoints() const;
+    const std::vector<GLuint> & getOccluderIndices() const;
+    bool isAbove(const cgra::vec3 &) const;
+    AABB getBounds() const;
+    
+    // Queries against the terrain being blended to, in world space
+    float sampleHeight(float x, float z) const;
+    bool raycast(const cgra::vec3 &origin, const cgra::vec3 &dir, cgra::vec3 &hit) const;
     void toggleWireMode();
+    void toggleHeightBlend();
     
 };
@@ -0,0 +1,134 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "terrain_config.hpp"
+
+using namespace std;
+
+static string trim(const string &s) {
+    size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+template <typename T>
+static T parseValue(const string &key, const string &value) {
+    istringstream stream(value);
+    T result;
+    if (!(stream >> result) || !(stream >> ws).eof()) {
+        throw runtime_error("Error: Invalid value '" + value + "' for terrain setting " + key);
+    }
+    return result;
+}
+
+float TerrainConfig::spacing() const {
+    return extent / width;
+}
+
+void TerrainConfig::set(const string &key, const string &value) {
+    if (key == "width") width = parseValue<int>(key, value);
+    else if (key == "length") length = parseValue<int>(key, value);
+    else if (key == "size") width = length = parseValue<int>(key, value);
+    else if (key == "extent") extent = parseValue<float>(key, value);
+    else if (key == "height-scale") heightScale = parseValue<float>(key, value);
+    else if (key == "noise-scale") noiseScale = parseValue<float>(key, value);
+    else if (key == "octaves") octaves = parseValue<int>(key, value);
+    else if (key == "persistence") persistence = parseValue<float>(key, value);
+    else if (key == "lacunarity") lacunarity = parseValue<float>(key, value);
+    else if (key == "falloff") falloff = parseValue<int>(key, value) != 0;
+    else if (key == "erosion-droplets") erosionDroplets = parseValue<int>(key, value);
+    else if (key == "thermal-iterations") thermalIterations = parseValue<int>(key, value);
+    else if (key == "thermal-talus") thermalTalus = parseValue<float>(key, value);
+    else if (key == "thermal-threshold") thermalThreshold = parseValue<float>(key, value);
+    else if (key == "river-area") riverArea = parseValue<float>(key, value);
+    else if (key == "river-depth") riverDepth = parseValue<float>(key, value);
+    else if (key == "ocean-resolution") oceanResolution = parseValue<int>(key, value);
+    else if (key == "ocean-size") oceanSize = parseValue<float>(key, value);
+    else if (key == "ocean-wind") oceanWind = parseValue<float>(key, value);
+    else if (key == "ocean-choppiness") oceanChoppiness = parseValue<float>(key, value);
+    else if (key == "ocean-height") oceanHeight = parseValue<float>(key, value);
+    else if (key == "water-cells") waterCells = parseValue<int>(key, value);
+    else if (key == "water-rate") waterRate = parseValue<float>(key, value);
+    else if (key == "flood-height") floodHeight = parseValue<float>(key, value);
+    else if (key == "height-lut") heightLut = parseValue<int>(key, value) != 0;
+    else if (key == "seed") seed = parseValue<int>(key, value);
+    else if (key == "terrain-file") terrainFile = value;
+    else if (key == "heightmap") heightmap = value;
+    else if (key == "heightmap-width") heightmapWidth = parseValue<int>(key, value);
+    else if (key == "heightmap-length") heightmapLength = parseValue<int>(key, value);
+    else if (key == "heightmap-signed") heightmapSigned = parseValue<int>(key, value) != 0;
+    else throw runtime_error("Error: Unknown terrain setting " + key);
+
+    if (width < 2 || length < 2) throw runtime_error("Error: Terrain must be at least 2 x 2 vertices");
+    if (extent <= 0 || noiseScale <= 0) throw runtime_error("Error: Terrain scales must be positive");
+    if (octaves < 1) throw runtime_error("Error: Terrain needs at least one octave");
+    if (erosionDroplets < 0 || thermalIterations < 0) throw runtime_error("Error: Erosion counts can't be negative");
+    if (thermalTalus <= 0 || thermalTalus >= 90) throw runtime_error("Error: Talus angle must be between 0 and 90 degrees");
+    if (riverArea < 0 || riverDepth < 0) throw runtime_error("Error: River area and depth can't be negative");
+    if (oceanResolution < 16 || (oceanResolution & (oceanResolution - 1)) != 0) {
+        throw runtime_error("Error: Ocean resolution must be a power of two, at least 16");
+    }
+    if (oceanSize <= 0 || oceanWind <= 0) throw runtime_error("Error: Ocean size and wind must be positive");
+    if (oceanChoppiness < 0 || oceanHeight < 0) throw runtime_error("Error: Ocean choppiness and height can't be negative");
+    if (waterCells < 0 || waterCells == 1) throw runtime_error("Error: Water needs at least 2 cells a side, or 0 for none");
+    if (waterRate <= 0) throw runtime_error("Error: Water rate must be positive");
+}
+
+// Lines are "key = value", blank lines and lines starting with # are
+// skipped. A missing file leaves the defaults alone.
+void TerrainConfig::loadFile(const string &filename) {
+    ifstream file(filename);
+    if (!file) return;
+
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line)) {
+        lineNumber++;
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue;
+
+        size_t equals = line.find('=');
+        if (equals == string::npos) {
+            throw runtime_error("Error: Expected key = value on line " + to_string(lineNumber) + " of " + filename);
+        }
+        set(trim(line.substr(0, equals)), trim(line.substr(equals + 1)));
+    }
+    cout << "Loaded terrain config " << filename << endl;
+}
+
+// Arguments are "--key=value". "--config=file" loads a file at that
+// point, so later arguments override it.
+void TerrainConfig::parseArguments(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t equals = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || equals == string::npos) continue;
+
+        string key = arg.substr(2, equals - 2);
+        string value = arg.substr(equals + 1);
+        if (key == "config") loadFile(value);
+        else set(key, value);
+    }
+}
+
+void TerrainConfig::print() const {
+    cout << "Terrain: " << width << " x " << length << " vertices over " << extent << " x "
+        << extent * length / width << " units, height " << heightScale << endl;
+    cout << "Noise: scale " << noiseScale << ", " << octaves << " octaves, persistence " << persistence
+        << ", lacunarity " << lacunarity << ", falloff " << falloff << ", seed " << seed << endl;
+    if (!terrainFile.empty()) cout << "Loaded from " << terrainFile << endl;
+    else if (!heightmap.empty()) cout << "Heights imported from " << heightmap << endl;
+    if (erosionDroplets > 0) cout << "Erosion: " << erosionDroplets << " droplets" << endl;
+    if (thermalIterations > 0) cout << "Thermal erosion: up to " << thermalIterations << " iterations, talus "
+        << thermalTalus << " degrees" << endl;
+    if (riverArea > 0) cout << "Rivers: draining " << riverArea << " square units, " << riverDepth << " deep" << endl;
+    cout << "Ocean: " << oceanResolution << " x " << oceanResolution << " spectrum over " << oceanSize
+        << " units, wind " << oceanWind << endl;
+    if (waterCells > 0) cout << "Shallow water: up to " << waterCells << " cells a side, " << waterRate
+        << " steps per second" << endl;
+    if (heightLut) cout << "Heights shaped with a lookup table" << endl;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+
+// Size, scale and noise settings for the terrain. Read from a config file
+// of "key = value" lines, then overridden by "--key=value" arguments.
+struct TerrainConfig {
+    int width = 100;                // grid vertices along x
+    int length = 100;               // grid vertices along z
+    float extent = 100;             // world units across the width, cells are square
+    float heightScale = 12;         // world height of a fully raised vertex
+
+    float noiseScale = 40;          // world units per unit of noise at the first octave
+    int octaves = 4;
+    float persistence = 0.4f;       // amplitude multiplier per octave
+    float lacunarity = 2;           // frequency multiplier per octave
+    bool falloff = true;            // sink the edges into an island
+    bool heightLut = false;         // shape heights with a lookup table rather than exp
+    int erosionDroplets = 0;        // hydraulic erosion droplets, 0 for none
+    int thermalIterations = 0;      // thermal erosion passes, 0 for none
+    float thermalTalus = 35;        // degrees, steeper slopes slide
+    float thermalThreshold = 1e-4f; // stop early once no vertex moves more than this, in world height
+    float riverArea = 0;            // world area draining through a vertex to make it a river, 0 for none
+    float riverDepth = 0.03f;       // deepest a channel is cut, in normalised height
+
+    int oceanResolution = 128;      // FFT ocean spectrum texels along each side, a power of two
+    float oceanSize = 50;           // world units one tile of the ocean covers
+    float oceanWind = 6;            // wind speed the waves are raised by, in units per second
+    float oceanChoppiness = 1;      // scale of the horizontal displacement that sharpens crests
+    float oceanHeight = 0.06f;      // RMS wave height, in world units
+    int waterCells = 256;           // most shallow water cells along a side, 0 for a flat sea
+    float waterRate = 60;           // shallow water steps per second
+    float floodHeight = 1;          // world units the sea rises by when flooding
+
+    int seed = 1497779637;
+    std::string terrainFile;        // saved terrain to start from, overriding the settings above
+
+    std::string heightmap;          // PNG or raw DEM to use instead of noise for the starting seed
+    int heightmapWidth = 0;         // samples in a raw DEM, which has no header
+    int heightmapLength = 0;
+    bool heightmapSigned = false;   // raw DEM samples are int16 rather than uint16
+
+    float spacing() const;
+
+    void set(const std::string &key, const std::string &value);
+    void loadFile(const std::string &filename);
+    void parseArguments(int argc, char **argv);
+
+    void print() const;
+};
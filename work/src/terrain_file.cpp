@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "terrain_file.hpp"
+
+using namespace std;
+using namespace cgra;
+
+static_assert(sizeof(vec3) == 3 * sizeof(float), "normals are stored as packed float triples");
+static_assert(sizeof(TerrainFileHeader) % 16 == 0, "arrays after the header must stay aligned");
+
+static uint64_t align16(uint64_t offset) {
+    return (offset + 15) & ~uint64_t(15);
+}
+
+TerrainFile::~TerrainFile() {
+    close();
+}
+
+#ifdef _WIN32
+void TerrainFile::map(const string &filename) {
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) throw runtime_error("Error: Could not open terrain file " + filename);
+    m_file = file;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) throw runtime_error("Error: Empty terrain file " + filename);
+    m_size = size_t(size.QuadPart);
+
+    m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping) throw runtime_error("Error: Could not map terrain file " + filename);
+    m_data = (const unsigned char *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data) throw runtime_error("Error: Could not map terrain file " + filename);
+}
+
+void TerrainFile::close() {
+    if (m_data) UnmapViewOfFile(m_data);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file) CloseHandle(m_file);
+    m_data = nullptr;
+    m_mapping = nullptr;
+    m_file = nullptr;
+    m_size = 0;
+}
+#else
+void TerrainFile::map(const string &filename) {
+    m_file = ::open(filename.c_str(), O_RDONLY);
+    if (m_file < 0) throw runtime_error("Error: Could not open terrain file " + filename);
+
+    struct stat info;
+    if (fstat(m_file, &info) != 0 || info.st_size == 0) throw runtime_error("Error: Empty terrain file " + filename);
+    m_size = size_t(info.st_size);
+
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+    if (data == MAP_FAILED) throw runtime_error("Error: Could not map terrain file " + filename);
+    m_data = (const unsigned char *)data;
+}
+
+void TerrainFile::close() {
+    if (m_data) munmap((void *)m_data, m_size);
+    if (m_file >= 0) ::close(m_file);
+    m_data = nullptr;
+    m_file = -1;
+    m_size = 0;
+}
+#endif
+
+void TerrainFile::open(const string &filename) {
+    close();
+    m_filename = filename;
+    try {
+        map(filename);
+
+        if (m_size < sizeof(TerrainFileHeader)) throw runtime_error("Error: Truncated terrain file " + filename);
+        const TerrainFileHeader &header = getHeader();
+        if (memcmp(header.magic, "TERR", 4) != 0) throw runtime_error("Error: Not a terrain file " + filename);
+        if (header.byteOrder != BYTE_ORDER_MARK) throw runtime_error("Error: Terrain file " + filename + " has the wrong byte order");
+        if (header.version != VERSION || header.headerSize != sizeof(TerrainFileHeader)) {
+            throw runtime_error("Error: Terrain file " + filename + " is version " + to_string(header.version)
+                + ", expected " + to_string(VERSION));
+        }
+        if (header.width < 2 || header.length < 2) throw runtime_error("Error: Bad grid size in terrain file " + filename);
+
+        uint64_t count = uint64_t(header.width) * header.length;
+        bool fits = header.noiseOffset + count * sizeof(float) <= m_size
+            && header.heightsOffset + count * sizeof(float) <= m_size
+            && header.normalsOffset + count * sizeof(vec3) <= m_size;
+        bool aligned = (header.noiseOffset | header.heightsOffset | header.normalsOffset) % 16 == 0;
+        if (!fits || !aligned) throw runtime_error("Error: Truncated terrain file " + filename);
+    } catch (...) {
+        close();
+        throw;
+    }
+    cout << "Mapped terrain file " << filename << " (" << m_size / 1024 << "KB)" << endl;
+}
+
+bool TerrainFile::isOpen() const {
+    return m_data != nullptr;
+}
+
+const TerrainFileHeader & TerrainFile::getHeader() const {
+    return *(const TerrainFileHeader *)m_data;
+}
+
+const float * TerrainFile::getNoise() const {
+    return (const float *)(m_data + getHeader().noiseOffset);
+}
+
+const float * TerrainFile::getHeights() const {
+    return (const float *)(m_data + getHeader().heightsOffset);
+}
+
+const vec3 * TerrainFile::getNormals() const {
+    return (const vec3 *)(m_data + getHeader().normalsOffset);
+}
+
+TerrainConfig TerrainFile::applyTo(const TerrainConfig &config) const {
+    const TerrainFileHeader &header = getHeader();
+    TerrainConfig result = config;
+    result.width = header.width;
+    result.length = header.length;
+    result.extent = header.extent;
+    result.heightScale = header.heightScale;
+    result.noiseScale = header.noiseScale;
+    result.octaves = header.octaves;
+    result.persistence = header.persistence;
+    result.lacunarity = header.lacunarity;
+    result.falloff = header.falloff != 0;
+    result.heightLut = header.heightLut != 0;
+    result.seed = header.seed;
+    return result;
+}
+
+void TerrainFile::save(const string &filename, const TerrainConfig &config, int seed,
+                       const vector<vec3> &points, const vector<float> &heights,
+                       const vector<vec3> &normals, float minHeight, float maxHeight) {
+    uint64_t count = uint64_t(config.width) * config.length;
+    if (points.size() != count || heights.size() != count || normals.size() != count) {
+        throw runtime_error("Error: Terrain data does not match its grid size");
+    }
+
+    TerrainFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "TERR", 4);
+    header.version = VERSION;
+    header.headerSize = sizeof(TerrainFileHeader);
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.width = config.width;
+    header.length = config.length;
+    header.extent = config.extent;
+    header.heightScale = config.heightScale;
+    header.noiseScale = config.noiseScale;
+    header.octaves = config.octaves;
+    header.persistence = config.persistence;
+    header.lacunarity = config.lacunarity;
+    header.falloff = config.falloff;
+    header.heightLut = config.heightLut;
+    header.seed = seed;
+    header.minHeight = minHeight;
+    header.maxHeight = maxHeight;
+    header.noiseOffset = sizeof(TerrainFileHeader);
+    header.heightsOffset = align16(header.noiseOffset + count * sizeof(float));
+    header.normalsOffset = align16(header.heightsOffset + count * sizeof(float));
+
+    ofstream file(filename, ios::binary | ios::trunc);
+    if (!file) throw runtime_error("Error: Could not write terrain file " + filename);
+
+    // Pads the file out to offset, then writes the array there
+    auto writeAt = [&](uint64_t offset, const void *data, size_t bytes) {
+        static const char zeros[16] = {};
+        file.write(zeros, offset - uint64_t(file.tellp()));
+        file.write((const char *)data, bytes);
+    };
+    file.write((const char *)&header, sizeof(header));
+
+    vector<float> noise(count);
+    for (size_t i = 0; i < count; i++) {
+        noise[i] = points[i].y;
+    }
+    writeAt(header.noiseOffset, noise.data(), count * sizeof(float));
+    writeAt(header.heightsOffset, heights.data(), count * sizeof(float));
+    writeAt(header.normalsOffset, normals.data(), count * sizeof(vec3));
+
+    if (!file) throw runtime_error("Error: Could not write terrain file " + filename);
+    cout << "Saved terrain file " << filename << endl;
+}
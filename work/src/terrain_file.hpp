@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cgra_math.hpp"
+#include "terrain_config.hpp"
+
+// Layout of a saved terrain. The header is followed by three arrays of
+// width * length entries at the given offsets, each 16 byte aligned, so
+// the file can be used in place once mapped. Bump TerrainFile::VERSION on
+// any change to this struct or to what the arrays hold.
+struct TerrainFileHeader {
+    char magic[4];                  // "TERR"
+    uint32_t version;
+    uint32_t headerSize;            // sizeof(TerrainFileHeader) when written
+    uint32_t byteOrder;             // TerrainFile::BYTE_ORDER_MARK in the writer's byte order
+
+    // the settings the terrain was generated with
+    int32_t width;
+    int32_t length;
+    float extent;
+    float heightScale;
+    float noiseScale;
+    int32_t octaves;
+    float persistence;
+    float lacunarity;
+    int32_t falloff;
+    int32_t heightLut;
+    int32_t seed;
+
+    float minHeight;                // range of the world heights
+    float maxHeight;
+    uint32_t reserved;
+
+    uint64_t noiseOffset;           // floats, normalised noise heights
+    uint64_t heightsOffset;         // floats, world heights
+    uint64_t normalsOffset;         // float triples, unit normals
+};
+
+// A saved terrain, mapped read only. Opening checks the header and that
+// the file is long enough for its arrays.
+class TerrainFile {
+public:
+    static const uint32_t VERSION = 1;
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+private:
+    std::string m_filename;
+    const unsigned char *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#else
+    int m_file = -1;
+#endif
+
+    void map(const std::string &filename);
+
+public:
+    TerrainFile() = default;
+    ~TerrainFile();
+    TerrainFile(const TerrainFile &) = delete;
+    TerrainFile & operator=(const TerrainFile &) = delete;
+
+    void open(const std::string &filename);
+    void close();
+    bool isOpen() const;
+
+    const TerrainFileHeader & getHeader() const;
+    const float * getNoise() const;
+    const float * getHeights() const;
+    const cgra::vec3 * getNormals() const;
+
+    // config with the grid and noise settings replaced by the file's
+    TerrainConfig applyTo(const TerrainConfig &config) const;
+
+    static void save(const std::string &filename, const TerrainConfig &config, int seed,
+                     const std::vector<cgra::vec3> &points, const std::vector<float> &heights,
+                     const std::vector<cgra::vec3> &normals, float minHeight, float maxHeight);
+};
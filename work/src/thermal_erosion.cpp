@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <atomic>
+
+#include "job_system.hpp"
+#include "thermal_erosion.hpp"
+
+using namespace std;
+
+// Flow out of a cell towards a neighbour d lower, negative when the
+// neighbour is higher and flows in. This is max(d - talus, 0) -
+// max(-d - talus, 0) written with fabs, which vectorises where the
+// comparisons would not.
+static inline float excess(float d, float talus) {
+    return d + 0.5f * (fabs(d - talus) - fabs(d + talus));
+}
+
+static inline float relaxCell(const float *up, const float *row, const float *down, int x, int l, int r,
+                              float straight, float diagonal, float rate) {
+    float h = row[x];
+    float flow = excess(h - row[l], straight) + excess(h - row[r], straight)
+        + excess(h - up[x], straight) + excess(h - down[x], straight)
+        + excess(h - up[l], diagonal) + excess(h - up[r], diagonal)
+        + excess(h - down[l], diagonal) + excess(h - down[r], diagonal);
+    return h - flow * rate;
+}
+
+ThermalErosion::ThermalErosion(int iterations, float talus, float threshold)
+    : m_iterations(iterations), m_talus(talus), m_threshold(threshold) {}
+
+// Relaxes rows [begin, end) of src into dst and returns how many cells
+// moved more than the threshold. Neighbours past the edge are the cell
+// itself, so no flow.
+int ThermalErosion::relaxRows(const float *src, float *dst, int width, int length, int begin, int end) const {
+    const float straight = m_talus;
+    const float diagonal = m_talus * 1.41421356f;
+    int moving = 0;
+
+    for (int z = begin; z < end; z++) {
+        const float *up = src + max(0, z - 1) * width;
+        const float *row = src + z * width;
+        const float *down = src + min(length - 1, z + 1) * width;
+        float *out = dst + z * width;
+
+        // the interior loop has fixed neighbour offsets so it vectorises,
+        // the end columns clamp theirs
+        out[0] = relaxCell(up, row, down, 0, 0, min(1, width - 1), straight, diagonal, RATE);
+        for (int x = 1; x < width - 1; x++) {
+            out[x] = relaxCell(up, row, down, x, x - 1, x + 1, straight, diagonal, RATE);
+        }
+        if (width > 1) out[width - 1] = relaxCell(up, row, down, width - 1, width - 2, width - 1, straight, diagonal, RATE);
+        // counted rather than taking the largest change, which vectorises
+        for (int x = 0; x < width; x++) {
+            moving += fabs(out[x] - row[x]) > m_threshold;
+        }
+    }
+    return moving;
+}
+
+int ThermalErosion::erode(vector<float> &heights, int width, int length, vector<double> &iterationMs) const {
+    iterationMs.clear();
+    if (m_iterations <= 0) return 0;
+
+    vector<float> buffer(heights.size());
+    float *src = heights.data();
+    float *dst = buffer.data();
+
+    JobSystem &jobs = JobSystem::instance();
+    int iteration = 0;
+    while (iteration < m_iterations) {
+        auto start = chrono::steady_clock::now();
+
+        atomic<int> moving(0);
+        jobs.wait(jobs.parallelFor(0, length, 0, [&](int begin, int end) {
+            moving += relaxRows(src, dst, width, length, begin, end);
+        }));
+        swap(src, dst);
+        iteration++;
+
+        iterationMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        if (moving == 0) break;
+    }
+
+    // an odd count leaves the result in the scratch buffer
+    if (src != heights.data()) heights.swap(buffer);
+    return iteration;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+
+// Thermal erosion over a heightfield. Wherever the drop to a neighbour is
+// steeper than the talus slope, part of the excess slides down to it,
+// until slopes settle at the talus angle.
+//
+// Each iteration reads one buffer and writes the other, and every cell
+// only gathers from its eight neighbours, so rows split freely across
+// threads and each row is a branch free loop the compiler vectorises.
+// Flows between a pair of cells are equal and opposite, so material is
+// conserved.
+class ThermalErosion {
+private:
+    static constexpr float RATE = 1.0f / 16; // share of the excess moved per iteration, stable up to 1/16
+
+    int m_iterations = 0;
+    float m_talus = 0;              // height difference per cell the slopes settle at
+    float m_threshold = 0;          // stop once no cell moves more than this
+
+    int relaxRows(const float *src, float *dst, int width, int length, int begin, int end) const;
+
+public:
+    // talus is in heightfield units per cell
+    ThermalErosion(int iterations, float talus, float threshold);
+
+    // Returns the iterations run, and fills in how long each took
+    int erode(std::vector<float> &heights, int width, int length, std::vector<double> &iterationMs) const;
+};
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <string>
 #include <stdexcept>
@@ -13,49 +14,33 @@
 using namespace std;
 using namespace cgra;
 
+GLuint Watertile::gridVao = 0;
+GLuint Watertile::gridIndices = 0;
+int Watertile::lodOffsets[LOD_COUNT];
+int Watertile::lodCounts[LOD_COUNT];
 
 Watertile::Watertile() {
 	//set default values
 	tilePosition = vec4(0.0, 2.0, 0.0, 0.0);
-	viewpos = vec4(0.0, 10.0, 50.0, 0.0);
-	screenDimension = vec2(640, 480);
-	lightpos = vec4(0.0, 20.0, 20.0, 1.0);
-	watercolor = vec4(0.0, 0.3, 0.5, 1.0);
 	tileWidth = 10;
-	distortAmount = 0.001;
-	currentDistort = 1;
 
 	//init shader/buffers/textures
 	initialise();
 }
 
-Watertile::Watertile(vec4 pos, vec4 light, GLuint shader, int width) {
+Watertile::Watertile(vec4 pos, const ShaderProgram &shader, int width) {
 	tilePosition = pos;
-	lightpos = light;
 	waterShader = shader;
 	tileWidth = width;
 
-	viewpos = vec4(0.0, 10.0, 50.0, 0.0);
-	screenDimension = vec2(640, 480);
-	watercolor = vec4(0.0, 0.3, 0.5, 1.0);
-	distortAmount = 0.001;
-	currentDistort = 1;
-
 	//init shader/buffers/textures
 	initialise();
 }
 
-Watertile::Watertile(vec4 pos, vec4 view, vec2 viewDimen, vec4 light, vec4 color, 
-	int width, float speed) {
+Watertile::Watertile(vec4 pos, int width) {
 	// set tile values
 	tilePosition = pos;
-	viewpos = view;
-	screenDimension = viewDimen;
-	lightpos = light;
-	watercolor = color;
 	tileWidth = width;
-	distortAmount = speed;
-	currentDistort = 1;
 
 	//init shader/buffers/textures
 	initialise();
@@ -68,27 +53,18 @@ void Watertile::initialise() {
 	// load in the shader program
 	initialiseShader();
 
-	// create the buffers for reflection and refraction
-	reflectionBuffer = createBuffer(reflectTexture, 0);
-	refractionBuffer = createBuffer(refractTexture, depthMap);
-
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// build the grids the water is drawn on, once for every tile
+	if (gridVao == 0) initialiseGrids();
 }
 
 void Watertile::initialiseTextures() {
 	// generate IDs for the textures
-	glGenTextures(1, &reflectTexture);
-	glGenTextures(1, &reflectTexture);
-	glGenTextures(1, &refractTexture);
-	glGenTextures(1, &depthMap);
 	glGenTextures(1, &normalMap);
 	glGenTextures(1, &dudvMap);
 
 	// load the normal map and dudv map
 	loadTexture("./work/res/textures/normal.png", normalMap);		
 	loadTexture("./work/res/textures/waterDUDV.png", dudvMap);
-
-
 }
 
 void Watertile::loadTexture(string texturePath, GLuint texture) {
@@ -104,194 +80,152 @@ void Watertile::loadTexture(string texturePath, GLuint texture) {
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	// fill texture with data from image
-	gluBuild2DMipmaps(GL_TEXTURE_2D, 3, tex.w, tex.h, tex.glFormat(), 
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, tex.w, tex.h, 0, tex.glFormat(), 
 		GL_UNSIGNED_BYTE, tex.dataPointer());
+	glGenerateMipmap(GL_TEXTURE_2D);
 }
 
 void Watertile::initialiseShader() {
-	if (waterShader == 0) {
-		waterShader = makeShaderProgramFromFile({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER },
+	if (waterShader.id() == 0) {
+		waterShader = ShaderProgram::fromFiles({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER },
 		{ "./work/res/shaders/waterShader.vert", "./work/res/shaders/waterShader.frag" });
 	}
+	// the texture units never change, so they are set once here rather than every draw
+	waterShader.use();
+	glUniform1i(waterShader.uniform("reflectionTexture"), 0);
+	glUniform1i(waterShader.uniform("refractionTexture"), 1);
+	glUniform1i(waterShader.uniform("normalMap"), 2);
+	glUniform1i(waterShader.uniform("dudvMap"), 3);
+	glUniform1i(waterShader.uniform("depthTexture"), 4);
+	glUniform1i(waterShader.uniform("displacementMap"), 6);
+	glUniform1i(waterShader.uniform("slopeMap"), 7);
+	glUniform1i(waterShader.uniform("waterLevelMap"), 8);
+	glUseProgram(0);
 }
 
-GLuint Watertile::createBuffer(GLuint texture, GLuint depthTexture) {
-	GLuint buffer = 0;
-	// generate buffer id and bind buffer
-	glGenFramebuffers(1, &buffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, buffer);
-
-	glBindTexture(GL_TEXTURE_2D, texture);
-	// create texture
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, screenDimension.x, screenDimension.y, 0, 
-		GL_RGB, GL_UNSIGNED_BYTE, 0);
-	// texture parameters
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	// depth for reflection
-	if (depthTexture == 0) {
-		GLuint depthrenderbuffer;
-		glGenRenderbuffers(1, &depthrenderbuffer);
-		glBindRenderbuffer(GL_RENDERBUFFER, depthrenderbuffer);
-		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, screenDimension.x, 
-			screenDimension.y);
-		// set depthRenderBuffer as the depth component of the buffer
-		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, 
-			depthrenderbuffer);
-	}
-	// depth for refraction
-	else {
-		glBindTexture(GL_TEXTURE_2D, depthTexture);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, screenDimension.x, 
-			screenDimension.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		// set depthTexture as the depth component of the buffer
-		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
-	}
-	// set texture as the color component of the buffer
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
-	// add draw buiffers
-	GLenum DrawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
-	glDrawBuffers(1, DrawBuffers);
-
-	GLenum err;
-	if ((err = glCheckFramebufferStatus(GL_FRAMEBUFFER)) != GL_FRAMEBUFFER_COMPLETE) {
-		cout << err << " ERROR YO" << endl;
+void Watertile::initialiseGrids() {
+	// vertex positions come from gl_VertexID, so only indices are stored
+	vector<GLushort> indices;
+	for (int lod = 0; lod < LOD_COUNT; lod++) {
+		int quads = FINEST_QUADS >> lod;
+		lodOffsets[lod] = int(indices.size());
+		for (int z = 0; z < quads; z++) {
+			for (int x = 0; x < quads; x++) {
+				GLushort corner = GLushort(z * (quads + 1) + x);
+				GLushort below = GLushort(corner + quads + 1);
+				indices.insert(indices.end(), { corner, below, GLushort(corner + 1), GLushort(corner + 1), below, GLushort(below + 1) });
+			}
+		}
+		lodCounts[lod] = int(indices.size()) - lodOffsets[lod];
 	}
 
-	return buffer;
+	glGenVertexArrays(1, &gridVao);
+	glGenBuffers(1, &gridIndices);
+	glBindVertexArray(gridVao);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gridIndices);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// Level from the nearest point of a tile's bounds to the eye. Each level's
+// range is double the last, and anything past the last range gets the
+// coarsest.
+int Watertile::pickLod(const AABB &bounds, const vec3 &eye, float &range) {
+	float dx = max(0.0f, max(bounds.min.x - eye.x, eye.x - bounds.max.x));
+	float dy = max(0.0f, max(bounds.min.y - eye.y, eye.y - bounds.max.y));
+	float dz = max(0.0f, max(bounds.min.z - eye.z, eye.z - bounds.max.z));
+	float distance = sqrt(dx * dx + dy * dy + dz * dz);
+
+	range = tileWidth * 2.0f;
+	int lod = 0;
+	while (lod < LOD_COUNT - 1 && distance >= range) {
+		range *= 2;
+		lod++;
+	}
+	return lod;
 }
 
-void Watertile::renderWater() {
+void Watertile::renderWater(const RenderTarget &reflection, const RenderTarget &refraction, const Ocean &ocean, const ShallowWater &water, const vec3 &eye) {
 	// enable flags
 	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_LIGHTING);
-	glEnable(GL_NORMALIZE);
-	//glShadeModel(GL_SMOOTH);
-	// use the water shader
-	glUseProgram(waterShader);
-	// set up all the uniform values
-	glUniform1i(glGetUniformLocation(waterShader, "reflectionTexture"), 0);
-	glUniform1i(glGetUniformLocation(waterShader, "refractionTexture"), 1);
-	glUniform1i(glGetUniformLocation(waterShader, "normalMap"), 2);
-	glUniform1i(glGetUniformLocation(waterShader, "dudvMap"), 3);
-	glUniform1i(glGetUniformLocation(waterShader, "depthTexture"), 4);
-	glUniform4f(glGetUniformLocation(waterShader, "viewpos"), viewpos.x, viewpos.y, viewpos.z, viewpos.w);
-	glUniform4f(glGetUniformLocation(waterShader, "lightpos"), lightpos.x, lightpos.y, lightpos.z, lightpos.w);
-	glUniform1f(glGetUniformLocation(waterShader, "distort"), currentDistort);
-	glUniform1f(glGetUniformLocation(waterShader, "invDistort"), -currentDistort);
-	glUniform4f(glGetUniformLocation(waterShader, "waterColor"), watercolor.r, watercolor.g, watercolor.b, watercolor.a);
-	// increment the distortion
-	currentDistort += distortAmount;
+	// use the water shader, camera/light/distortion come from the FrameConstants block
+	waterShader.use();
 
 	// reflection texture in texture0
 	glActiveTexture(GL_TEXTURE0);
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, reflectTexture);
+	glBindTexture(GL_TEXTURE_2D, reflection.getColorTexture());
 	// refraction texture in texture1
 	glActiveTexture(GL_TEXTURE1);
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, refractTexture);
+	glBindTexture(GL_TEXTURE_2D, refraction.getColorTexture());
 	// normal in texture2
 	glActiveTexture(GL_TEXTURE2);
-	glEnable(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, normalMap);
 	// dudv in texture3
 	glActiveTexture(GL_TEXTURE3);
-	glEnable(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, dudvMap);
 	// depth in texutre4
 	glActiveTexture(GL_TEXTURE4);
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, depthMap);
-
+	glBindTexture(GL_TEXTURE_2D, refraction.getDepthTexture());
+	glActiveTexture(GL_TEXTURE0);
+	// displacement and slopes in texture6 and texture7
+	ocean.bind(waterShader, 6);
+	// water surface in texture8
+	water.bind(waterShader, 8);
+
+	// the last level has nothing coarser to morph to, so never starts
+	AABB bounds = getBounds();
+	float range;
+	int lod = pickLod(bounds, eye, range);
+
+	// a border shared with a coarser tile is fully morphed onto its grid and
+	// one shared with a finer tile isn't morphed at all, so the two meet
+	// without cracks. Tiles of the same level morph their border alike.
+	float across[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	float edgeMorph[4];
+	for (int i = 0; i < 4; i++) {
+		vec3 offset = vec3(across[i][0], 0.0f, across[i][1]) * float(tileWidth);
+		float neighbourRange;
+		int neighbour = pickLod(AABB(bounds.min + offset, bounds.max + offset), eye, neighbourRange);
+		edgeMorph[i] = neighbour > lod ? 1.0f : neighbour < lod ? 0.0f : -1.0f;
+	}
 	float hWidth = float(tileWidth) / 2.0f;
-	
-	// draw the water quad 
-	glBegin(GL_QUADS);
-	glNormal3f(0.0, 1.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE0, 0.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE1, 0.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE2, 0.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE3, 0.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE4, 0.0, 0.0);
-	glVertex3f(tilePosition.x - hWidth, tilePosition.y, tilePosition.z - hWidth);	// top left
-	glMultiTexCoord2f(GL_TEXTURE0, 0.0, 1.0);
-	glMultiTexCoord2f(GL_TEXTURE1, 0.0, 1.0);
-	glMultiTexCoord2f(GL_TEXTURE2, 0.0, 1.0);
-	glMultiTexCoord2f(GL_TEXTURE3, 0.0, 1.0);
-	glMultiTexCoord2f(GL_TEXTURE4, 0.0, 1.0);
-	glVertex3f(tilePosition.x - hWidth, tilePosition.y, tilePosition.z + hWidth);	// bottom left
-	glMultiTexCoord2f(GL_TEXTURE0, 1.0, 1.0);
-	glMultiTexCoord2f(GL_TEXTURE1, 1.0, 1.0);
-	glMultiTexCoord2f(GL_TEXTURE2, 1.0, 1.0);
-	glMultiTexCoord2f(GL_TEXTURE3, 1.0, 1.0);
-	glMultiTexCoord2f(GL_TEXTURE4, 1.0, 1.0);
-	glVertex3f(tilePosition.x + hWidth, tilePosition.y, tilePosition.z + hWidth);	// bottom right
-	glMultiTexCoord2f(GL_TEXTURE0, 1.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE1, 1.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE2, 1.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE3, 1.0, 0.0);
-	glMultiTexCoord2f(GL_TEXTURE4, 1.0, 0.0);
-	glVertex3f(tilePosition.x + hWidth, tilePosition.y, tilePosition.z - hWidth);	// top right
-	glEnd();
-	glFlush();
-
-	glDisable(GL_TEXTURE_2D);
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_LIGHTING);
-	glDisable(GL_NORMALIZE);
+	glUniform3f(waterShader.uniform("tileOrigin"), tilePosition.x - hWidth, tilePosition.y, tilePosition.z - hWidth);
+	glUniform1f(waterShader.uniform("tileSize"), float(tileWidth));
+	glUniform1f(waterShader.uniform("gridQuads"), float(FINEST_QUADS >> lod));
+	glUniform1f(waterShader.uniform("lodRange"), lod == LOD_COUNT - 1 ? 1e30f : range);
+	glUniform4f(waterShader.uniform("edgeMorph"), edgeMorph[0], edgeMorph[1], edgeMorph[2], edgeMorph[3]);
 
-	glUseProgram(0);
-}
+	// draw the water grid
+	glBindVertexArray(gridVao);
+	glDrawElements(GL_TRIANGLES, lodCounts[lod], GL_UNSIGNED_SHORT, (void *)(lodOffsets[lod] * sizeof(GLushort)));
+	glBindVertexArray(0);
 
-// getters
+	glDisable(GL_DEPTH_TEST);
 
-GLuint Watertile::getReflectionBuffer() {
-	return reflectionBuffer;
+	glUseProgram(0);
 }
 
-GLuint Watertile::getRefractionBuffer() {
-	return refractionBuffer;
+// the bounds are padded by this, so waves aren't culled
+void Watertile::setWaveHeight(float height) {
+	waveHeight = height;
 }
 
-GLuint Watertile::getReflectionTexture() {
-	return reflectTexture;
+// flooding raises the water above the tile, so the bounds are raised too
+void Watertile::setSurfaceTop(float top) {
+	surfaceTop = top;
 }
 
-GLuint Watertile::getRefractionTexture() {
-	return refractTexture;
-}
+// getters
 
 vec4 Watertile::getWaterPosition() {
 	return tilePosition;
 }
 
-
-
-//setters
-
-void Watertile::setLightPos(vec4 newPos) {
-	lightpos = newPos;
-}
-
-void Watertile::setCameraPos(vec4 newPos) {
-	viewpos = newPos;
-}
-
-void Watertile::setDistortAmount(float newSpeed) {
-	distortAmount = newSpeed;
-}
-
-void Watertile::setWaterColor(vec4 newColor) {
-	watercolor = newColor;
-}
-
-void Watertile::setReflectionBuffer(GLuint newBuffer) {
-	reflectionBuffer = newBuffer;
-}
+AABB Watertile::getBounds() {
+	float hWidth = float(tileWidth) / 2.0f + waveHeight;
+	vec3 centre = vec3(tilePosition.x, tilePosition.y, tilePosition.z);
+	float top = max(tilePosition.y, surfaceTop) + waveHeight;
+	return AABB(centre - vec3(hWidth, waveHeight, hWidth), vec3(centre.x + hWidth, top, centre.z + hWidth));
+}
\ No newline at end of file
@@ -6,75 +6,68 @@
 #include <vector>
 
 #include "cgra_math.hpp"
+#include "frustum.hpp"
+#include "ocean.hpp"
 #include "opengl.hpp"
+#include "render_target.hpp"
+#include "shader_program.hpp"
+#include "shallow_water.hpp"
 
+// A square of water, drawn as a grid lifted to the shallow water's
+// surface and displaced by the FFT ocean where it is deep enough. Every
+// tile shares one set of grids, each level half as fine as the last, and
+// picks its level by how far it is from the camera. Vertices on odd grid
+// lines slide onto the next coarser grid as they near the end of their
+// level's range, so levels meet without popping. A border with a coarser
+// neighbour is always morphed onto its grid, so the seams don't crack.
 class Watertile {
 private:
+	static const int LOD_COUNT = 4;
+	// quads along each side of the finest grid
+	static const int FINEST_QUADS = 64;
+
+	// grids shared by every tile, all levels in one index buffer
+	static GLuint gridVao;
+	static GLuint gridIndices;
+	static int lodOffsets[LOD_COUNT];
+	static int lodCounts[LOD_COUNT];
+
 	// width of tile
 	int tileWidth;
 	// tile position
 	cgra::vec4 tilePosition;
+	// highest the waves reach above and below the tile
+	float waveHeight = 0;
+	// highest the water's surface is, flooded
+	float surfaceTop = 0;
 
-	// camera position
-	cgra::vec4 viewpos;
-	// Dimensions of the viewPort
-	cgra::vec2 screenDimension;
-	// light position
-	cgra::vec4 lightpos;
-	// color of the water
-	cgra::vec4 watercolor;
-	// amount the distortion moves across the water tile
-	float distortAmount;
-	//currentDistortion
-	float currentDistort;
-
-	// reflection texture id
-	GLuint reflectTexture;
-	// refraction texture id
-	GLuint refractTexture;
 	// normal map id
 	GLuint normalMap;
 	// dudv map id
 	GLuint dudvMap;
-	// refraction depth map id
-	GLuint depthMap;
 
-	// reflection buffer id
-	GLuint reflectionBuffer;
-	// refraction buffer id
-	GLuint refractionBuffer;
-	
-	// shader program id
-	GLuint waterShader;
+	// shader program
+	ShaderProgram waterShader;
 
-	GLuint createBuffer(GLuint, GLuint);
 	void initialise();
 	void initialiseTextures();
 	void loadTexture(std::string, GLuint);
 	void initialiseShader();
+	void initialiseGrids();
+	int pickLod(const AABB &, const cgra::vec3 &eye, float &range);
 
 public:
 	Watertile();
-	Watertile(cgra::vec4, cgra::vec4, GLuint, int);
-
-	// pos,view,screen,light,color,width,height,distort
-	Watertile(cgra::vec4, cgra::vec4, cgra::vec2, cgra::vec4, cgra::vec4,
-		int width = 10, float speed = 0.001);
+	Watertile(cgra::vec4, const ShaderProgram &, int);
 
-	void renderWater();
+	// pos,width
+	Watertile(cgra::vec4, int width = 10);
 
-	GLuint getReflectionBuffer();
-	GLuint getRefractionBuffer();
-
-	GLuint getReflectionTexture();
-	GLuint getRefractionTexture();
+	// reflection and refraction are shared by every tile on the same plane
+	void renderWater(const RenderTarget &, const RenderTarget &, const Ocean &, const ShallowWater &, const cgra::vec3 &eye);
 
+	void setWaveHeight(float);
+	void setSurfaceTop(float);
 	cgra::vec4 getWaterPosition();
-
-	void setLightPos(cgra::vec4);
-	void setCameraPos(cgra::vec4);
-	void setWaterColor(cgra::vec4);
-	void setDistortAmount(float);
-
-	void setReflectionBuffer(GLuint);
+	AABB getBounds();
 };
\ No newline at end of file